@@ -0,0 +1,102 @@
+#include "staticrecompiler.h"
+#include <cstdlib>
+#include <exception>
+#include <fmt/core.h>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+// Ahead of time recompiler: turns a PS-X EXE or raw binary into a C++ file
+// that registers its functions with a Meeps::StaticProgram
+
+using namespace Meeps;
+
+static void PrintUsage() {
+  fmt::print("Usage: MeepsAOT <input> <output.cpp> [options]\n"
+             "  --raw <base> <entry>  Input is a raw binary loaded at base\n"
+             "  --entry <address>     Extra function entry point, repeatable\n"
+             "  --name <name>         Registration function name "
+             "(default RegisterProgram)\n"
+             "  --memory <policy>     Memory policy the code is built for "
+             "(default PointerMemory)\n");
+}
+
+static uint32_t ParseAddress(const std::string &text) {
+  size_t end;
+  const unsigned long value = std::stoul(text, &end, 0);
+  if (end != text.size() || value > 0xffff'ffff) {
+    throw std::invalid_argument("[Static Recompiler] Invalid address " + text);
+  }
+  return (uint32_t)value;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    PrintUsage();
+    return EXIT_FAILURE;
+  }
+
+  try {
+    const std::string input = argv[1];
+    const std::string output = argv[2];
+    bool raw = false;
+    uint32_t base = 0;
+    uint32_t entry = 0;
+    std::vector<uint32_t> entries;
+    std::string name = "RegisterProgram";
+    std::string memory = "PointerMemory";
+
+    for (int i = 3; i < argc; i++) {
+      const std::string option = argv[i];
+      const int left = argc - i - 1;
+      if (option == "--raw" && left >= 2) {
+        raw = true;
+        base = ParseAddress(argv[++i]);
+        entry = ParseAddress(argv[++i]);
+      } else if (option == "--entry" && left >= 1) {
+        entries.push_back(ParseAddress(argv[++i]));
+      } else if (option == "--name" && left >= 1) {
+        name = argv[++i];
+      } else if (option == "--memory" && left >= 1) {
+        memory = argv[++i];
+      } else {
+        PrintUsage();
+        return EXIT_FAILURE;
+      }
+    }
+
+    std::ifstream file(input, std::ios::binary);
+    if (!file) {
+      throw std::runtime_error("[Static Recompiler] Can't open " + input);
+    }
+    std::vector<uint8_t> bytes((std::istreambuf_iterator<char>(file)),
+                               std::istreambuf_iterator<char>());
+
+    GuestImage image;
+    if (raw) {
+      image.base = base;
+      image.entry = entry;
+      image.data = std::move(bytes);
+    } else {
+      image = GuestImage::FromPSXExe(bytes);
+    }
+
+    StaticRecompiler recompiler(std::move(image));
+    recompiler.Analyze(entries);
+
+    std::ofstream out(output);
+    out << recompiler.Emit(name, memory);
+    if (!out) {
+      throw std::runtime_error("[Static Recompiler] Can't write " + output);
+    }
+
+    fmt::print("Recompiled {} functions into {}\n",
+               recompiler.GetFunctions().size(), output);
+  } catch (const std::exception &e) {
+    fmt::print(stderr, "{}\n", e.what());
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
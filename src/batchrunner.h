@@ -0,0 +1,263 @@
+#pragma once
+#include "cop0.h"
+#include "memory.h"
+#include "r3000.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#endif
+
+namespace Meeps {
+
+// Runs many independent guests in parallel. Each instance owns its CPU, COP0
+// and memory, and Run hands out time slices of CPU::Run over a pool of worker
+// threads. Workers keep a queue of instances each and steal from each other
+// once theirs runs dry, so uneven guests still keep every core busy.
+template <MemoryPolicy Memory = PointerMemory> class BatchRunner {
+public:
+  struct Instance {
+    std::unique_ptr<COP0> cop0;
+    std::shared_ptr<void> memory; // Whatever backs the CPU's memory
+    std::unique_ptr<CPU<Memory>> cpu;
+
+    uint64_t cycles = 0;      // Left to run in the current batch
+    std::exception_ptr error; // Set if CPU::Run threw, which stops it
+    StopReason stopped = StopReason::None; // Set if the CPU stopped, same
+  };
+
+  // Creates instance index's COP0 and memory and builds its CPU with them
+  using Factory = std::function<void(size_t index, Instance &instance)>;
+
+  // Called after every slice, returning true stops the instance early. Runs
+  // on the worker threads, so it may only touch the instance it is given.
+  using StopCondition = std::function<bool(size_t index, Instance &instance)>;
+
+  struct Options {
+    size_t threads = std::max(std::thread::hardware_concurrency(), 1u);
+    int sliceCycles = 10000;
+    bool pinThreads = true; // Worker i runs on core i % core count
+  };
+
+  BatchRunner(size_t count, const Factory &factory)
+      : BatchRunner(count, factory, Options{}) {}
+
+  BatchRunner(size_t count, const Factory &factory, Options options)
+      : options(options) {
+    if (!options.threads || options.sliceCycles <= 0) {
+      throw std::invalid_argument("[Batch Runner] Invalid options");
+    }
+
+    instances.resize(count);
+    for (size_t i = 0; i < count; i++) {
+      factory(i, instances[i]);
+      if (!instances[i].cpu) {
+        throw std::invalid_argument("[Batch Runner] Factory built no CPU");
+      }
+    }
+
+    for (size_t i = 0; i < options.threads; i++) {
+      workers.push_back(std::make_unique<Worker>());
+    }
+    for (size_t i = 0; i < options.threads; i++) {
+      workers[i]->thread = std::thread([this, i] { WorkerLoop(i); });
+      if (options.pinThreads) {
+        Pin(*workers[i], i);
+      }
+    }
+  }
+
+  ~BatchRunner() {
+    {
+      std::lock_guard lock(mutex);
+      quit = true;
+    }
+    wake.notify_all();
+    for (auto &worker : workers) {
+      worker->thread.join();
+    }
+  }
+
+  BatchRunner(const BatchRunner &) = delete;
+  BatchRunner &operator=(const BatchRunner &) = delete;
+
+  // Runs every instance for cycles, or until stop returns true for it, and
+  // returns once all of them are done. Instances that threw keep the
+  // exception in Instance::error, and ones whose CPU stopped keep the reason
+  // in Instance::stopped.
+  void Run(uint64_t cycles, const StopCondition &stop = {}) {
+    if (instances.empty() || !cycles) {
+      return;
+    }
+
+    for (size_t i = 0; i < instances.size(); i++) {
+      instances[i].cycles = cycles;
+      instances[i].error = nullptr;
+      instances[i].stopped = StopReason::None;
+      Worker &worker = *workers[i % workers.size()];
+      std::lock_guard lock(worker.mutex);
+      worker.queue.push_back(i);
+    }
+
+    std::unique_lock lock(mutex);
+    this->stop = &stop;
+    pending = instances.size();
+    batch++;
+    wake.notify_all();
+    idle.wait(lock, [this] { return !pending && !busy; });
+    this->stop = nullptr;
+  }
+
+  Instance &GetInstance(size_t index) { return instances[index]; }
+  CPU<Memory> &GetCPU(size_t index) { return *instances[index].cpu; }
+  size_t GetInstanceCount() const { return instances.size(); }
+
+private:
+  struct Worker {
+    std::mutex mutex;
+    std::deque<size_t> queue;
+    std::thread thread;
+  };
+
+  void WorkerLoop(size_t self) {
+    uint64_t seen = 0;
+    while (true) {
+      {
+        std::unique_lock lock(mutex);
+        wake.wait(lock, [&] { return quit || batch != seen; });
+        if (quit) {
+          return;
+        }
+        seen = batch;
+        busy++;
+      }
+
+      while (pending.load()) {
+        // Read before looking, so a requeue in between isn't slept through
+        const uint64_t ticket = requeued.load();
+        size_t index;
+        if (!Pop(self, index) && !Steal(self, index)) {
+          // Everything left is being run by other workers
+          std::unique_lock lock(mutex);
+          work.wait(lock, [&] { return !pending || requeued != ticket; });
+          continue;
+        }
+
+        if (RunSlice(index)) {
+          if (--pending == 0) {
+            std::lock_guard lock(mutex);
+            work.notify_all();
+          }
+        } else {
+          {
+            std::lock_guard lock(workers[self]->mutex);
+            workers[self]->queue.push_back(index);
+          }
+          requeued++;
+          std::lock_guard lock(mutex);
+          work.notify_one();
+        }
+      }
+
+      {
+        std::lock_guard lock(mutex);
+        busy--;
+      }
+      idle.notify_all();
+    }
+  }
+
+  // Returns true once the instance is done for this batch
+  bool RunSlice(size_t index) {
+    Instance &instance = instances[index];
+    const int slice =
+        (int)std::min<uint64_t>(instance.cycles, options.sliceCycles);
+
+    try {
+      const RunStatus status = instance.cpu->Run(slice);
+      instance.cycles -= status.cycles;
+      instance.stopped = status.reason;
+    } catch (...) {
+      instance.error = std::current_exception();
+      return true;
+    }
+    if (instance.stopped != StopReason::None) {
+      return true;
+    }
+
+    return !instance.cycles || (*stop && (*stop)(index, instance));
+  }
+
+  bool Pop(size_t self, size_t &index) {
+    Worker &worker = *workers[self];
+    std::lock_guard lock(worker.mutex);
+    if (worker.queue.empty()) {
+      return false;
+    }
+    index = worker.queue.front();
+    worker.queue.pop_front();
+    return true;
+  }
+
+  // Takes from the back of the other queues, away from where their owners pop
+  bool Steal(size_t self, size_t &index) {
+    for (size_t i = 1; i < workers.size(); i++) {
+      Worker &victim = *workers[(self + i) % workers.size()];
+      std::lock_guard lock(victim.mutex);
+      if (!victim.queue.empty()) {
+        index = victim.queue.back();
+        victim.queue.pop_back();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  static void Pin(Worker &worker, size_t index) {
+    const size_t cores = std::max(std::thread::hardware_concurrency(), 1u);
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(index % cores, &set);
+    pthread_setaffinity_np(worker.thread.native_handle(), sizeof(set), &set);
+#elif defined(_WIN32)
+    SetThreadAffinityMask(worker.thread.native_handle(),
+                          DWORD_PTR(1) << (index % cores % 64));
+#else
+    (void)worker;
+    (void)index;
+    (void)cores;
+#endif
+  }
+
+  Options options;
+  std::vector<Instance> instances;
+  std::vector<std::unique_ptr<Worker>> workers;
+
+  std::mutex mutex;
+  std::condition_variable wake; // New batch or shutdown
+  std::condition_variable idle; // A worker finished its batch
+  std::condition_variable work; // An instance was requeued, or all are done
+  uint64_t batch = 0;
+  size_t busy = 0;
+  bool quit = false;
+  std::atomic<size_t> pending = 0;
+  std::atomic<uint64_t> requeued = 0;
+  const StopCondition *stop = nullptr;
+};
+
+} // namespace Meeps
@@ -0,0 +1,251 @@
+#pragma once
+#include "r3000interpreter.h"
+#include "trace.h"
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace Meeps {
+
+// Cache of translated guest blocks shared by the cached interpreter and the
+// recompiler. Payload is whatever a backend needs to execute a block.
+//
+// Every block records where it can go next: the jump/branch target and the
+// fall-through for direct control flow, and the last seen target for JR/JALR.
+// Once a successor has been looked up it is linked in by pointer, so hot
+// loops go from block to block without hashing the PC. Removing a block
+// unlinks it from every block that points at it.
+//
+// A block can also be a trace of several basic blocks (see trace.h), which
+// is keyed by its first part and only links up the exits of its last one.
+template <class Payload> class BlockCache {
+public:
+  struct Block;
+
+  struct Exit {
+    uint32_t target = 0;
+    Block *block = nullptr;
+  };
+
+  struct Block {
+    uint32_t start;
+    uint32_t size; // In guest instructions
+    Payload payload;
+
+    // Guest code the block was built from, as [begin, end) address pairs.
+    // Only traces have more than one.
+    std::vector<std::pair<uint32_t, uint32_t>> ranges;
+
+    std::array<Exit, 2> exits{}; // Taken/jump target and fall-through
+    size_t exitCount = 0;
+    bool indirect = false; // Ends in JR/JALR, exits[0] caches the last target
+    bool idle = false;     // Spins without side effects, see IR::IsIdleLoop
+
+    // One entry per link pointing at this block
+    std::vector<Block *> predecessors;
+  };
+
+  Block *Find(uint32_t pc) {
+    auto it = blocks.find(pc);
+    return it != blocks.end() ? &it->second : nullptr;
+  }
+
+  // instrs are the guest instructions the payload was built from, of which
+  // the first size are part of the block
+  Block &Insert(uint32_t pc, const std::vector<Instruction> &instrs,
+                uint32_t size, Payload &&payload) {
+    Block &block = Emplace(pc, size, std::move(payload));
+    block.ranges.emplace_back(pc, pc + size * 4);
+    SetExits(block, pc, instrs, size);
+    return block;
+  }
+
+  // Inserts a block built from trace, keyed by the start of its first part
+  Block &InsertTrace(const Trace &trace, Payload &&payload) {
+    uint32_t size = 0;
+    for (const TracePart &part : trace) {
+      size += (uint32_t)part.instrs.size();
+    }
+
+    Block &block = Emplace(trace.front().pc, size, std::move(payload));
+    for (const TracePart &part : trace) {
+      block.ranges.emplace_back(part.pc, part.pc + part.instrs.size() * 4);
+    }
+
+    const TracePart &last = trace.back();
+    SetExits(block, last.pc, last.instrs, (uint32_t)last.instrs.size());
+    return block;
+  }
+
+  // The block linked for control leaving from at pc, or nullptr if it hasn't
+  // been linked yet
+  static Block *Follow(const Block &from, uint32_t pc) {
+    for (size_t i = 0; i < from.exitCount; i++) {
+      if (from.exits[i].target == pc) {
+        return from.exits[i].block;
+      }
+    }
+    return nullptr;
+  }
+
+  // Links the exit of from leading to to.start. For indirect jumps this
+  // replaces the previously cached target.
+  void Link(Block &from, Block &to) {
+    if (from.indirect) {
+      Unlink(from, from.exits[0]);
+      from.exits[0].target = to.start;
+      from.exitCount = 1;
+    }
+
+    for (size_t i = 0; i < from.exitCount; i++) {
+      Exit &link = from.exits[i];
+      if (link.target == to.start && !link.block) {
+        link.block = &to;
+        to.predecessors.push_back(&from);
+      }
+    }
+  }
+
+  // Removes every block overlapping [addr, addr + size). Block addresses are
+  // masked first, so 0x1fff'ffff finds them in every segment.
+  void Invalidate(uint32_t addr, uint32_t size, uint32_t mask = 0xffff'ffff) {
+    const uint64_t end = uint64_t(addr) + size;
+    for (auto it = blocks.begin(); it != blocks.end();) {
+      Block &block = it->second;
+      const bool overlaps =
+          std::any_of(block.ranges.begin(), block.ranges.end(),
+                      [&](const auto &range) {
+                        const uint32_t begin = range.first & mask;
+                        return begin < end &&
+                               addr < uint64_t(begin) + (range.second -
+                                                         range.first);
+                      });
+      if (!overlaps) {
+        ++it;
+        continue;
+      }
+
+      Remove(block);
+      it = blocks.erase(it);
+      generation++;
+    }
+  }
+
+  void Clear() {
+    blocks.clear();
+    generation++;
+  }
+
+  // Flags the code a block was built from in state, so stores to it are
+  // caught by State::CheckCodeWrite
+  static void MarkCode(State &state, const Block &block) {
+    for (const auto &range : block.ranges) {
+      state.MarkCode(range.first, range.second);
+    }
+  }
+
+  // Removes the blocks overlapping the code stores queued up in state, or
+  // all of them if too many were written to
+  void InvalidateWritten(State &state) {
+    if (state.writtenCodeCount > state.writtenCode.size()) {
+      Clear();
+      state.ClearCodePages();
+      return;
+    }
+    for (uint32_t i = 0; i < state.writtenCodeCount; i++) {
+      const auto [addr, size] = state.writtenCode[i];
+      Invalidate(addr, size, 0x1fff'ffff);
+    }
+    state.writtenCodeCount = 0;
+  }
+
+  // Changes whenever blocks are removed, so callers holding a Block pointer
+  // across a compile (which may clear the cache) can tell it went stale
+  uint64_t GetGeneration() const { return generation; }
+
+  size_t GetBlockCount() const { return blocks.size(); }
+
+private:
+  using Interpreter = R3000Interpreter<>;
+
+  Block &Emplace(uint32_t pc, uint32_t size, Payload &&payload) {
+    Block &block = blocks
+                       .emplace(std::piecewise_construct,
+                                std::forward_as_tuple(pc), std::tuple<>())
+                       .first->second;
+    block.start = pc;
+    block.size = size;
+    block.payload = std::move(payload);
+    return block;
+  }
+
+  // Sets up the exits of a block whose last size instructions are the first
+  // size of instrs, fetched at pc
+  static void SetExits(Block &block, uint32_t pc,
+                       const std::vector<Instruction> &instrs, uint32_t size) {
+    const uint32_t end = pc + size * 4;
+
+    // Ends right on a jump/branch, the delay slot is stepped so no exits
+    if (!size || Interpreter::IsControlTransfer(instrs[size - 1])) {
+      return;
+    }
+
+    if (size < 2 || !Interpreter::IsControlTransfer(instrs[size - 2])) {
+      block.exits[block.exitCount++].target = end;
+      return;
+    }
+
+    const Instruction instr = instrs[size - 2];
+    const uint32_t addr = end - 8;
+    switch (instr.i.op) {
+    case 0b00'0000: // JR, JALR
+      block.indirect = true;
+      break;
+    case 0b00'0010: // J
+    case 0b00'0011: // JAL
+      block.exits[block.exitCount++].target =
+          ((addr + 4) & 0xf000'0000) + (instr.j.target << 2);
+      break;
+    default: // Branches
+      block.exits[block.exitCount++].target =
+          addr + 4 + (uint32_t)(int32_t)(int16_t)instr.i.imm * 4;
+      block.exits[block.exitCount++].target = end;
+      break;
+    }
+  }
+
+  static void Unlink(Block &from, Exit &link) {
+    if (!link.block) {
+      return;
+    }
+    auto &preds = link.block->predecessors;
+    preds.erase(std::find(preds.begin(), preds.end(), &from));
+    link.block = nullptr;
+  }
+
+  static void Remove(Block &block) {
+    for (size_t i = 0; i < block.exitCount; i++) {
+      if (block.exits[i].block != &block) {
+        Unlink(block, block.exits[i]);
+      }
+    }
+
+    for (Block *pred : block.predecessors) {
+      for (size_t i = 0; i < pred->exitCount; i++) {
+        if (pred->exits[i].block == &block) {
+          pred->exits[i].block = nullptr;
+        }
+      }
+    }
+  }
+
+  // Node based, so Block pointers stay valid as the cache grows
+  std::unordered_map<uint32_t, Block> blocks;
+  uint64_t generation = 0;
+};
+
+} // namespace Meeps
@@ -1,4 +1,5 @@
 #pragma once
+#include <cstdint>
 
 #ifndef NDEBUG
 #define DPRINT(f_, ...) fmt::print((f_), __VA_ARGS__)
@@ -6,10 +7,43 @@
 #define DPRINT(f_, ...)
 #endif
 
+#if defined(__x86_64__) || defined(_M_X64)
+#define MEEPS_X64
+#endif
+
+#if defined(MEEPS_X64) && defined(__linux__)
+#define MEEPS_FASTMEM
+#endif
+
+// GCC and Clang support labels as values, used for threaded dispatch
+#if defined(__GNUC__) && !defined(MEEPS_NO_COMPUTED_GOTO)
+#define MEEPS_COMPUTED_GOTO
+#endif
+
 namespace Meeps {
 // https://stackoverflow.com/questions/15181579/c-most-efficient-way-to-compare-a-variable-to-multiple-values
 template <typename First, typename... T>
 constexpr bool ValueIsIn(First &&first, T &&...t) {
   return ((first == t) || ...);
 }
+
+// Wrapping signed add/subtract that also report overflow, which GCC and Clang
+// compile down to a check of the host's overflow flag
+inline bool AddOverflows(int32_t a, int32_t b, int32_t &result) {
+#if defined(__GNUC__)
+  return __builtin_add_overflow(a, b, &result);
+#else
+  result = (int32_t)((uint32_t)a + (uint32_t)b);
+  return ((a ^ result) & (b ^ result)) < 0;
+#endif
+}
+
+inline bool SubOverflows(int32_t a, int32_t b, int32_t &result) {
+#if defined(__GNUC__)
+  return __builtin_sub_overflow(a, b, &result);
+#else
+  result = (int32_t)((uint32_t)a - (uint32_t)b);
+  return ((a ^ b) & (a ^ result)) < 0;
+#endif
+}
 } // namespace Meeps
\ No newline at end of file
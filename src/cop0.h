@@ -2,8 +2,30 @@
 #include "types.h"
 
 namespace Meeps {
+// Cause.ExcCode of the exceptions the CPU delivers itself
+enum class ExceptionCode : uint32_t {
+    Interrupt = 0,
+    AddressErrorLoad = 4,
+    AddressErrorStore = 5,
+    Syscall = 8,
+    Break = 9,
+    ReservedInstruction = 10,
+    Overflow = 12,
+};
+
+// A COP0 of the embedder's, used instead of the built-in SystemControl. Cache
+// isolation (SR.IsC) is honoured through a mirror of SR, see
+// State::MirrorSR.
 class COP0 {
 public:
+    // Registers written on exception entry and by RFE
+    static constexpr size_t BadVaddr = 8;
+    static constexpr size_t SR = 12;
+    static constexpr size_t Cause = 13;
+    static constexpr size_t EPC = 14;
+
+    virtual ~COP0() = default;
+
     virtual uint32_t GetReg(size_t reg) = 0;
     virtual void SetReg(size_t reg, uint32_t value) = 0;
 };
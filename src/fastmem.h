@@ -0,0 +1,344 @@
+#pragma once
+#include "common.h"
+
+#ifdef MEEPS_FASTMEM
+#include "memory.h"
+#include "state.h"
+#include <array>
+#include <atomic>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <vector>
+
+namespace Meeps {
+
+// Every fastmem access is one of these host instructions, with the arena base
+// in rsi, the guest address in rdi, the State pointer in rdx and the value in
+// eax. Pinning the encoding lets the SIGSEGV handler emulate a faulting access
+// without a general x86 decoder.
+struct FastmemAccess {
+  std::array<uint8_t, 4> bytes;
+  uint8_t length;
+  uint8_t size;
+  bool store;
+};
+
+// clang-format off
+inline constexpr std::array<FastmemAccess, 6> fastmemAccesses{{
+  {{0x0F, 0xB6, 0x04, 0x3E}, 4, 1, false}, // movzx eax, byte [rsi+rdi]
+  {{0x0F, 0xB7, 0x04, 0x3E}, 4, 2, false}, // movzx eax, word [rsi+rdi]
+  {{0x8B, 0x04, 0x3E},       3, 4, false}, // mov eax, [rsi+rdi]
+  {{0x88, 0x04, 0x3E},       3, 1, true},  // mov [rsi+rdi], al
+  {{0x66, 0x89, 0x04, 0x3E}, 4, 2, true},  // mov [rsi+rdi], ax
+  {{0x89, 0x04, 0x3E},       3, 4, true},  // mov [rsi+rdi], eax
+}};
+// clang-format on
+
+// Reserves the whole 32 bit guest address space in host virtual memory, so a
+// guest access is a single base + offset host access. RAM/ROM are mapped in
+// with their segment mirrors, everything else stays inaccessible and faults
+// into a SIGSEGV handler that performs the access through SlowMemory (IO
+// handlers in State::pageTable, then the callbacks) and resumes the guest.
+// IO handlers therefore run inside of a signal handler and must not throw.
+class FastmemArena {
+public:
+  // One extra page catches unaligned accesses at the very top
+  static constexpr size_t ArenaSize = (size_t(1) << 32) + 4096;
+
+  // What MapMemory made accessible, per guest page
+  enum PageAccess : uint8_t { Unmapped = 0, Readable = 1, Writable = 2 };
+
+  FastmemArena() {
+    void *mem = mmap(nullptr, ArenaSize, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED) {
+      throw std::runtime_error("[Fastmem] Failed to reserve address space");
+    }
+    base = (uint8_t *)mem;
+
+    InstallHandler();
+    if (!Register(base)) {
+      munmap(base, ArenaSize);
+      throw std::runtime_error("[Fastmem] Too many arenas");
+    }
+  }
+
+  ~FastmemArena() {
+    Unregister(base);
+    munmap(base, ArenaSize);
+  }
+
+  FastmemArena(const FastmemArena &) = delete;
+  FastmemArena &operator=(const FastmemArena &) = delete;
+
+  // Allocates size bytes of guest memory and maps them at addr, plus the
+  // KUSEG/KSEG0/KSEG1 mirrors like PageTable::MapMemory. Returns a host
+  // pointer to the memory for the embedder to fill.
+  uint8_t *MapMemory(uint32_t addr, uint32_t size, bool writable = true) {
+    if ((addr | size) & (PageTable::PageSize - 1)) {
+      throw std::invalid_argument("[Fastmem] Mappings must be page aligned");
+    }
+
+    const int fd = memfd_create("meeps-fastmem", MFD_CLOEXEC);
+    if (fd < 0) {
+      throw std::runtime_error("[Fastmem] Failed to allocate guest memory");
+    }
+    if (ftruncate(fd, size) != 0) {
+      close(fd);
+      throw std::runtime_error("[Fastmem] Failed to allocate guest memory");
+    }
+
+    // On failure the mirrors mapped so far go back to being reserved, so
+    // nothing is left half mapped
+    const int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+    uint8_t *host = nullptr;
+    std::array<uint32_t, 3> mapped;
+    size_t mappedCount = 0;
+    ForEachMirror(addr, [&](uint32_t mirror) {
+      void *view =
+          mmap(base + mirror, size, prot, MAP_SHARED | MAP_FIXED, fd, 0);
+      if (view == MAP_FAILED) {
+        close(fd);
+        for (size_t i = 0; i < mappedCount; i++) {
+          Reserve(mapped[i], size);
+        }
+        throw std::runtime_error("[Fastmem] Failed to map guest memory");
+      }
+      mapped[mappedCount++] = mirror;
+      host = host ? host : (uint8_t *)view;
+    });
+
+    const uint8_t access = writable ? Readable | Writable : Readable;
+    ForEachMirror(addr,
+                  [&](uint32_t mirror) { SetAccess(mirror, size, access); });
+
+    close(fd); // The mappings keep the memory alive
+    return host;
+  }
+
+  void Unmap(uint32_t addr, uint32_t size) {
+    ForEachMirror(addr, [&](uint32_t mirror) {
+      Reserve(mirror, size);
+      SetAccess(mirror, size, Unmapped);
+    });
+  }
+
+  // Points the State at this arena, required for CPU<FastmemMemory>
+  void Attach(State &state) {
+    state.fastmem = base;
+    state.fastmemPages = pages.data();
+  }
+
+  uint8_t *GetBase() const { return base; }
+
+private:
+  static constexpr size_t MaxArenas = 256;
+
+  // Replaces whatever is mapped at addr with inaccessible memory
+  void Reserve(uint32_t addr, uint32_t size) {
+    mmap(base + addr, size, PROT_NONE,
+         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+  }
+
+  void SetAccess(uint32_t addr, uint32_t size, uint8_t access) {
+    std::memset(&pages[addr >> PageTable::PageBits], access,
+                size >> PageTable::PageBits);
+  }
+
+  template <typename F> static void ForEachMirror(uint32_t addr, F &&fn) {
+    const uint32_t segment = addr >> 29;
+    if (segment == 0 || segment == 4 || segment == 5) {
+      const uint32_t physical = addr & 0x1fff'ffff;
+      fn(physical);
+      fn(physical | 0x8000'0000);
+      fn(physical | 0xa000'0000);
+    } else {
+      fn(addr);
+    }
+  }
+
+  static inline std::array<std::atomic<uint8_t *>, MaxArenas> arenas{};
+  static inline struct sigaction previousHandler {};
+
+  static bool Register(uint8_t *arena) {
+    for (auto &slot : arenas) {
+      uint8_t *expected = nullptr;
+      if (slot.compare_exchange_strong(expected, arena)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  static void Unregister(uint8_t *arena) {
+    for (auto &slot : arenas) {
+      uint8_t *expected = arena;
+      if (slot.compare_exchange_strong(expected, nullptr)) {
+        return;
+      }
+    }
+  }
+
+  static bool IsArena(uint8_t *arena) {
+    if (!arena) {
+      return false; // Unused slots are null
+    }
+    for (const auto &slot : arenas) {
+      if (slot.load(std::memory_order_relaxed) == arena) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  static void InstallHandler() {
+    static std::once_flag once;
+    std::call_once(once, [] {
+      struct sigaction action {};
+      action.sa_sigaction = &HandleFault;
+      action.sa_flags = SA_SIGINFO | SA_NODEFER;
+      sigemptyset(&action.sa_mask);
+      sigaction(SIGSEGV, &action, &previousHandler);
+    });
+  }
+
+  static void HandleFault(int sig, siginfo_t *info, void *raw) {
+    auto *context = (ucontext_t *)raw;
+    greg_t *regs = context->uc_mcontext.gregs;
+    const uint8_t *rip = (const uint8_t *)regs[REG_RIP];
+
+    // Only accesses faulting inside of the arena they're based on are ours,
+    // anything else is a genuine crash
+    uint8_t *arena = (uint8_t *)regs[REG_RSI];
+    const uint8_t *fault = (const uint8_t *)info->si_addr;
+    if (IsArena(arena) && fault >= arena && fault < arena + ArenaSize) {
+      for (const FastmemAccess &access : fastmemAccesses) {
+        if (std::memcmp(rip, access.bytes.data(), access.length) == 0) {
+          Emulate(access, regs);
+          regs[REG_RIP] += access.length;
+          return;
+        }
+      }
+    }
+
+    // Not a fastmem access, hand it to whoever was installed before us
+    if (previousHandler.sa_flags & SA_SIGINFO) {
+      previousHandler.sa_sigaction(sig, info, raw);
+    } else if (previousHandler.sa_handler == SIG_DFL) {
+      signal(sig, SIG_DFL); // Re-executing the access now crashes as usual
+    } else if (previousHandler.sa_handler != SIG_IGN) {
+      previousHandler.sa_handler(sig);
+    }
+  }
+
+  static void Emulate(const FastmemAccess &access, greg_t *regs) {
+    State &state = *(State *)regs[REG_RDX];
+    const uint32_t addr = (uint32_t)regs[REG_RDI];
+
+    if (access.store) {
+      const uint32_t value = (uint32_t)regs[REG_RAX];
+      switch (access.size) {
+      case 1:
+        SlowMemory::Write<uint8_t>(state, addr, value);
+        break;
+      case 2:
+        SlowMemory::Write<uint16_t>(state, addr, value);
+        break;
+      default:
+        SlowMemory::Write<uint32_t>(state, addr, value);
+        break;
+      }
+      return;
+    }
+
+    // Loads zero extend into the full register, same as the host instruction
+    switch (access.size) {
+    case 1:
+      regs[REG_RAX] = SlowMemory::Read<uint8_t>(state, addr);
+      break;
+    case 2:
+      regs[REG_RAX] = SlowMemory::Read<uint16_t>(state, addr);
+      break;
+    default:
+      regs[REG_RAX] = SlowMemory::Read<uint32_t>(state, addr);
+      break;
+    }
+  }
+
+  uint8_t *base;
+  std::vector<uint8_t> pages = std::vector<uint8_t>(PageTable::PageCount);
+};
+
+// Memory policy for a State attached to a FastmemArena. The inline assembly
+// pins the operands to the registers FastmemArena's fault handler expects.
+struct FastmemMemory {
+  static uint8_t Read8(State &state, uint32_t addr) {
+    uint32_t value;
+    __asm__ __volatile__("movzbl (%%rsi,%%rdi,1), %%eax"
+                         : "=a"(value)
+                         : "S"(state.fastmem), "D"((uint64_t)addr), "d"(&state)
+                         : "memory");
+    return value;
+  }
+
+  static uint16_t Read16(State &state, uint32_t addr) {
+    uint32_t value;
+    __asm__ __volatile__("movzwl (%%rsi,%%rdi,1), %%eax"
+                         : "=a"(value)
+                         : "S"(state.fastmem), "D"((uint64_t)addr), "d"(&state)
+                         : "memory");
+    return value;
+  }
+
+  static uint32_t Read32(State &state, uint32_t addr) {
+    uint32_t value;
+    __asm__ __volatile__("movl (%%rsi,%%rdi,1), %%eax"
+                         : "=a"(value)
+                         : "S"(state.fastmem), "D"((uint64_t)addr), "d"(&state)
+                         : "memory");
+    return value;
+  }
+
+  static void Write8(State &state, uint32_t addr, uint8_t value) {
+    __asm__ __volatile__("movb %%al, (%%rsi,%%rdi,1)"
+                         :
+                         : "a"(value), "S"(state.fastmem),
+                           "D"((uint64_t)addr), "d"(&state)
+                         : "memory");
+  }
+
+  static void Write16(State &state, uint32_t addr, uint16_t value) {
+    __asm__ __volatile__("movw %%ax, (%%rsi,%%rdi,1)"
+                         :
+                         : "a"(value), "S"(state.fastmem),
+                           "D"((uint64_t)addr), "d"(&state)
+                         : "memory");
+  }
+
+  static void Write32(State &state, uint32_t addr, uint32_t value) {
+    __asm__ __volatile__("movl %%eax, (%%rsi,%%rdi,1)"
+                         :
+                         : "a"(value), "S"(state.fastmem),
+                           "D"((uint64_t)addr), "d"(&state)
+                         : "memory");
+  }
+
+  // For BulkMemory, nullptr if the page isn't mapped in the arena (or is read
+  // only), so IO and unmapped pages still go through the fault handler
+  static uint8_t *HostPage(State &state, uint32_t addr, bool write) {
+    const uint8_t access = state.fastmemPages[addr >> PageTable::PageBits];
+    if (!(access & (write ? FastmemArena::Writable : FastmemArena::Readable))) {
+      return nullptr;
+    }
+    return state.fastmem + (addr & ~PageTable::PageMask);
+  }
+};
+
+} // namespace Meeps
+#endif
@@ -0,0 +1,411 @@
+#pragma once
+#include "r3000interpreter.h"
+#include "trace.h"
+#include <cstdint>
+#include <vector>
+
+// Linear per-block IR that the cached interpreter and the recompiler both
+// execute. Every operand is a guest register or a 32 bit immediate, so the
+// passes in irpasses.h can rewrite instructions without knowing MIPS
+// encodings, and both backends get the result for free.
+//
+// A block runs as a whole: pc/nextPC are only written where something needs
+// them (interpreter fallbacks, control transfers, the delay slot and the
+// exit), and registers in between may skip writes the block itself proves
+// dead.
+
+namespace Meeps::IR {
+
+enum class Op : uint8_t {
+  Nop, // Left behind by the passes, dropped before execution
+
+  Const, // dst = imm
+  Mov,   // dst = src1
+
+  // dst = src1 <op> src2
+  Add, Sub, And, Or, Xor, Nor, Slt, Sltu,
+  // dst = src1 <op> imm, with imm already extended the way MIPS does
+  AddI, AndI, OrI, XorI, SltI, SltuI,
+  // dst = src1 shifted by imm, or by src2 & 31 for the variable forms
+  Sll, Srl, Sra, Sllv, Srlv, Srav,
+  MfHi, MfLo, // dst = hi/lo
+
+  // dst = [src1 + imm], [src1 + imm] = src2
+  Load8, Load8U, Load16, Load16U, Load32,
+  Store8, Store16, Store32,
+
+  // Control transfers set nextPC. Jumps link addr + 8 into dst if non-zero.
+  Jump,    // nextPC = imm
+  JumpReg, // nextPC = src1
+  Beq, Bne, // nextPC = src1 <cond> src2 ? imm : addr + 8
+  Blez, Bgtz, Bltz, Bgez, // nextPC = src1 <cond> 0 ? imm : addr + 8
+  // SLT/SLTU + BNE/BEQ on the result, fused by FuseInstructions.
+  // dst = src1 < src2, nextPC = (Blt/Bltu ? dst : !dst) ? imm : addr + 8
+  Blt, Bge, Bltu, Bgeu,
+  // Same for SLTI/SLTIU, comparing src1 against imm2
+  BltI, BgeI, BltuI, BgeuI,
+
+  DelaySlot,  // pc = nextPC, nextPC += 4, precedes the delay slot
+  Interpret,  // Calls the interpreter handler for instr
+  Guard,      // Leaves the block after imm2 instructions unless pc == imm
+  Exit,       // pc = imm, nextPC = imm + 4, ends straight line blocks
+  ExitBranch, // pc = imm, ends blocks cut off before a delay slot
+};
+
+constexpr size_t OpCount = (size_t)Op::ExitBranch + 1;
+
+struct Inst {
+  Op op = Op::Nop;
+  uint8_t dst = 0;
+  uint8_t src1 = 0;
+  uint8_t src2 = 0;
+  uint32_t imm = 0;
+  uint32_t addr = 0; // Guest address this came from
+
+  // Interpret only. In a delay slot the pc/nextPC shuffle has already
+  // happened, otherwise the handler gets pc = addr + 4, nextPC = addr + 8.
+  Instruction instr = 0;
+  bool delaySlot = false; // Also set for loads/stores with an alignMask
+
+  // Guard, Interpret and loads/stores with an alignMask: instructions run
+  // before it, fused compares: the SLTI immediate
+  uint32_t imm2 = 0;
+
+  // Loads/stores only, address bits that have to be clear. Set for halfword
+  // and word accesses when translated with guest exceptions on, and raising an
+  // address error stops the CPU (see StopReason).
+  uint8_t alignMask = 0;
+
+  // Control transfers only, also does the DelaySlot shuffle right after
+  // setting nextPC (see FuseInstructions)
+  bool fusedSlot = false;
+};
+
+struct Block {
+  std::vector<Inst> insts;
+  uint32_t size = 0; // Guest instructions covered, for cycle counting
+};
+
+constexpr uint32_t AllRegs = 0xffff'ffff;
+
+constexpr bool IsControlTransfer(Op op) {
+  return op >= Op::Jump && op <= Op::BgeuI;
+}
+constexpr bool IsFusedCompare(Op op) {
+  return op >= Op::Blt && op <= Op::BgeuI;
+}
+constexpr bool IsLoad(Op op) { return op >= Op::Load8 && op <= Op::Load32; }
+constexpr bool IsStore(Op op) { return op >= Op::Store8 && op <= Op::Store32; }
+
+// Ops that only write dst and can be dropped if dst is never read
+constexpr bool IsPure(Op op) { return op >= Op::Const && op <= Op::MfLo; }
+
+constexpr uint32_t Bit(uint32_t reg) { return reg ? 1u << reg : 0; }
+
+// GPRs read by an interpreter fallback. Anything that may stop the CPU reads
+// all of them, so no register write is skipped before it stops. ADD/ADDI/SUB
+// are only left to the interpreter when they may.
+inline uint32_t InterpretReads(Instruction instr) {
+  using I = R3000Interpreter<>;
+  if (I::MayStop(instr, true)) {
+    return AllRegs;
+  }
+
+  const uint32_t rs = instr.i.rs;
+  const uint32_t rt = instr.i.rt;
+  switch (instr.i.op) {
+  case 0b00'0000:
+    if (instr.r.func == 0b01'0000 || instr.r.func == 0b01'0010) {
+      return 0; // MFHI, MFLO
+    }
+    return Bit(rs) | Bit(rt); // MTHI/MTLO, MULT/DIV, shifts, JR/JALR...
+  case 0b00'0010: // J
+  case 0b00'0011: // JAL
+    return 0;
+  case 0b01'0000: // COP0
+    return instr.i.rs == 0b0'0100 ? Bit(rt) : 0; // MTC0
+  case 0b11'0000: // LWC0
+  case 0b11'1000: // SWC0
+    return Bit(rs);
+  default:
+    return Bit(rs) | Bit(rt);
+  }
+}
+
+// GPRs an interpreter fallback may write, e.g. BLTZAL only links if taken
+inline uint32_t InterpretWrites(Instruction instr) {
+  using I = R3000Interpreter<>;
+  if (I::MayStop(instr, true)) {
+    return AllRegs;
+  }
+
+  switch (instr.i.op) {
+  case 0b00'0000:
+    if (instr.r.func == 0b00'1000 ||
+        (instr.r.func >= 0b01'0001 && instr.r.func <= 0b01'1111 &&
+         instr.r.func != 0b01'0010)) {
+      return 0; // JR, MTHI, MTLO, MULT, DIV...
+    }
+    return Bit(instr.r.rd);
+  case 0b00'0001: // BCONDZ, the link variants write $ra
+    return (instr.i.rt >> 1) == 0x8 ? Bit(31) : 0;
+  case 0b00'0011: // JAL
+    return Bit(31);
+  case 0b01'0000: // COP0
+    return instr.i.rs == 0b0'0000 ? Bit(instr.i.rt) : 0; // MFC0
+  case 0b11'0000: // LWC0
+  case 0b11'1000: // SWC0
+  case 0b00'0010: // J
+  case 0b00'0100: // BEQ
+  case 0b00'0101: // BNE
+  case 0b00'0110: // BLEZ
+  case 0b00'0111: // BGTZ
+    return 0;
+  default:
+    return Bit(instr.i.rt);
+  }
+}
+
+inline uint32_t Reads(const Inst &inst) {
+  if (inst.alignMask) {
+    return AllRegs; // May stop the CPU, same as InterpretReads
+  }
+
+  switch (inst.op) {
+  case Op::Nop:
+  case Op::Const:
+  case Op::MfHi:
+  case Op::MfLo:
+  case Op::Jump:
+  case Op::DelaySlot:
+  case Op::Exit:
+  case Op::ExitBranch:
+    return 0;
+  case Op::Interpret:
+    return InterpretReads(inst.instr);
+  case Op::Guard:
+    return AllRegs; // Side exits leave every register in State
+  default:
+    return Bit(inst.src1) | Bit(inst.src2);
+  }
+}
+
+inline uint32_t Writes(const Inst &inst) {
+  if (inst.op == Op::Interpret) {
+    return InterpretWrites(inst.instr);
+  }
+  if (IsPure(inst.op) || IsLoad(inst.op) || IsFusedCompare(inst.op) ||
+      inst.op == Op::Jump || inst.op == Op::JumpReg) {
+    return Bit(inst.dst);
+  }
+  return 0;
+}
+
+// Appends the first size instructions of a block fetched at pc, without
+// anything to leave the block at the end. With guest exceptions (see
+// State::exceptions), overflows and misaligned addresses stop the CPU.
+inline void TranslateInstructions(Block &block,
+                                  const std::vector<Instruction> &instrs,
+                                  uint32_t pc, size_t size,
+                                  bool exceptions = false) {
+  using I = R3000Interpreter<>;
+  const uint32_t before = block.size;
+  block.size += (uint32_t)size;
+
+  bool delaySlot = false;
+  for (size_t n = 0; n < size; n++) {
+    const Instruction instr = instrs[n];
+    const uint32_t addr = pc + n * 4;
+    const uint8_t rs = instr.i.rs;
+    const uint8_t rt = instr.i.rt;
+    const uint8_t rd = instr.r.rd;
+    const uint32_t imm = instr.i.imm;
+    const uint32_t simm = (int32_t)(int16_t)instr.i.imm;
+    const uint32_t target = addr + 4 + simm * 4;
+
+    if (delaySlot) {
+      block.insts.push_back({Op::DelaySlot});
+    }
+
+    Inst inst{Op::Interpret};
+    inst.addr = addr;
+
+    // A jump/branch in a delay slot works off of the runtime pc, which only
+    // the interpreter handlers read
+    if (delaySlot && I::IsControlTransfer(instr)) {
+      inst.op = Op::Interpret;
+    } else if (instr.i.op == 0b00'0000) {
+      static constexpr Op shifts[] = {Op::Sll,  Op::Nop, Op::Srl,  Op::Sra,
+                                      Op::Sllv, Op::Nop, Op::Srlv, Op::Srav};
+      const uint32_t func = instr.r.func;
+      if (func < 8 && shifts[func] != Op::Nop) {
+        const bool variable = func & 4;
+        inst = {shifts[func], rd, rt, variable ? rs : uint8_t(0),
+                variable ? 0 : instr.r.shamt, addr};
+      } else if (func == 0b00'1000 || func == 0b00'1001) { // JR, JALR
+        inst = {Op::JumpReg, func == 0b00'1001 ? rd : uint8_t(0), rs, 0, 0,
+                addr};
+      } else if (func == 0b01'0000 || func == 0b01'0010) { // MFHI, MFLO
+        inst = {func == 0b01'0000 ? Op::MfHi : Op::MfLo, rd, 0, 0, 0, addr};
+      } else if (func >= 0b10'0000 && func <= 0b10'1011 && func != 0b10'1000 &&
+                 func != 0b10'1001 &&
+                 !(exceptions && (func == 0b10'0000 || func == 0b10'0010))) {
+        // ADD/SUB only trap with exceptions, and are interpreted then
+        static constexpr Op alu[] = {Op::Add, Op::Add, Op::Sub, Op::Sub,
+                                     Op::And, Op::Or,  Op::Xor, Op::Nor,
+                                     Op::Nop, Op::Nop, Op::Slt, Op::Sltu};
+        inst = {alu[func - 0b10'0000], rd, rs, rt, 0, addr};
+      }
+    } else {
+      switch (instr.i.op) {
+      case 0b00'0001: // BCONDZ, the link variants are interpreted
+        if ((rt >> 1) != 0x8) {
+          inst = {(rt & 1) ? Op::Bgez : Op::Bltz, 0, rs, 0, target, addr};
+        }
+        break;
+      case 0b00'0010: // J
+      case 0b00'0011: // JAL
+        inst = {Op::Jump, instr.i.op == 0b00'0011 ? uint8_t(31) : uint8_t(0),
+                0, 0, ((addr + 4) & 0xf000'0000) + (instr.j.target << 2),
+                addr};
+        break;
+      case 0b00'0100:
+        inst = {Op::Beq, 0, rs, rt, target, addr};
+        break;
+      case 0b00'0101:
+        inst = {Op::Bne, 0, rs, rt, target, addr};
+        break;
+      case 0b00'0110:
+        inst = {Op::Blez, 0, rs, 0, target, addr};
+        break;
+      case 0b00'0111:
+        inst = {Op::Bgtz, 0, rs, 0, target, addr};
+        break;
+      case 0b00'1000: // ADDI, interpreted if it may trap
+        if (!exceptions) {
+          inst = {Op::AddI, rt, rs, 0, simm, addr};
+        }
+        break;
+      case 0b00'1001: // ADDIU
+        inst = {Op::AddI, rt, rs, 0, simm, addr};
+        break;
+      case 0b00'1010:
+        inst = {Op::SltI, rt, rs, 0, simm, addr};
+        break;
+      case 0b00'1011:
+        inst = {Op::SltuI, rt, rs, 0, simm, addr};
+        break;
+      case 0b00'1100:
+        inst = {Op::AndI, rt, rs, 0, imm, addr};
+        break;
+      case 0b00'1101:
+        inst = {Op::OrI, rt, rs, 0, imm, addr};
+        break;
+      case 0b00'1110:
+        inst = {Op::XorI, rt, rs, 0, imm, addr};
+        break;
+      case 0b00'1111: // LUI
+        inst = {Op::Const, rt, 0, 0, imm << 16, addr};
+        break;
+      case 0b10'0000:
+        inst = {Op::Load8, rt, rs, 0, simm, addr};
+        break;
+      case 0b10'0001:
+        inst = {Op::Load16, rt, rs, 0, simm, addr};
+        break;
+      case 0b10'0011:
+        inst = {Op::Load32, rt, rs, 0, simm, addr};
+        break;
+      case 0b10'0100:
+        inst = {Op::Load8U, rt, rs, 0, simm, addr};
+        break;
+      case 0b10'0101:
+        inst = {Op::Load16U, rt, rs, 0, simm, addr};
+        break;
+      case 0b10'1000:
+        inst = {Op::Store8, 0, rs, rt, simm, addr};
+        break;
+      case 0b10'1001:
+        inst = {Op::Store16, 0, rs, rt, simm, addr};
+        break;
+      case 0b10'1011:
+        inst = {Op::Store32, 0, rs, rt, simm, addr};
+        break;
+      }
+    }
+
+    if (exceptions && (inst.op == Op::Load16 || inst.op == Op::Load16U ||
+                       inst.op == Op::Store16)) {
+      inst.alignMask = 1;
+    } else if (exceptions &&
+               (inst.op == Op::Load32 || inst.op == Op::Store32)) {
+      inst.alignMask = 3;
+    }
+
+    if (inst.op == Op::Interpret || inst.alignMask) {
+      inst.instr = instr;
+      inst.delaySlot = delaySlot;
+      inst.imm2 = before + (uint32_t)n;
+    }
+    block.insts.push_back(inst);
+    delaySlot = I::IsControlTransfer(instr);
+  }
+}
+
+// Leaves pc/nextPC as if the instructions appended last had been stepped
+// through. After a delay slot they already are.
+inline void TranslateExit(Block &block, const std::vector<Instruction> &instrs,
+                          uint32_t pc, size_t size) {
+  using I = R3000Interpreter<>;
+  const uint32_t end = pc + size * 4;
+  const bool delaySlot = size && I::IsControlTransfer(instrs[size - 1]);
+  const bool endsInDelaySlot =
+      size > 1 && I::IsControlTransfer(instrs[size - 2]);
+  if (!endsInDelaySlot) {
+    block.insts.push_back(
+        {delaySlot ? Op::ExitBranch : Op::Exit, 0, 0, 0, end});
+  }
+}
+
+// Translates the first size instructions of a block fetched at pc
+inline Block Translate(const std::vector<Instruction> &instrs, uint32_t pc,
+                       size_t size, bool exceptions = false) {
+  Block block;
+  TranslateInstructions(block, instrs, pc, size, exceptions);
+  TranslateExit(block, instrs, pc, size);
+  return block;
+}
+
+// Translates a recorded trace into a single block. Every part but the last
+// that ends on a branch or register jump is followed by a Guard, which takes
+// a side exit if the trace went elsewhere this time.
+inline Block TranslateTrace(const Trace &trace, bool exceptions = false) {
+  using I = R3000Interpreter<>;
+  Block block;
+
+  for (size_t i = 0; i < trace.size(); i++) {
+    const TracePart &part = trace[i];
+    const size_t size = part.instrs.size();
+    TranslateInstructions(block, part.instrs, part.pc, size, exceptions);
+
+    if (i + 1 == trace.size()) {
+      TranslateExit(block, part.instrs, part.pc, size);
+      break;
+    }
+
+    // Straight line parts and J/JAL always lead to the next part
+    const Instruction last = size > 1 ? part.instrs[size - 2] : Instruction(0);
+    const uint32_t op = last.i.op;
+    if (size > 1 && I::IsControlTransfer(last) && op != 0b00'0010 &&
+        op != 0b00'0011) {
+      const uint32_t addr = part.pc + (uint32_t)(size - 2) * 4;
+      Inst guard{Op::Guard, 0, 0, 0, trace[i + 1].pc, addr};
+      guard.imm2 = block.size;
+      block.insts.push_back(guard);
+    }
+  }
+
+  return block;
+}
+
+} // namespace Meeps::IR
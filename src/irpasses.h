@@ -0,0 +1,340 @@
+#pragma once
+#include "ir.h"
+#include <array>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace Meeps::IR {
+
+struct Options {
+  bool constantPropagation = true;
+  bool deadWriteElimination = true;
+  // Reuses the result of an earlier identical load when nothing in between
+  // could have changed memory. Only correct if guest loads have no side
+  // effects (no FIFOs or read-to-clear registers), so it's off by default.
+  bool redundantLoadElimination = false;
+  bool fuseInstructions = true;
+  // Skips whole iterations of loops that would spin without changing
+  // anything, like polling a flag (see IsIdleLoop). Only correct if guest
+  // loads have no side effects and what they poll can't change during a
+  // Run, so it's off by default.
+  bool idleLoopSkipping = false;
+};
+
+// Folds values known within the block: LUI+ORI/ADDIU pairs become a single
+// Const, and loads/stores through a known base get an absolute address
+inline void PropagateConstants(Block &block) {
+  std::array<uint32_t, 32> values{};
+  uint32_t known = 1; // Bit per GPR, $zero is always 0
+
+  for (Inst &inst : block.insts) {
+    bool knownA = known & (1u << inst.src1);
+    bool knownB = known & (1u << inst.src2);
+    uint32_t a = values[inst.src1];
+    uint32_t b = values[inst.src2];
+
+    const bool commutative = inst.op == Op::Add || inst.op == Op::And ||
+                             inst.op == Op::Or || inst.op == Op::Xor;
+    if (commutative && knownA && !knownB) {
+      std::swap(inst.src1, inst.src2);
+      std::swap(a, b);
+      std::swap(knownA, knownB);
+    }
+
+    // Reg-reg ops with a known second operand use the immediate forms
+    if (knownB && !knownA) {
+      switch (inst.op) {
+      case Op::Add:
+        inst = {Op::AddI, inst.dst, inst.src1, 0, b, inst.addr};
+        break;
+      case Op::Sub:
+        inst = {Op::AddI, inst.dst, inst.src1, 0, 0 - b, inst.addr};
+        break;
+      case Op::And:
+        inst = {Op::AndI, inst.dst, inst.src1, 0, b, inst.addr};
+        break;
+      case Op::Or:
+        inst = {Op::OrI, inst.dst, inst.src1, 0, b, inst.addr};
+        break;
+      case Op::Xor:
+        inst = {Op::XorI, inst.dst, inst.src1, 0, b, inst.addr};
+        break;
+      case Op::Slt:
+        inst = {Op::SltI, inst.dst, inst.src1, 0, b, inst.addr};
+        break;
+      case Op::Sltu:
+        inst = {Op::SltuI, inst.dst, inst.src1, 0, b, inst.addr};
+        break;
+      case Op::Sllv:
+        inst = {Op::Sll, inst.dst, inst.src1, 0, b & 31, inst.addr};
+        break;
+      case Op::Srlv:
+        inst = {Op::Srl, inst.dst, inst.src1, 0, b & 31, inst.addr};
+        break;
+      case Op::Srav:
+        inst = {Op::Sra, inst.dst, inst.src1, 0, b & 31, inst.addr};
+        break;
+      default:
+        break;
+      }
+    }
+
+    // Everything that reads src2 needs both operands from here on
+    const uint32_t imm = inst.imm;
+    const bool both = knownA && knownB;
+    bool folded = false;
+    uint32_t result = 0;
+    auto Fold = [&](bool operandsKnown, uint32_t value) {
+      folded = operandsKnown;
+      result = value;
+    };
+
+    switch (inst.op) {
+    case Op::Const:
+      Fold(true, imm);
+      break;
+    case Op::Mov:
+      Fold(knownA, a);
+      break;
+    case Op::Add:
+      Fold(both, a + b);
+      break;
+    case Op::Sub:
+      Fold(both, a - b);
+      break;
+    case Op::And:
+      Fold(both, a & b);
+      break;
+    case Op::Or:
+      Fold(both, a | b);
+      break;
+    case Op::Xor:
+      Fold(both, a ^ b);
+      break;
+    case Op::Nor:
+      Fold(both, ~(a | b));
+      break;
+    case Op::Slt:
+      Fold(both, (int32_t)a < (int32_t)b);
+      break;
+    case Op::Sltu:
+      Fold(both, a < b);
+      break;
+    case Op::AddI:
+      Fold(knownA, a + imm);
+      break;
+    case Op::AndI:
+      Fold(knownA, a & imm);
+      break;
+    case Op::OrI:
+      Fold(knownA, a | imm);
+      break;
+    case Op::XorI:
+      Fold(knownA, a ^ imm);
+      break;
+    case Op::SltI:
+      Fold(knownA, (int32_t)a < (int32_t)imm);
+      break;
+    case Op::SltuI:
+      Fold(knownA, a < imm);
+      break;
+    case Op::Sll:
+      Fold(knownA, a << imm);
+      break;
+    case Op::Srl:
+      Fold(knownA, a >> imm);
+      break;
+    case Op::Sra:
+      Fold(knownA, (int32_t)a >> imm);
+      break;
+    default:
+      break;
+    }
+
+    if (folded) {
+      inst = {Op::Const, inst.dst, 0, 0, result, inst.addr};
+    } else if (inst.op == Op::AddI && !imm) {
+      inst = {Op::Mov, inst.dst, inst.src1, 0, 0, inst.addr};
+    }
+
+    // Address formation, the base register itself stays untouched
+    if ((IsLoad(inst.op) || IsStore(inst.op)) && inst.src1 && knownA) {
+      inst.imm += a;
+      inst.src1 = 0;
+    }
+
+    known = (known & ~Writes(inst)) | 1;
+    if (inst.op == Op::Const && inst.dst) {
+      known |= 1u << inst.dst;
+      values[inst.dst] = inst.imm;
+    }
+  }
+}
+
+// Drops pure ops writing $zero, loads into $zero keep their memory access.
+// Backends rely on pure ops never targeting $zero after Optimize.
+inline void RemoveZeroWrites(Block &block) {
+  for (Inst &inst : block.insts) {
+    if (IsPure(inst.op) && !inst.dst) {
+      inst.op = Op::Nop;
+    }
+  }
+}
+
+// Replaces a load with a copy of an earlier identical load's result while
+// neither register involved has been overwritten and nothing wrote memory
+inline void EliminateRedundantLoads(Block &block) {
+  std::vector<Inst *> available;
+
+  for (Inst &inst : block.insts) {
+    if (IsStore(inst.op) || inst.op == Op::Interpret) {
+      available.clear();
+    }
+
+    Inst *match = nullptr;
+    if (IsLoad(inst.op)) {
+      for (Inst *load : available) {
+        if (load->op == inst.op && load->src1 == inst.src1 &&
+            load->imm == inst.imm) {
+          match = load;
+        }
+      }
+    }
+
+    const uint32_t writes = Writes(inst);
+    std::erase_if(available, [&](const Inst *load) {
+      return writes & (Bit(load->dst) | Bit(load->src1));
+    });
+
+    if (match && inst.dst) {
+      inst = {Op::Mov, inst.dst, match->dst, 0, 0, inst.addr};
+    } else if (IsLoad(inst.op) && inst.dst && !(writes & Bit(inst.src1))) {
+      available.push_back(&inst);
+    }
+  }
+}
+
+// Drops pure ops whose result is overwritten before being read, working
+// backwards from the end of the block where every register is live. Fallbacks
+// never count as overwriting anything, since they might not.
+inline void EliminateDeadWrites(Block &block) {
+  uint32_t live = AllRegs;
+
+  for (auto it = block.insts.rbegin(); it != block.insts.rend(); ++it) {
+    Inst &inst = *it;
+    const uint32_t writes = Writes(inst);
+
+    if (writes && !(writes & live)) {
+      if (IsPure(inst.op)) {
+        inst.op = Op::Nop;
+        continue;
+      }
+      if (IsLoad(inst.op)) {
+        inst.dst = 0; // The access itself has to stay
+      }
+    }
+
+    if (inst.op != Op::Interpret) {
+      live &= ~writes;
+    }
+    live |= Reads(inst);
+  }
+}
+
+// Merges common pairs into single ops, so backends dispatch once for both.
+// A compare followed by a BNE/BEQ on its result against $zero becomes a
+// compare and branch, and jumps/branches absorb the DelaySlot op after them,
+// which with an empty delay slot covers both guest instructions. Runs last on
+// a block without Nops, the other passes don't know the fused ops.
+inline void FuseInstructions(Block &block) {
+  auto &insts = block.insts;
+
+  for (size_t i = 0; i + 1 < insts.size(); i++) {
+    Inst &compare = insts[i];
+    Inst &branch = insts[i + 1];
+    const bool onResult =
+        (branch.op == Op::Bne || branch.op == Op::Beq) && compare.dst &&
+        ((branch.src1 == compare.dst && !branch.src2) ||
+         (branch.src2 == compare.dst && !branch.src1));
+    if (!onResult) {
+      continue;
+    }
+
+    const bool bne = branch.op == Op::Bne;
+    Op fused;
+    switch (compare.op) {
+    case Op::Slt:
+      fused = bne ? Op::Blt : Op::Bge;
+      break;
+    case Op::Sltu:
+      fused = bne ? Op::Bltu : Op::Bgeu;
+      break;
+    case Op::SltI:
+      fused = bne ? Op::BltI : Op::BgeI;
+      break;
+    case Op::SltuI:
+      fused = bne ? Op::BltuI : Op::BgeuI;
+      break;
+    default:
+      continue;
+    }
+
+    Inst inst{fused,      compare.dst, compare.src1,
+              compare.src2, branch.imm, branch.addr};
+    inst.imm2 = compare.imm;
+    branch = inst;
+    compare.op = Op::Nop;
+  }
+
+  for (size_t i = 0; i + 1 < insts.size(); i++) {
+    if (IsControlTransfer(insts[i].op) && insts[i + 1].op == Op::DelaySlot) {
+      insts[i].fusedSlot = true;
+      insts[i + 1].op = Op::Nop;
+    }
+  }
+
+  std::erase_if(insts, [](const Inst &inst) { return inst.op == Op::Nop; });
+}
+
+// True if a block that ends up back at its own start would do exactly the
+// same thing when run again: it has no stores or fallbacks, and no register
+// is both written and read before being written. Only loads and guards tell
+// whether the loop is still spinning, so as long as memory stays the same it
+// keeps looping forever.
+inline bool IsIdleLoop(const Block &block) {
+  uint32_t written = 0;
+  uint32_t readFirst = 0;
+
+  for (const Inst &inst : block.insts) {
+    if (IsStore(inst.op) || inst.op == Op::Interpret) {
+      return false;
+    }
+    if (inst.op != Op::Guard) {
+      readFirst |= Reads(inst) & ~written;
+    }
+    written |= Writes(inst);
+  }
+
+  return !(readFirst & written);
+}
+
+inline void Optimize(Block &block, const Options &options = {}) {
+  if (options.constantPropagation) {
+    PropagateConstants(block);
+  }
+  RemoveZeroWrites(block);
+  if (options.redundantLoadElimination) {
+    EliminateRedundantLoads(block);
+  }
+  if (options.deadWriteElimination) {
+    EliminateDeadWrites(block);
+  }
+
+  std::erase_if(block.insts, [](const Inst &inst) { return inst.op == Op::Nop; });
+  if (options.fuseInstructions) {
+    FuseInstructions(block);
+  }
+}
+
+} // namespace Meeps::IR
@@ -0,0 +1,208 @@
+#pragma once
+#include "fmt/core.h"
+#include "fmt/printf.h"
+#include "memory.h"
+#include "state.h"
+#include <bitset>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+
+namespace Meeps {
+
+// BIOS kernel calls, encoded as (table << 8) | function number. Guests call
+// them by jumping to 0xA0/0xB0/0xC0 with the number in $t1.
+enum class KernelFunction : uint16_t {
+  Strlen = 0xA01B,
+  Bzero = 0xA028,
+  Memcpy = 0xA02A,
+  Memset = 0xA02B,
+  Printf = 0xA03F,
+};
+
+// High level emulation of BIOS kernel calls. Every function is off until
+// enabled, and once it is, reaching the A0/B0/C0 entry point with its number
+// in $t1 runs it natively against the memory policy and returns to $ra
+// without executing any guest instructions. Calls to anything not enabled
+// run the guest's own kernel code as usual.
+//
+// The CPU backends check State::hle whenever they get to a new block or land
+// on a jump/branch target, which is the only way guests reach the entry
+// points.
+class KernelHLE {
+public:
+  using Output = std::function<void(std::string_view text)>;
+
+  // The A0/B0/C0 vectors in any of the KUSEG/KSEG0/KSEG1 mirrors
+  static constexpr bool IsEntry(uint32_t pc) {
+    const uint32_t addr = pc & 0x1fff'ffff;
+    return addr == 0xa0 || addr == 0xb0 || addr == 0xc0;
+  }
+
+  void Enable(KernelFunction function, bool enabled = true) {
+    enabledFunctions[Index(function)] = enabled;
+  }
+
+  bool IsEnabled(KernelFunction function) const {
+    return enabledFunctions[Index(function)];
+  }
+
+  bool AnyEnabled() const { return enabledFunctions.any(); }
+
+  // Receives everything the guest prints, stdout by default
+  void SetOutput(Output output) { this->output = std::move(output); }
+
+  // Runs the call state.pc is the entry point of if it's enabled, leaving
+  // the result in $v0 and pc at $ra. Returns false to let the guest's
+  // kernel handle it.
+  template <MemoryPolicy Memory> bool Call(State &state) {
+    using DataMemory = ScratchpadMemory<Memory>; // Like guest loads/stores
+    const uint32_t table = (state.pc & 0x1fff'ffff) >> 4;
+    const uint32_t number = state.gpr[9]; // $t1
+    if (number > 0xff) {
+      return false;
+    }
+
+    const auto function = (KernelFunction)((table << 12) | number);
+    if (!enabledFunctions[Index(function)]) {
+      return false;
+    }
+
+    auto &gpr = state.gpr;
+    const uint32_t a0 = gpr[4];
+    const uint32_t a1 = gpr[5];
+    const uint32_t a2 = gpr[6];
+    uint32_t result = 0;
+
+    // Null pointers and non-positive lengths return 0 like the BIOS does
+    switch (function) {
+    case KernelFunction::Strlen:
+      result = a0 ? (uint32_t)ReadString<DataMemory>(state, a0).size() : 0;
+      break;
+    case KernelFunction::Bzero:
+    case KernelFunction::Memset:
+      if (a0 && (int32_t)a2 > 0) {
+        const uint8_t fill = function == KernelFunction::Memset ? a1 : 0;
+        for (uint32_t i = 0; i < a2; i++) {
+          DataMemory::Write8(state, a0 + i, fill);
+          state.CheckCodeWrite(a0 + i);
+        }
+        result = a0;
+      }
+      break;
+    case KernelFunction::Memcpy:
+      if (a0 && a1) {
+        for (int32_t i = 0; i < (int32_t)a2; i++) {
+          DataMemory::Write8(state, a0 + i, DataMemory::Read8(state, a1 + i));
+          state.CheckCodeWrite(a0 + i);
+        }
+        result = a0;
+      }
+      break;
+    case KernelFunction::Printf: {
+      const std::string text = Format<DataMemory>(state);
+      if (output) {
+        output(text);
+      }
+      result = (uint32_t)text.size();
+      break;
+    }
+    }
+
+    gpr[2] = result; // $v0
+    state.pc = gpr[31];
+    state.nextPC = state.pc + 4;
+    return true;
+  }
+
+private:
+  static constexpr size_t Index(KernelFunction function) {
+    const uint32_t value = (uint32_t)function;
+    return ((value >> 12) - 0xa) * 0x100 + (value & 0xff);
+  }
+
+  template <MemoryPolicy Memory>
+  static std::string ReadString(State &state, uint32_t addr) {
+    std::string text;
+    while (const char c = (char)Memory::Read8(state, addr++)) {
+      text += c;
+    }
+    return text;
+  }
+
+  // The BIOS printf, with arguments in $a1-$a3 and then on the stack. Each
+  // conversion is passed on to fmt::sprintf, which follows C's rules.
+  template <MemoryPolicy Memory> static std::string Format(State &state) {
+    const std::string format = ReadString<Memory>(state, state.gpr[4]);
+    uint32_t argument = 1;
+    auto NextArgument = [&]() {
+      const uint32_t index = argument++;
+      return index < 4 ? state.gpr[4 + index]
+                       : Memory::Read32(state, state.gpr[29] + index * 4);
+    };
+
+    std::string text;
+    for (size_t i = 0; i < format.size(); i++) {
+      if (format[i] != '%') {
+        text += format[i];
+        continue;
+      }
+
+      // Flags, width and precision, with * taking the value from the next
+      // argument. Length modifiers make no difference on a 32 bit CPU.
+      std::string spec = "%";
+      size_t j = i + 1;
+      while (j < format.size() &&
+             std::string_view("-+ #0123456789.*hl").find(format[j]) !=
+                 std::string_view::npos) {
+        if (format[j] == '*') {
+          spec += std::to_string((int32_t)NextArgument());
+        } else if (format[j] != 'h' && format[j] != 'l') {
+          spec += format[j];
+        }
+        j++;
+      }
+      if (j == format.size()) {
+        text += format.substr(i);
+        break;
+      }
+
+      const char conversion = format[j];
+      spec += conversion;
+      switch (conversion) {
+      case 'd':
+      case 'i':
+        text += fmt::sprintf(spec, (int32_t)NextArgument());
+        break;
+      case 'u':
+      case 'o':
+      case 'x':
+      case 'X':
+      case 'c':
+        text += fmt::sprintf(spec, NextArgument());
+        break;
+      case 'p':
+        text += fmt::sprintf("%08x", NextArgument());
+        break;
+      case 's':
+        text += fmt::sprintf(spec, ReadString<Memory>(state, NextArgument()));
+        break;
+      case '%':
+        text += '%';
+        break;
+      default: // Unknown conversions are printed as is
+        text += format.substr(i, j - i + 1);
+        break;
+      }
+      i = j;
+    }
+
+    return text;
+  }
+
+  std::bitset<3 * 0x100> enabledFunctions;
+  Output output = [](std::string_view text) { fmt::print("{}", text); };
+};
+
+} // namespace Meeps
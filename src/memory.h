@@ -0,0 +1,321 @@
+#pragma once
+#include "state.h"
+#include <algorithm>
+#include <concepts>
+#include <cstdint>
+#include <cstring>
+
+namespace Meeps {
+
+// CPU and its backends are templated on a memory policy, a type with static
+// accessors that every load, store and instruction fetch goes through. A
+// policy that touches host memory directly lets the compiler inline guest RAM
+// accesses into each instruction handler. Policies may keep their context in
+// State::mp, which the CPU never touches itself.
+template <class T>
+concept MemoryPolicy = requires(State &state, uint32_t addr) {
+  { T::Read8(state, addr) } -> std::same_as<uint8_t>;
+  { T::Read16(state, addr) } -> std::same_as<uint16_t>;
+  { T::Read32(state, addr) } -> std::same_as<uint32_t>;
+  T::Write8(state, addr, uint8_t{});
+  T::Write16(state, addr, uint16_t{});
+  T::Write32(state, addr, uint32_t{});
+};
+
+// Instruction fetch goes through Fetch32 for policies that have one, e.g. to
+// keep the current code page at hand, and Read32 otherwise
+template <MemoryPolicy Memory>
+inline uint32_t FetchInstruction(State &state, uint32_t pc) {
+  if constexpr (requires { Memory::Fetch32(state, pc); }) {
+    return Memory::Fetch32(state, pc);
+  } else {
+    return Memory::Read32(state, pc);
+  }
+}
+
+// Adapter for the readPointer/writePointer callbacks set through
+// CPU::SetReadPointer and CPU::SetWritePointer
+struct PointerMemory {
+  static uint8_t Read8(State &state, uint32_t addr) { return state.read8(addr); }
+  static uint16_t Read16(State &state, uint32_t addr) {
+    return state.read16(addr);
+  }
+  static uint32_t Read32(State &state, uint32_t addr) {
+    return state.read32(addr);
+  }
+
+  static void Write8(State &state, uint32_t addr, uint8_t value) {
+    state.write8(addr, value);
+  }
+  static void Write16(State &state, uint32_t addr, uint16_t value) {
+    state.write16(addr, value);
+  }
+  static void Write32(State &state, uint32_t addr, uint32_t value) {
+    state.write32(addr, value);
+  }
+};
+
+// Path for accesses that don't hit host memory: the IO handlers mapped in
+// State::pageTable, then the readPointer/writePointer callbacks if set.
+// Unbacked reads return 0 and unbacked writes are dropped, as are writes to
+// read-only memory mapped in State::pageTable.
+struct SlowMemory {
+  template <class T> static T Read(State &state, uint32_t addr) {
+    if (const IOHandlers *io = state.pageTable.FindIO(addr)) {
+      if constexpr (sizeof(T) == 1) {
+        return io->read8(io->context, addr);
+      } else if constexpr (sizeof(T) == 2) {
+        return io->read16(io->context, addr);
+      } else {
+        return io->read32(io->context, addr);
+      }
+    }
+
+    if constexpr (sizeof(T) == 1) {
+      return state.rp8 ? state.read8(addr) : 0;
+    } else if constexpr (sizeof(T) == 2) {
+      return state.rp16 ? state.read16(addr) : 0;
+    } else {
+      return state.rp32 ? state.read32(addr) : 0;
+    }
+  }
+
+  template <class T> static void Write(State &state, uint32_t addr, T value) {
+    if (const IOHandlers *io = state.pageTable.FindIO(addr)) {
+      if constexpr (sizeof(T) == 1) {
+        io->write8(io->context, addr, value);
+      } else if constexpr (sizeof(T) == 2) {
+        io->write16(io->context, addr, value);
+      } else {
+        io->write32(io->context, addr, value);
+      }
+      return;
+    }
+    if (state.pageTable.GetReadPage(addr)) {
+      return; // Mapped read only
+    }
+
+    if constexpr (sizeof(T) == 1) {
+      if (state.wp8) {
+        state.write8(addr, value);
+      }
+    } else if constexpr (sizeof(T) == 2) {
+      if (state.wp16) {
+        state.write16(addr, value);
+      }
+    } else {
+      if (state.wp32) {
+        state.write32(addr, value);
+      }
+    }
+  }
+};
+
+// Resolves accesses through State::pageTable. RAM/ROM hits are a table lookup
+// and a direct host access, everything else goes through SlowMemory. Fetches
+// use the page table's cached code page, so code running from MMIO is the
+// only code fetched through the slow path.
+struct PageTableMemory {
+  static uint8_t Read8(State &state, uint32_t addr) {
+    return Read<uint8_t>(state, addr);
+  }
+  static uint16_t Read16(State &state, uint32_t addr) {
+    return Read<uint16_t>(state, addr);
+  }
+  static uint32_t Read32(State &state, uint32_t addr) {
+    return Read<uint32_t>(state, addr);
+  }
+
+  static uint32_t Fetch32(State &state, uint32_t pc) {
+    if (const uint8_t *page = state.pageTable.GetCodePage(pc)) [[likely]] {
+      uint32_t instr;
+      std::memcpy(&instr, page + (pc & PageTable::PageMask), sizeof(instr));
+      return instr;
+    }
+    return SlowMemory::Read<uint32_t>(state, pc);
+  }
+
+  static void Write8(State &state, uint32_t addr, uint8_t value) {
+    Write<uint8_t>(state, addr, value);
+  }
+  static void Write16(State &state, uint32_t addr, uint16_t value) {
+    Write<uint16_t>(state, addr, value);
+  }
+  static void Write32(State &state, uint32_t addr, uint32_t value) {
+    Write<uint32_t>(state, addr, value);
+  }
+
+  // For BulkMemory, nullptr if the page isn't host memory (or is read only)
+  static uint8_t *HostPage(State &state, uint32_t addr, bool write) {
+    return write ? state.pageTable.GetWritePage(addr)
+                 : state.pageTable.GetReadPage(addr);
+  }
+
+  template <class T> static T Read(State &state, uint32_t addr) {
+    if (const uint8_t *page = state.pageTable.GetReadPage(addr)) [[likely]] {
+      T value;
+      std::memcpy(&value, page + (addr & PageTable::PageMask), sizeof(T));
+      return value;
+    }
+    return SlowMemory::Read<T>(state, addr);
+  }
+
+  template <class T> static void Write(State &state, uint32_t addr, T value) {
+    if (uint8_t *page = state.pageTable.GetWritePage(addr)) [[likely]] {
+      std::memcpy(page + (addr & PageTable::PageMask), &value, sizeof(T));
+      return;
+    }
+    SlowMemory::Write<T>(state, addr, value);
+  }
+};
+
+// Puts the scratchpad (see CPU::SetScratchpad) in front of a policy, for the
+// loads and stores guest code performs. DMA can't reach it, and neither can
+// instruction fetch. Misaligned accesses to it are aligned down.
+template <MemoryPolicy Memory> struct ScratchpadMemory {
+  static uint8_t Read8(State &state, uint32_t addr) {
+    if (state.InScratchpad(addr)) [[unlikely]] {
+      return Read<uint8_t>(state, addr);
+    }
+    return Memory::Read8(state, addr);
+  }
+  static uint16_t Read16(State &state, uint32_t addr) {
+    if (state.InScratchpad(addr)) [[unlikely]] {
+      return Read<uint16_t>(state, addr);
+    }
+    return Memory::Read16(state, addr);
+  }
+  static uint32_t Read32(State &state, uint32_t addr) {
+    if (state.InScratchpad(addr)) [[unlikely]] {
+      return Read<uint32_t>(state, addr);
+    }
+    return Memory::Read32(state, addr);
+  }
+
+  static void Write8(State &state, uint32_t addr, uint8_t value) {
+    if (state.InScratchpad(addr)) [[unlikely]] {
+      return Write<uint8_t>(state, addr, value);
+    }
+    Memory::Write8(state, addr, value);
+  }
+  static void Write16(State &state, uint32_t addr, uint16_t value) {
+    if (state.InScratchpad(addr)) [[unlikely]] {
+      return Write<uint16_t>(state, addr, value);
+    }
+    Memory::Write16(state, addr, value);
+  }
+  static void Write32(State &state, uint32_t addr, uint32_t value) {
+    if (state.InScratchpad(addr)) [[unlikely]] {
+      return Write<uint32_t>(state, addr, value);
+    }
+    Memory::Write32(state, addr, value);
+  }
+
+private:
+  template <class T> static T Read(State &state, uint32_t addr) {
+    T value;
+    std::memcpy(&value, &state.scratchpad[Offset<T>(addr)], sizeof(T));
+    return value;
+  }
+
+  template <class T> static void Write(State &state, uint32_t addr, T value) {
+    std::memcpy(&state.scratchpad[Offset<T>(addr)], &value, sizeof(T));
+  }
+
+  template <class T> static uint32_t Offset(uint32_t addr) {
+    return addr & (State::ScratchpadSize - sizeof(T));
+  }
+};
+
+// Host side transfers for DMA and loaders, see CPU::ReadBlock. They go a page
+// at a time, with memcpy/memset for pages a policy's HostPage resolves to
+// host memory. Other pages go through the policy's accessors, with words
+// where aligned. Writes drop translated code they modify like guest stores.
+template <MemoryPolicy Memory> struct BulkMemory {
+  static void Read(State &state, uint32_t addr, void *dst, uint32_t size) {
+    uint8_t *out = (uint8_t *)dst;
+    ForEachPage(addr, size, [&](uint32_t at, uint32_t length) {
+      if (const uint8_t *page = HostPage(state, at, false)) {
+        std::memcpy(out, page + (at & PageTable::PageMask), length);
+        out += length;
+        return;
+      }
+      for (uint32_t i = 0; i < length;) {
+        if (!((at + i) & 3) && length - i >= 4) {
+          const uint32_t value = Memory::Read32(state, at + i);
+          std::memcpy(out, &value, 4);
+          out += 4;
+          i += 4;
+        } else {
+          *out++ = Memory::Read8(state, at + i++);
+        }
+      }
+    });
+  }
+
+  static void Write(State &state, uint32_t addr, const void *src,
+                    uint32_t size) {
+    const uint8_t *in = (const uint8_t *)src;
+    ForEachPage(addr, size, [&](uint32_t at, uint32_t length) {
+      if (uint8_t *page = HostPage(state, at, true)) {
+        std::memcpy(page + (at & PageTable::PageMask), in, length);
+        in += length;
+        return;
+      }
+      for (uint32_t i = 0; i < length;) {
+        if (!((at + i) & 3) && length - i >= 4) {
+          uint32_t value;
+          std::memcpy(&value, in, 4);
+          Memory::Write32(state, at + i, value);
+          in += 4;
+          i += 4;
+        } else {
+          Memory::Write8(state, at + i++, *in++);
+        }
+      }
+    });
+    state.CheckCodeWrites(addr, size);
+  }
+
+  static void Fill(State &state, uint32_t addr, uint8_t value,
+                   uint32_t size) {
+    ForEachPage(addr, size, [&](uint32_t at, uint32_t length) {
+      if (uint8_t *page = HostPage(state, at, true)) {
+        std::memset(page + (at & PageTable::PageMask), value, length);
+        return;
+      }
+      for (uint32_t i = 0; i < length;) {
+        if (!((at + i) & 3) && length - i >= 4) {
+          Memory::Write32(state, at + i, value * 0x0101'0101u);
+          i += 4;
+        } else {
+          Memory::Write8(state, at + i++, value);
+        }
+      }
+    });
+    state.CheckCodeWrites(addr, size);
+  }
+
+private:
+  static uint8_t *HostPage(State &state, uint32_t addr, bool write) {
+    if constexpr (requires { Memory::HostPage(state, addr, write); }) {
+      return Memory::HostPage(state, addr, write);
+    } else {
+      return nullptr;
+    }
+  }
+
+  // Splits [addr, addr + size) at page boundaries, wrapping around at 4 GiB
+  template <typename F>
+  static void ForEachPage(uint32_t addr, uint32_t size, F &&fn) {
+    while (size) {
+      const uint32_t length =
+          std::min(size, PageTable::PageSize - (addr & PageTable::PageMask));
+      fn(addr, length);
+      addr += length;
+      size -= length;
+    }
+  }
+};
+
+} // namespace Meeps
@@ -0,0 +1,266 @@
+#pragma once
+#include "types.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <vector>
+
+namespace Meeps {
+
+// Callbacks for a memory mapped IO region. They receive the full guest
+// address, not an offset into the region.
+struct IOHandlers {
+  void *context;
+  readPointer<uint8_t> read8;
+  readPointer<uint16_t> read16;
+  readPointer<uint32_t> read32;
+  writePointer<uint8_t> write8;
+  writePointer<uint16_t> write16;
+  writePointer<uint32_t> write32;
+};
+
+// How PageTable::MapRegion maps host memory, combined with |
+struct RegionFlags {
+  static constexpr uint32_t ReadOnly = 1 << 0;  // ROM, guest writes dropped
+  static constexpr uint32_t NoMirrors = 1 << 1; // Only at base, no segments
+};
+
+// Flat table over the 32 bit address space holding a host pointer per guest
+// page for RAM/ROM, so a RAM access costs one lookup and a direct load.
+// Pages without a host pointer take the slow path through IO handlers, which
+// are found through a second table holding the first IO region of each page.
+//
+// Mappings below 512 MiB, or in KSEG0/KSEG1, are installed in all three of
+// KUSEG, KSEG0 and KSEG1 up front so mirrors cost nothing per access.
+class PageTable {
+public:
+  static constexpr uint32_t PageBits = 12;
+  static constexpr uint32_t PageSize = 1 << PageBits;
+  static constexpr uint32_t PageMask = PageSize - 1;
+  static constexpr size_t PageCount = size_t(1) << (32 - PageBits);
+
+
+  // Maps size bytes at base to host memory, replacing whatever was there.
+  // The first hostSize bytes of host repeat across the region (all of it if
+  // 0), for memory that's mirrored within its segment. Pages of read-only
+  // memory only get a read pointer, so writes to them take the slow path,
+  // which drops them.
+  void MapRegion(uint32_t base, uint32_t size, uint8_t *host,
+                 uint32_t flags = 0, uint32_t hostSize = 0) {
+    hostSize = hostSize ? hostSize : size;
+    CheckAlignment(base, size);
+    CheckAlignment(0, hostSize);
+    const bool writable = !(flags & RegionFlags::ReadOnly);
+    AllocateTables();
+    ForEachMirror(base, flags, [&](uint32_t mirror) {
+      RemoveIO(mirror, size);
+      for (uint32_t offset = 0; offset < size; offset += PageSize) {
+        const size_t page = (mirror + offset) >> PageBits;
+        uint8_t *hostPage = host + offset % hostSize;
+        readPages[page] = hostPage;
+        writePages[page] = writable ? hostPage : nullptr;
+      }
+    });
+    IndexIO();
+    FlushCodePage();
+  }
+
+  void MapMemory(uint32_t base, uint32_t size, uint8_t *host,
+                 bool writable = true) {
+    MapRegion(base, size, host, writable ? 0 : RegionFlags::ReadOnly);
+  }
+
+  // IO regions needn't be page aligned, so several devices can share a page.
+  // Any page one touches loses its host memory, and it replaces the IO
+  // regions it overlaps.
+  void MapIO(uint32_t base, uint32_t size, const IOHandlers &handlers) {
+    if (size == 0 || base + (size - 1) < base) {
+      throw std::invalid_argument("[Page Table] Invalid IO region");
+    }
+    AllocateTables();
+    ForEachMirror(base, 0, [&](uint32_t mirror) {
+      const uint32_t first = mirror >> PageBits;
+      const uint32_t last = (mirror + (size - 1)) >> PageBits;
+      for (size_t page = first; page <= last; page++) {
+        readPages[page] = nullptr;
+        writePages[page] = nullptr;
+      }
+      RemoveIO(mirror, size);
+      ioRegions.push_back({mirror, size, handlers});
+    });
+    IndexIO();
+    FlushCodePage();
+  }
+
+  // Removes host memory and IO regions, in every segment mirror of base
+  void Unmap(uint32_t base, uint32_t size) {
+    CheckAlignment(base, size);
+    AllocateTables();
+    ForEachMirror(base, 0, [&](uint32_t mirror) {
+      for (uint32_t offset = 0; offset < size; offset += PageSize) {
+        const size_t page = (mirror + offset) >> PageBits;
+        readPages[page] = nullptr;
+        writePages[page] = nullptr;
+      }
+      RemoveIO(mirror, size);
+    });
+    IndexIO();
+    FlushCodePage();
+  }
+
+  // Host pointer to the start of the page containing addr, or nullptr
+  uint8_t *GetReadPage(uint32_t addr) const {
+    return readPages[addr >> PageBits];
+  }
+  uint8_t *GetWritePage(uint32_t addr) const {
+    return writePages[addr >> PageBits];
+  }
+
+  // GetReadPage for instruction fetch, which remembers the last page so
+  // running through it costs a compare instead of a table lookup. The page
+  // is looked up again once the pc leaves it or the mappings change.
+  const uint8_t *GetCodePage(uint32_t addr) {
+    const uint32_t base = addr & ~PageMask;
+    if (base != codeBase) [[unlikely]] {
+      codeBase = base;
+      codePage = readPages[addr >> PageBits];
+    }
+    return codePage;
+  }
+
+  // Regions are sorted and disjoint, so only the ones starting up to addr
+  // from the first one on its page need checking
+  const IOHandlers *FindIO(uint32_t addr) const {
+    const uint32_t first = ioPages[addr >> PageBits];
+    if (!first) {
+      return nullptr;
+    }
+    for (size_t i = first - 1; i < ioRegions.size(); i++) {
+      const IORegion &region = ioRegions[i];
+      if (region.base > addr) {
+        break;
+      }
+      if (addr - region.base < region.size) {
+        return &region.handlers;
+      }
+    }
+    return nullptr;
+  }
+
+private:
+  struct IORegion {
+    uint32_t base;
+    uint32_t size;
+    IOHandlers handlers;
+  };
+
+  struct FreeDeleter {
+    void operator()(void *ptr) const { std::free(ptr); }
+  };
+  template <class T> using PageArray = std::unique_ptr<T[], FreeDeleter>;
+
+  // An allocation this large is served with lazily zeroed pages, so an empty
+  // table only costs address space
+  template <class T> static PageArray<T> Allocate() {
+    void *pages = std::calloc(PageCount, sizeof(T));
+    if (!pages) {
+      throw std::bad_alloc();
+    }
+    return PageArray<T>((T *)pages);
+  }
+
+  // Shared by every table nothing was mapped in yet, so lookups needn't
+  // check for a missing table. Never written to.
+  template <class T> static T *EmptyPages() {
+    static T pages[PageCount]{};
+    return pages;
+  }
+
+  // Tables are allocated on the first mapping, so CPUs that never use one
+  // (PointerMemory ones, BatchRunner instances) don't reserve 20 MB each
+  void AllocateTables() {
+    if (ownedReadPages) {
+      return;
+    }
+    ownedReadPages = Allocate<uint8_t *>();
+    ownedWritePages = Allocate<uint8_t *>();
+    ownedIOPages = Allocate<uint32_t>();
+    readPages = ownedReadPages.get();
+    writePages = ownedWritePages.get();
+    ioPages = ownedIOPages.get();
+  }
+
+  static void CheckAlignment(uint32_t base, uint32_t size) {
+    if ((base | size) & PageMask) {
+      throw std::invalid_argument("[Page Table] Mappings must be page aligned");
+    }
+  }
+
+  template <typename F>
+  static void ForEachMirror(uint32_t base, uint32_t flags, F &&fn) {
+    const uint32_t segment = base >> 29;
+    if (flags & RegionFlags::NoMirrors) {
+      fn(base);
+    } else if (segment == 0 || segment == 4 || segment == 5) {
+      // KUSEG, KSEG0, KSEG1
+      const uint32_t physical = base & 0x1fff'ffff;
+      fn(physical);
+      fn(physical | 0x8000'0000);
+      fn(physical | 0xa000'0000);
+    } else {
+      fn(base);
+    }
+  }
+
+  void FlushCodePage() {
+    codeBase = 1; // No page starts there
+    codePage = nullptr;
+  }
+
+  // Drops IO regions overlapping [base, base + size)
+  void RemoveIO(uint32_t base, uint32_t size) {
+    const uint64_t end = uint64_t(base) + size;
+    std::erase_if(ioRegions, [&](const IORegion &region) {
+      if (region.base < end && base < uint64_t(region.base) + region.size) {
+        SetIOPages(region, 0);
+        return true;
+      }
+      return false;
+    });
+  }
+
+  // Points each page at its first region, after RemoveIO cleared the pages
+  // of the ones that went away
+  void IndexIO() {
+    std::sort(ioRegions.begin(), ioRegions.end(),
+              [](const IORegion &a, const IORegion &b) {
+                return a.base < b.base;
+              });
+    for (size_t i = ioRegions.size(); i-- > 0;) {
+      SetIOPages(ioRegions[i], uint32_t(i + 1));
+    }
+  }
+
+  void SetIOPages(const IORegion &region, uint32_t index) {
+    const size_t first = region.base >> PageBits;
+    const size_t last = (region.base + (region.size - 1)) >> PageBits;
+    for (size_t page = first; page <= last; page++) {
+      ioPages[page] = index;
+    }
+  }
+
+  uint8_t **readPages = EmptyPages<uint8_t *>();
+  uint8_t **writePages = EmptyPages<uint8_t *>();
+  uint32_t *ioPages = EmptyPages<uint32_t>(); // 1 + first region, 0 for none
+  PageArray<uint8_t *> ownedReadPages;
+  PageArray<uint8_t *> ownedWritePages;
+  PageArray<uint32_t> ownedIOPages;
+  std::vector<IORegion> ioRegions;
+  uint32_t codeBase = 1;
+  const uint8_t *codePage = nullptr;
+};
+
+} // namespace Meeps
@@ -1,35 +1,277 @@
 #pragma once
 
+#include "common.h"
+#include "irpasses.h"
+#include "kernelhle.h"
+#include "memory.h"
+#include "r3000cachedinterpreter.h"
 #include "r3000interpreter.h"
+#include "scheduler.h"
 #include "state.h"
+#include "tiering.h"
+#include <algorithm>
+#include <memory>
 #include <type_traits>
+#include <unordered_set>
+#include <utility>
+
+#ifdef MEEPS_X64
+#include "r3000recompiler.h"
+#endif
 
 namespace Meeps {
 
 enum class CPUMode {
   Interpreter,
-  // soontm
+  CachedInterpreter,
+  Recompiler, // Falls back to CachedInterpreter on non x86-64 hosts
+};
+
+// What a call to CPU::Run got done
+struct RunStatus {
+  int cycles = 0; // Instructions executed
+  StopReason reason = StopReason::None;
 };
 
-class CPU {
+// Memory is the policy every guest memory access goes through, see memory.h.
+// The default forwards to the callbacks set with SetReadPointer/SetWritePointer.
+template <MemoryPolicy Memory = PointerMemory> class CPU {
 public:
-  CPU(CPUMode mode, COP0* cop0) : state(cop0) { this->mode = mode; }
+  // Without a COP0, the built-in SystemControl is used (see
+  // GetSystemControl)
+  CPU(CPUMode mode, COP0* cop0 = nullptr) : state(cop0) {
+    this->mode = mode;
+#ifdef MEEPS_X64
+    // The code cache is large, so only CPUs that use it get one
+    if (mode == CPUMode::Recompiler) {
+      recompiler = std::make_unique<R3000Recompiler<Memory>>();
+    }
+#else
+    if (mode == CPUMode::Recompiler) {
+      this->mode = CPUMode::CachedInterpreter;
+    }
+#endif
+  }
+
+  // Runs up to cycles instructions. An instruction that stops the CPU (see
+  // StopReason) ends the run early without executing, so pc points at it,
+  // and running again retries it. Use Skip to move past it instead.
+  //
+  // The run is split into slices ending at the scheduler's deadlines, and
+  // the events due are fired after each one (see Scheduler). Idle loop
+  // skipping never goes past a slice either.
+  //
+  // With guest exceptions on, the ones the R3000 raises exceptions for are
+  // delivered to the guest instead and count as executed. A pending
+  // interrupt is taken before each slice, or right after the MTC0/RFE that
+  // unmasks it.
+  RunStatus Run(int cycles) {
+    const int budget = std::max(cycles, 0);
+    RunStatus status;
+
+    // Whatever the embedder scheduled for now fires before running, after
+    // that every slice runs at least one instruction
+    scheduler.RunDueEvents();
+    do {
+      state.MirrorSR();
+      if (state.exceptions && state.InterruptPending()) {
+        EnterException(ExceptionCode::Interrupt);
+      }
+
+      const uint64_t now = scheduler.Now();
+      const uint64_t deadline = scheduler.NextDeadline();
+      const uint64_t untilEvent = deadline > now ? deadline - now : 1;
+      const int slice =
+          (int)std::min<uint64_t>(budget - status.cycles, untilEvent);
+
+      const int executed = RunSlice(slice);
+      status.cycles += executed;
+      scheduler.Advance(executed);
+      if (state.stop != StopReason::None) {
+        break;
+      }
+      scheduler.RunDueEvents();
+    } while (status.cycles < budget);
 
-  void Run(int cycles) {
-    while (cycles--) {
-      R3000Interpreter::ExecuteInstruction(state);
+    status.reason = state.stop;
+    return status;
+  }
+
+  // Delivers SYSCALL, BREAK, reserved instructions, ADD/ADDI/SUB overflows,
+  // misaligned loads/stores and interrupts to the guest through COP0 (see
+  // Run). Off by default, and existing blocks are flushed.
+  void SetGuestExceptions(bool enabled) {
+    state.exceptions = enabled;
+    FlushCache();
+  }
+
+  // Moves past the instruction at pc without executing it, e.g. after
+  // handling the SYSCALL a run stopped on
+  void Skip() {
+    state.pc = state.nextPC;
+    state.nextPC += 4;
+    state.stop = StopReason::None;
+  }
+
+  // Runs stop with StopReason::Breakpoint before executing the instruction at
+  // addr, unless it's the first one of the run. While any breakpoint is set,
+  // every mode steps instructions one at a time.
+  void AddBreakpoint(uint32_t addr) { breakpoints.insert(addr); }
+  void RemoveBreakpoint(uint32_t addr) { breakpoints.erase(addr); }
+  void ClearBreakpoints() { breakpoints.clear(); }
+
+  void Reset() {
+    state.Reset();
+    FlushCache();
+  }
+
+  // Drops every predecoded/compiled block. Guest stores, emulated kernel
+  // calls and WriteBlock/FillBlock drop the blocks they modify on their own,
+  // so this is only needed after the host modifies guest code otherwise.
+  void FlushCache() {
+    state.ClearCodePages();
+    cachedInterpreter.Flush();
+#ifdef MEEPS_X64
+    if (recompiler) {
+      recompiler->Flush();
     }
+#endif
   }
 
-  void Reset() { state.Reset(); }
+  // Drops only the blocks overlapping [addr, addr + size), for code that is
+  // modified in place
+  void InvalidateCache(uint32_t addr, uint32_t size) {
+    cachedInterpreter.Invalidate(addr, size);
+#ifdef MEEPS_X64
+    if (recompiler) {
+      recompiler->Invalidate(addr, size);
+    }
+#endif
+  }
+
+  // Selects the IR passes the cached interpreter and recompiler run on new
+  // blocks, existing ones are flushed
+  void SetIROptions(const IR::Options &options) {
+    cachedInterpreter.SetIROptions(options);
+#ifdef MEEPS_X64
+    if (recompiler) {
+      recompiler->SetIROptions(options);
+    }
+#endif
+    FlushCache();
+  }
+
+  // Blocks are translated on their threshold-th entry and stepped by the
+  // interpreter until then. Doesn't apply to CPUMode::Interpreter.
+  void SetHotThreshold(uint32_t threshold) {
+    cachedInterpreter.SetHotThreshold(threshold);
+#ifdef MEEPS_X64
+    if (recompiler) {
+      recompiler->SetHotThreshold(threshold);
+    }
+#endif
+  }
+
+  uint32_t GetHotThreshold() const {
+    return cachedInterpreter.GetHotThreshold();
+  }
+
+  // Hot code gets recorded into traces that follow the path it took across
+  // jumps and branches, instead of being translated one basic block at a time
+  void SetTracing(bool enabled) {
+    cachedInterpreter.SetTracing(enabled);
+#ifdef MEEPS_X64
+    if (recompiler) {
+      recompiler->SetTracing(enabled);
+    }
+#endif
+  }
+
+  // How many instructions each tier has run so far
+  TierStats GetTierStats() const {
+    switch (mode) {
+    case CPUMode::CachedInterpreter:
+      return cachedInterpreter.GetTierStats();
+    case CPUMode::Recompiler:
+#ifdef MEEPS_X64
+      return recompiler->GetTierStats();
+#endif
+    default:
+      return interpreterStats;
+    }
+  }
+
+  // Runs a BIOS kernel call natively instead of the guest's kernel code for
+  // it, see KernelHLE. Every function is off by default.
+  void SetKernelHLE(KernelFunction function, bool enabled) {
+    GetKernelHLE().Enable(function, enabled);
+    state.hle = hle->AnyEnabled() ? hle.get() : nullptr;
+    FlushCache(); // Traces may have been recorded through the entry points
+  }
+
+  // Where an emulated printf goes, stdout by default
+  void SetKernelOutput(KernelHLE::Output output) {
+    GetKernelHLE().SetOutput(std::move(output));
+  }
 
   State &GetState() { return state; }
 
+  // Only used if the CPU was built without a COP0
+  SystemControl &GetSystemControl() { return state.systemControl; }
+
   void SetPC(uint32_t pc) {
     state.pc = pc;
     state.nextPC = state.pc + 4;
   }
 
+  // Maps guest memory to host memory, e.g. RAM, ROM (RegionFlags::ReadOnly)
+  // or a scratchpad, with its segment mirrors unless RegionFlags::NoMirrors.
+  // hostSize bytes of host repeat across the region, 0 for all of it. Only
+  // for the PageTableMemory policy, which resolves it with a table lookup.
+  void MapRegion(uint32_t base, uint32_t size, uint8_t *host,
+                 uint32_t flags = 0, uint32_t hostSize = 0) {
+    static_assert(std::is_same_v<Memory, PageTableMemory>,
+                  "[CPU] MapRegion needs the PageTableMemory policy");
+    state.pageTable.MapRegion(base, size, host, flags, hostSize);
+    FlushCache();
+  }
+
+  // Routes accesses to [base, base + size) and its segment mirrors to
+  // handlers. Regions needn't be page aligned, but pages they touch can't
+  // also hold memory. Accesses nothing is mapped at fall back to the
+  // SetReadPointer/SetWritePointer callbacks, if any.
+  void MapIO(uint32_t base, uint32_t size, const IOHandlers &handlers) {
+    static_assert(!std::is_same_v<Memory, PointerMemory>,
+                  "[CPU] MapIO needs a policy that uses the page table");
+    state.pageTable.MapIO(base, size, handlers);
+    FlushCache();
+  }
+
+  void Unmap(uint32_t base, uint32_t size) {
+    state.pageTable.Unmap(base, size);
+    FlushCache();
+  }
+
+  // Maps the 1 KiB data cache at 0x1f80'0000 and 0x9f80'0000 as scratchpad
+  // RAM, ahead of whatever memory is there. Guest loads and stores to it are
+  // served from State::scratchpad without going through the memory policy.
+  void SetScratchpad(bool enabled) {
+    state.scratchpadBase = enabled ? State::ScratchpadBase : 1;
+  }
+
+  // Copies between guest memory and the host for DMA and loaders, resolving
+  // each page once instead of going through the policy per byte (see
+  // BulkMemory). Writes drop translated code they overwrite.
+  void ReadBlock(uint32_t addr, void *dst, uint32_t size) {
+    BulkMemory<Memory>::Read(state, addr, dst, size);
+  }
+  void WriteBlock(uint32_t addr, const void *src, uint32_t size) {
+    BulkMemory<Memory>::Write(state, addr, src, size);
+  }
+  void FillBlock(uint32_t addr, uint8_t value, uint32_t size) {
+    BulkMemory<Memory>::Fill(state, addr, value, size);
+  }
+
   void SetMemoryPointer(void *mp) { state.mp = mp; }
 
   template <class T> void SetReadPointer(readPointer<T> rp) {
@@ -60,9 +302,144 @@ public:
     }
   }
 
+  // Timed events fired between slices of Run
+  Scheduler &GetScheduler() { return scheduler; }
+
 private:
+  // Delivers exceptions the guest handles and carries on until the cycles
+  // are used up or the CPU stops
+  int RunSlice(int cycles) {
+    int executed = 0;
+    while (true) {
+      executed += RunMode(cycles - executed);
+      if (!state.exceptions || !DeliverException()) {
+        return executed;
+      }
+      if (++executed >= cycles) {
+        return executed;
+      }
+    }
+  }
+
+  int RunMode(int cycles) {
+    if (!breakpoints.empty()) {
+      const int executed = RunToBreakpoint(cycles);
+      interpreterStats.steppedInstructions += executed;
+      return executed;
+    }
+
+    switch (mode) {
+    case CPUMode::Interpreter: {
+      const int executed = R3000Interpreter<Memory>::Run(state, cycles);
+      interpreterStats.steppedInstructions += executed;
+      return executed;
+    }
+    case CPUMode::CachedInterpreter:
+      return cachedInterpreter.Run(state, cycles);
+    case CPUMode::Recompiler:
+#ifdef MEEPS_X64
+      return recompiler->Run(state, cycles);
+#endif
+      break;
+    }
+    return 0;
+  }
+
+  // Turns what stopped the CPU into an exception, returns false if the guest
+  // doesn't handle it
+  bool DeliverException() {
+    switch (state.stop) {
+    case StopReason::Syscall:
+      EnterException(ExceptionCode::Syscall);
+      return true;
+    case StopReason::Break:
+      EnterException(ExceptionCode::Break);
+      return true;
+    case StopReason::ReservedInstruction:
+      EnterException(ExceptionCode::ReservedInstruction);
+      return true;
+    case StopReason::Overflow:
+      EnterException(ExceptionCode::Overflow);
+      return true;
+    case StopReason::AddressErrorLoad:
+    case StopReason::AddressErrorStore:
+      state.WriteCOP0(COP0::BadVaddr, state.badVaddr);
+      EnterException(state.stop == StopReason::AddressErrorLoad
+                         ? ExceptionCode::AddressErrorLoad
+                         : ExceptionCode::AddressErrorStore);
+      return true;
+    case StopReason::Interrupt:
+      Skip(); // The MTC0/RFE already ran
+      EnterException(ExceptionCode::Interrupt);
+      return true;
+    default:
+      return false;
+    }
+  }
+
+  // Exception entry for the instruction at pc. In a delay slot EPC points at
+  // the jump/branch and Cause.BD is set, so it gets rerun on return.
+  void EnterException(ExceptionCode code) {
+    const bool delaySlot = state.nextPC != state.pc + 4;
+    const uint32_t cause = state.GetCOP0(COP0::Cause) & 0xff00; // IP bits
+    state.WriteCOP0(COP0::EPC, delaySlot ? state.pc - 4 : state.pc);
+    state.WriteCOP0(COP0::Cause, cause | ((uint32_t)code << 2) |
+                                     ((uint32_t)delaySlot << 31));
+
+    // Pushes kernel mode with interrupts off onto the KU/IE stack
+    const uint32_t sr = state.GetCOP0(COP0::SR);
+    state.WriteCOP0(COP0::SR, (sr & ~0x3fu) | ((sr << 2) & 0x3c));
+
+    const uint32_t vector =
+        (sr & SystemControl::BEV) ? 0xbfc0'0180 : 0x8000'0080;
+    state.pc = vector;
+    state.nextPC = vector + 4;
+    state.stop = StopReason::None;
+  }
+
+  int RunToBreakpoint(int cycles) {
+    using Interpreter = R3000Interpreter<Memory>;
+    state.stop = StopReason::None;
+
+    int executed = 0;
+    while (executed < cycles) {
+      if (executed && breakpoints.contains(state.pc)) {
+        state.stop = StopReason::Breakpoint;
+        break;
+      }
+
+      if (state.hle && state.nextPC == state.pc + 4 &&
+          KernelHLE::IsEntry(state.pc) && state.hle->Call<Memory>(state)) {
+        executed++;
+        continue;
+      }
+
+      Interpreter::ExecuteInstruction(state);
+      if (state.stop != StopReason::None) {
+        break;
+      }
+      executed++;
+    }
+    return executed;
+  }
+
+  KernelHLE &GetKernelHLE() {
+    if (!hle) {
+      hle = std::make_unique<KernelHLE>();
+    }
+    return *hle;
+  }
+
   State state;
   CPUMode mode;
+  R3000CachedInterpreter<Memory> cachedInterpreter;
+  TierStats interpreterStats;
+  std::unique_ptr<KernelHLE> hle; // Only allocated once configured
+  std::unordered_set<uint32_t> breakpoints;
+  Scheduler scheduler;
+#ifdef MEEPS_X64
+  std::unique_ptr<R3000Recompiler<Memory>> recompiler;
+#endif
 };
 
 } // namespace Meeps
\ No newline at end of file
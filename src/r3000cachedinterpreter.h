@@ -0,0 +1,407 @@
+#pragma once
+#include "blockcache.h"
+#include "ir.h"
+#include "irpasses.h"
+#include "kernelhle.h"
+#include "memory.h"
+#include "r3000interpreter.h"
+#include "state.h"
+#include "tiering.h"
+#include "trace.h"
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace Meeps {
+
+// Translates guest basic blocks to optimized IR once and executes them straight
+// from a cache keyed by their starting PC, skipping the fetch and table
+// dispatch that the plain interpreter pays on every instruction. Blocks are
+// chained to their successors (see BlockCache), so the cache is only searched
+// on a miss. Blocks are only translated once they are hot, cold code is
+// stepped by the interpreter (see HotnessCounters). With tracing on, hot
+// code is recorded into traces instead, which run the path a loop took over
+// several basic blocks in one go.
+//
+// Like the recompiler, blocks only run as a whole and memory callbacks must
+// not throw, since registers may lag behind in the middle of a block.
+template <MemoryPolicy Memory = PointerMemory> class R3000CachedInterpreter {
+public:
+  // A block ends on the delay slot of a jump/branch, or after this many
+  // instructions of straight line code
+  static constexpr size_t MaxBlockSize = 64;
+  static constexpr size_t MaxTraceSize = 256;
+
+  struct Entry;
+  // Returns false to leave the block early, only guards and instructions
+  // that stop the CPU do
+  using Handler = bool (*)(State &, const Entry &);
+
+  struct Entry {
+    Handler handler;
+    IR::Inst inst;
+    interpreterfp fallback; // For IR::Op::Interpret
+  };
+
+  using Cache = BlockCache<std::vector<Entry>>;
+  using Block = typename Cache::Block;
+
+  // Returns the number of instructions executed, which is less than cycles
+  // if the CPU stopped (see StopReason)
+  int Run(State &state, int cycles) {
+    const int budget = std::max(cycles, 0);
+    Block *block = nullptr; // Last block run to completion
+    state.stop = StopReason::None;
+
+    while (cycles > 0 && state.stop == StopReason::None) {
+      // Blocks built from code that was stored to go before running any more
+      if (state.writtenCodeCount) [[unlikely]] {
+        cache.InvalidateWritten(state);
+        block = nullptr;
+      }
+
+      // The block layout assumes sequential flow, so a pending branch (a
+      // previous Run stopped right before a delay slot) is stepped instead
+      if (state.nextPC != state.pc + 4) {
+        const int executed = Interpreter::Step(state, 1);
+        cycles -= executed;
+        stats.steppedInstructions += executed;
+        block = nullptr;
+        continue;
+      }
+
+      if (state.hle && KernelHLE::IsEntry(state.pc) &&
+          state.hle->Call<Memory>(state)) [[unlikely]] {
+        cycles--;
+        block = nullptr;
+        continue;
+      }
+
+      block = GetBlock(state, block);
+      if (!block) {
+        const int executed = RunCold(state, cycles);
+        cycles -= executed;
+        stats.steppedInstructions += executed;
+        continue;
+      }
+
+      // A slice ending inside of the block is stepped to its end instead
+      if (block->size > (uint32_t)cycles) {
+        const int executed = Interpreter::Step(state, cycles);
+        cycles -= executed;
+        stats.steppedInstructions += executed;
+        break;
+      }
+
+      uint32_t executed = block->size;
+      for (const Entry &entry : block->payload) {
+        if (!entry.handler(state, entry)) {
+          executed = entry.inst.imm2;
+          block = nullptr; // Side exits and stops aren't linked
+          break;
+        }
+      }
+      cycles -= executed;
+      stats.blockInstructions += executed;
+
+      // Every further iteration of an idle loop would do the same, so the
+      // ones that fit are skipped and only the tail is stepped
+      if (block && block->idle && state.pc == block->start) {
+        const int skipped = cycles - cycles % (int)block->size;
+        cycles -= skipped;
+        stats.skippedInstructions += skipped;
+      }
+    }
+
+    return budget - std::max(cycles, 0);
+  }
+
+  // Must be called whenever guest code that may have been cached is modified
+  void Flush() {
+    cache.Clear();
+    hotness.Clear();
+  }
+
+  // Applies to blocks translated from now on
+  void SetIROptions(const IR::Options &options) { irOptions = options; }
+
+  // Drops the blocks overlapping [addr, addr + size) and unlinks them
+  void Invalidate(uint32_t addr, uint32_t size) {
+    cache.Invalidate(addr, size);
+    hotness.Invalidate(addr, size);
+  }
+
+  size_t GetBlockCount() const { return cache.GetBlockCount(); }
+
+  void SetHotThreshold(uint32_t threshold) { hotness.SetThreshold(threshold); }
+  uint32_t GetHotThreshold() const { return hotness.GetThreshold(); }
+  const TierStats &GetTierStats() const { return stats; }
+
+  // Records traces from hot code instead of translating single blocks
+  void SetTracing(bool enabled) { tracing = enabled; }
+
+private:
+  using Interpreter = R3000Interpreter<Memory>;
+  using DataMemory = ScratchpadMemory<Memory>;
+
+  // Follows the link out of the previous block if there is one, and links it
+  // up after a lookup otherwise. Returns nullptr if there's no block yet.
+  Block *GetBlock(State &state, Block *previous) {
+    if (previous) {
+      if (Block *next = Cache::Follow(*previous, state.pc)) {
+        return next;
+      }
+    }
+
+    Block *block = cache.Find(state.pc);
+    if (block && previous) {
+      cache.Link(*previous, *block);
+    }
+    return block;
+  }
+
+  // Steps the block at state.pc while it's cold. Once it's hot, it either
+  // gets translated for the next lookup or a trace is recorded from it.
+  // Returns the number of instructions executed.
+  int RunCold(State &state, int cycles) {
+    const uint32_t pc = state.pc;
+    if (!hotness.Enter(pc)) {
+      return Interpreter::StepBlock(state, cycles, MaxBlockSize);
+    }
+
+    if (!tracing) {
+      CompileBlock(state, pc);
+      return 0;
+    }
+
+    int executed;
+    const Trace trace = RecordTrace<Memory>(
+        state, cycles, executed, MaxBlockSize, MaxTraceSize,
+        [this](uint32_t next) { return cache.Find(next) != nullptr; });
+    if (!trace.empty()) {
+      CompileTrace(state, trace);
+    }
+    return executed;
+  }
+
+  Block &CompileBlock(State &state, uint32_t pc) {
+    std::vector<Instruction> instrs =
+        Interpreter::FetchBlock(state, pc, MaxBlockSize);
+
+    IR::Block ir = IR::Translate(instrs, pc, instrs.size(), state.exceptions);
+    stats.blocksTranslated++;
+    Block &block = cache.Insert(pc, instrs, ir.size, MakeEntries(ir));
+    block.idle = irOptions.idleLoopSkipping && IR::IsIdleLoop(ir);
+    Cache::MarkCode(state, block);
+    return block;
+  }
+
+  Block &CompileTrace(State &state, const Trace &trace) {
+    IR::Block ir = IR::TranslateTrace(trace, state.exceptions);
+    stats.tracesTranslated++;
+    Block &block = cache.InsertTrace(trace, MakeEntries(ir));
+    block.idle = irOptions.idleLoopSkipping && IR::IsIdleLoop(ir);
+    Cache::MarkCode(state, block);
+    return block;
+  }
+
+  std::vector<Entry> MakeEntries(IR::Block &ir) {
+    IR::Optimize(ir, irOptions);
+
+    std::vector<Entry> entries;
+    for (const IR::Inst &inst : ir.insts) {
+      const interpreterfp fallback = inst.op == IR::Op::Interpret
+                                         ? Interpreter::Decode(inst.instr)
+                                         : nullptr;
+      entries.push_back({handlers[(size_t)inst.op], inst, fallback});
+    }
+    return entries;
+  }
+
+  template <IR::Op op> static bool Execute(State &state, const Entry &entry) {
+    using enum IR::Op;
+    const IR::Inst &inst = entry.inst;
+    auto &gpr = state.gpr;
+    const uint32_t a = gpr[inst.src1];
+    const uint32_t b = gpr[inst.src2];
+    const uint32_t imm = inst.imm;
+
+    // Pure ops never target $zero once optimized
+    if constexpr (op == Const) {
+      gpr[inst.dst] = imm;
+    } else if constexpr (op == Mov) {
+      gpr[inst.dst] = a;
+    } else if constexpr (op == Add) {
+      gpr[inst.dst] = a + b;
+    } else if constexpr (op == Sub) {
+      gpr[inst.dst] = a - b;
+    } else if constexpr (op == And) {
+      gpr[inst.dst] = a & b;
+    } else if constexpr (op == Or) {
+      gpr[inst.dst] = a | b;
+    } else if constexpr (op == Xor) {
+      gpr[inst.dst] = a ^ b;
+    } else if constexpr (op == Nor) {
+      gpr[inst.dst] = ~(a | b);
+    } else if constexpr (op == Slt) {
+      gpr[inst.dst] = (int32_t)a < (int32_t)b;
+    } else if constexpr (op == Sltu) {
+      gpr[inst.dst] = a < b;
+    } else if constexpr (op == AddI) {
+      gpr[inst.dst] = a + imm;
+    } else if constexpr (op == AndI) {
+      gpr[inst.dst] = a & imm;
+    } else if constexpr (op == OrI) {
+      gpr[inst.dst] = a | imm;
+    } else if constexpr (op == XorI) {
+      gpr[inst.dst] = a ^ imm;
+    } else if constexpr (op == SltI) {
+      gpr[inst.dst] = (int32_t)a < (int32_t)imm;
+    } else if constexpr (op == SltuI) {
+      gpr[inst.dst] = a < imm;
+    } else if constexpr (op == Sll) {
+      gpr[inst.dst] = a << imm;
+    } else if constexpr (op == Srl) {
+      gpr[inst.dst] = a >> imm;
+    } else if constexpr (op == Sra) {
+      gpr[inst.dst] = (int32_t)a >> imm;
+    } else if constexpr (op == Sllv) {
+      gpr[inst.dst] = a << (b & 31);
+    } else if constexpr (op == Srlv) {
+      gpr[inst.dst] = a >> (b & 31);
+    } else if constexpr (op == Srav) {
+      gpr[inst.dst] = (int32_t)a >> (b & 31);
+    } else if constexpr (op == MfHi) {
+      gpr[inst.dst] = state.hi;
+    } else if constexpr (op == MfLo) {
+      gpr[inst.dst] = state.lo;
+    } else if constexpr (IR::IsLoad(op)) {
+      const uint32_t addr = a + imm;
+      if (addr & inst.alignMask) [[unlikely]] {
+        Interpreter::AddressError(state, addr, false);
+        return Stop(state, inst);
+      }
+      uint32_t value;
+      if constexpr (op == Load8) {
+        value = (int32_t)(int8_t)DataMemory::Read8(state, addr);
+      } else if constexpr (op == Load8U) {
+        value = DataMemory::Read8(state, addr);
+      } else if constexpr (op == Load16) {
+        value = (int32_t)(int16_t)DataMemory::Read16(state, addr);
+      } else if constexpr (op == Load16U) {
+        value = DataMemory::Read16(state, addr);
+      } else {
+        value = DataMemory::Read32(state, addr);
+      }
+      state.SetGPR(inst.dst, value);
+    } else if constexpr (IR::IsStore(op)) {
+      const uint32_t addr = a + imm;
+      if (addr & inst.alignMask) [[unlikely]] {
+        Interpreter::AddressError(state, addr, true);
+        return Stop(state, inst);
+      }
+      if (state.systemControl.CacheIsolated()) [[unlikely]] {
+        return true;
+      }
+      if constexpr (op == Store8) {
+        DataMemory::Write8(state, addr, b & 0xff);
+      } else if constexpr (op == Store16) {
+        DataMemory::Write16(state, addr, b & 0xffff);
+      } else {
+        DataMemory::Write32(state, addr, b);
+      }
+      state.CheckCodeWrite(addr);
+    } else if constexpr (op == Jump || op == JumpReg) {
+      state.SetGPR(inst.dst, inst.addr + 8);
+      SetNextPC(state, inst, op == Jump ? imm : a);
+    } else if constexpr (op == Beq || op == Bne || op == Blez || op == Bgtz ||
+                         op == Bltz || op == Bgez) {
+      bool taken;
+      if constexpr (op == Beq) {
+        taken = a == b;
+      } else if constexpr (op == Bne) {
+        taken = a != b;
+      } else if constexpr (op == Blez) {
+        taken = (int32_t)a <= 0;
+      } else if constexpr (op == Bgtz) {
+        taken = (int32_t)a > 0;
+      } else if constexpr (op == Bltz) {
+        taken = (int32_t)a < 0;
+      } else {
+        taken = (int32_t)a >= 0;
+      }
+      SetNextPC(state, inst, taken ? imm : inst.addr + 8);
+    } else if constexpr (IR::IsFusedCompare(op)) {
+      bool less;
+      if constexpr (op == Blt || op == Bge) {
+        less = (int32_t)a < (int32_t)b;
+      } else if constexpr (op == Bltu || op == Bgeu) {
+        less = a < b;
+      } else if constexpr (op == BltI || op == BgeI) {
+        less = (int32_t)a < (int32_t)inst.imm2;
+      } else {
+        less = a < inst.imm2;
+      }
+      gpr[inst.dst] = less;
+      constexpr bool onLess =
+          op == Blt || op == Bltu || op == BltI || op == BltuI;
+      SetNextPC(state, inst, less == onLess ? imm : inst.addr + 8);
+    } else if constexpr (op == DelaySlot) {
+      state.pc = state.nextPC;
+      state.nextPC += 4;
+    } else if constexpr (op == Interpret) {
+      if (!inst.delaySlot) {
+        state.pc = inst.addr + 4;
+        state.nextPC = inst.addr + 8;
+      }
+      entry.fallback(state, inst.instr);
+      if (state.stop != StopReason::None) [[unlikely]] {
+        return Stop(state, inst);
+      }
+    } else if constexpr (op == Guard) {
+      return state.pc == imm;
+    } else if constexpr (op == Exit) {
+      state.pc = imm;
+      state.nextPC = imm + 4;
+    } else if constexpr (op == ExitBranch) {
+      state.pc = imm;
+    }
+    return true;
+  }
+
+  // Leaves pc/nextPC right before inst, which stopped the CPU
+  static bool Stop(State &state, const IR::Inst &inst) {
+    state.nextPC = inst.delaySlot ? state.pc : inst.addr + 4;
+    state.pc = inst.addr;
+    return false;
+  }
+
+  // Goes straight through the delay slot if the DelaySlot op was fused in
+  static void SetNextPC(State &state, const IR::Inst &inst, uint32_t target) {
+    if (inst.fusedSlot) {
+      state.pc = target;
+      state.nextPC = target + 4;
+    } else {
+      state.nextPC = target;
+    }
+  }
+
+  template <size_t... I>
+  static constexpr std::array<Handler, IR::OpCount>
+  MakeHandlers(std::index_sequence<I...>) {
+    return {&Execute<(IR::Op)I>...};
+  }
+
+  static constexpr std::array<Handler, IR::OpCount> handlers =
+      MakeHandlers(std::make_index_sequence<IR::OpCount>());
+
+  IR::Options irOptions;
+  Cache cache;
+  HotnessCounters hotness;
+  TierStats stats;
+  bool tracing = false;
+};
+
+} // namespace Meeps
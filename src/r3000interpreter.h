@@ -1,11 +1,14 @@
 #pragma once
 #include "common.h"
 #include "fmt/core.h"
+#include "kernelhle.h"
+#include "memory.h"
 #include "state.h"
+#include <algorithm>
 #include <array>
 #include <stdexcept>
+#include <vector>
 
-// TODO: throwing proper exceptions (like xbyak what() : )
 // TODO: cache and that cache control bit in cop0?
 
 namespace Meeps {
@@ -71,36 +74,388 @@ union Instruction {
 
 using interpreterfp = void (*)(State &, Instruction);
 
-class R3000Interpreter {
+template <MemoryPolicy Memory = PointerMemory> class R3000Interpreter {
 public:
+  // Runs the instruction at state.pc. If it stops the CPU, State::stop is set
+  // and pc/nextPC are left as they were.
   static void ExecuteInstruction(State &state) {
     DPRINT("PC: {:08X}\n", state.pc);
 
-    Instruction instr = state.read32(state.pc);
-    state.pc = state.nextPC;
+    const uint32_t pc = state.pc;
+    const uint32_t nextPC = state.nextPC;
+    Instruction instr = FetchInstruction<Memory>(state, pc);
+    state.pc = nextPC;
     state.nextPC += 4;
 
     primaryTable[instr.i.op](state, instr);
+    if (state.stop != StopReason::None) [[unlikely]] {
+      state.pc = pc;
+      state.nextPC = nextPC;
+    }
+  }
+
+  // Executes up to cycles instructions one at a time, stopping early on one
+  // that stops the CPU. Returns the number of instructions executed.
+  static int Step(State &state, int cycles) {
+    int executed = 0;
+    while (executed < cycles) {
+      ExecuteInstruction(state);
+      if (state.stop != StopReason::None) [[unlikely]] {
+        break;
+      }
+      executed++;
+    }
+    return executed;
+  }
+
+  // Executes cycles instructions, or up to the first one that stops the CPU
+  // (see StopReason), and returns the number executed. pc is kept in a local
+  // while running straight line code, and only written back to State (with
+  // nextPC = pc + 4) before handlers that read or set it, like jumps and
+  // branches, when returning, or when a memory callback throws. A taken
+  // jump/branch leaves its target in nextPC, so its delay slot is fetched from
+  // pc and run with the transfer already applied, and the local pc carries on
+  // from the target. Emulated kernel calls (see KernelHLE) are picked up on
+  // landing at a target.
+  //
+  // With computed goto support, every slot of the primary, secondary and
+  // BCONDZ tables gets its own label, and each one ends by fetching and
+  // jumping straight to the next instruction's label, so there are no
+  // call/returns into the tables and every handler gets its own indirect
+  // branch to predict.
+  static int Run(State &state, int cycles) {
+    const int budget = std::max(cycles, 0);
+    uint32_t pc = state.pc;
+    bool delaySlot = false; // State holds a pending transfer, pc is stale
+    state.stop = StopReason::None;
+
+    try {
+#ifdef MEEPS_COMPUTED_GOTO
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#ifdef __clang__
+#pragma GCC diagnostic ignored "-Wgnu-label-as-value"
+#endif
+// Slot indices are two digit octal literals (017 == 15), which lets a small
+// macro enumerate 64 labels
+#define MEEPS_OCTAL8(M, table, hi)                                             \
+  M(table, hi##0) M(table, hi##1) M(table, hi##2) M(table, hi##3)              \
+  M(table, hi##4) M(table, hi##5) M(table, hi##6) M(table, hi##7)
+#define MEEPS_OCTAL64(M, table)                                                \
+  MEEPS_OCTAL8(M, table, 00) MEEPS_OCTAL8(M, table, 01)                        \
+  MEEPS_OCTAL8(M, table, 02) MEEPS_OCTAL8(M, table, 03)                        \
+  MEEPS_OCTAL8(M, table, 04) MEEPS_OCTAL8(M, table, 05)                        \
+  MEEPS_OCTAL8(M, table, 06) MEEPS_OCTAL8(M, table, 07)
+#define MEEPS_LABEL(table, slot) &&table##_##slot,
+#define MEEPS_DISPATCH()                                                       \
+  if (cycles-- <= 0) {                                                         \
+    goto done;                                                                 \
+  }                                                                            \
+  DPRINT("PC: {:08X}\n", pc);                                                  \
+  instr = FetchInstruction<Memory>(state, pc);                                 \
+  pc += 4;                                                                     \
+  goto *primaryLabels[instr.i.op]
+// Handlers that use pc/nextPC get them written back first, and the ones
+// that may stop the CPU are checked after
+#define MEEPS_CALL(table, slot)                                                \
+  if constexpr (table##Flags[slot] & UsesPC) {                                 \
+    state.pc = pc;                                                             \
+    state.nextPC = pc + 4;                                                     \
+    table[slot](state, instr);                                                 \
+    goto resync;                                                               \
+  }                                                                            \
+  else if constexpr (table##Flags[slot] & CanStop) {                           \
+    table[slot](state, instr);                                                 \
+    if (state.stop != StopReason::None) [[unlikely]] {                         \
+      goto stopped;                                                            \
+    }                                                                          \
+    MEEPS_DISPATCH();                                                          \
+  }                                                                            \
+  else {                                                                       \
+    table[slot](state, instr);                                                 \
+    MEEPS_DISPATCH();                                                          \
+  }
+#define MEEPS_HANDLER(table, slot) table##_##slot : MEEPS_CALL(table, slot)
+// SPECIAL and BCONDZ jump on into their sub-tables instead of calling
+#define MEEPS_PRIMARY_HANDLER(table, slot)                                     \
+  table##_##slot : if constexpr (slot == 0) {                                  \
+    goto *secondaryLabels[instr.r.func];                                       \
+  }                                                                            \
+  else if constexpr (slot == 1) {                                              \
+    goto *branchLabels[BranchTableHash(instr)];                                \
+  }                                                                            \
+  else {                                                                       \
+    MEEPS_CALL(table, slot)                                                    \
+  }
+
+      static void *const primaryLabels[] = {
+          MEEPS_OCTAL64(MEEPS_LABEL, primaryTable)};
+      static void *const secondaryLabels[] = {
+          MEEPS_OCTAL64(MEEPS_LABEL, secondaryTable)};
+      static void *const branchLabels[] = {
+          MEEPS_LABEL(branchTable, 00) MEEPS_LABEL(branchTable, 01)
+          MEEPS_LABEL(branchTable, 02) MEEPS_LABEL(branchTable, 03)};
+
+      Instruction instr = 0;
+      goto resync;
+
+      MEEPS_OCTAL64(MEEPS_PRIMARY_HANDLER, primaryTable)
+      MEEPS_OCTAL64(MEEPS_HANDLER, secondaryTable)
+      MEEPS_HANDLER(branchTable, 00)
+      MEEPS_HANDLER(branchTable, 01)
+      MEEPS_HANDLER(branchTable, 02)
+      MEEPS_HANDLER(branchTable, 03)
+
+    // Picks up after a handler that used State's pc/nextPC
+    resync:
+      pc = state.pc;
+      if (state.nextPC == pc + 4) {
+        if (state.hle && KernelHLE::IsEntry(pc) && cycles > 0 &&
+            state.hle->Call<Memory>(state)) [[unlikely]] {
+          cycles--;
+          goto resync;
+        }
+        MEEPS_DISPATCH();
+      }
+      if (cycles-- <= 0) {
+        return budget;
+      }
+      DPRINT("PC: {:08X}\n", pc);
+      delaySlot = true;
+      instr = FetchInstruction<Memory>(state, pc);
+      // Stepped if it leads to a kernel call, which is checked for once it ran
+      if (state.hle && KernelHLE::IsEntry(state.nextPC)) [[unlikely]] {
+        ExecuteInstruction(state);
+        delaySlot = false;
+        if (state.stop != StopReason::None) [[unlikely]] {
+          return budget - cycles - 1;
+        }
+        goto resync;
+      }
+      delaySlot = false;
+      pc = state.nextPC;
+      goto *primaryLabels[instr.i.op];
+
+    // The stopping instruction is undone. A delay slot still has State right
+    // before it, with the transfer pending.
+    stopped:
+      if (state.nextPC != pc || state.nextPC == state.pc + 4) {
+        state.pc = pc - 4;
+        state.nextPC = pc;
+      }
+      return budget - cycles - 1;
+
+    done:
+#undef MEEPS_PRIMARY_HANDLER
+#undef MEEPS_HANDLER
+#undef MEEPS_CALL
+#undef MEEPS_DISPATCH
+#undef MEEPS_LABEL
+#undef MEEPS_OCTAL64
+#undef MEEPS_OCTAL8
+#pragma GCC diagnostic pop
+#else
+      delaySlot = state.nextPC != pc + 4;
+      while (cycles-- > 0) {
+        if (state.hle) [[unlikely]] {
+          if (delaySlot && KernelHLE::IsEntry(state.nextPC)) {
+            ExecuteInstruction(state);
+            pc = state.pc;
+            delaySlot = state.nextPC != pc + 4;
+            continue;
+          }
+          if (!delaySlot && KernelHLE::IsEntry(pc)) {
+            state.pc = pc;
+            state.nextPC = pc + 4;
+            if (state.hle->Call<Memory>(state)) {
+              pc = state.pc;
+              continue;
+            }
+          }
+        }
+
+        DPRINT("PC: {:08X}\n", pc);
+        const uint32_t fetchPC = pc;
+        Instruction instr = FetchInstruction<Memory>(state, pc);
+        if (delaySlot) {
+          delaySlot = false;
+          pc = state.nextPC;
+        } else {
+          pc += 4;
+        }
+
+        if (!(GetFlags(instr) & UsesPC)) {
+          primaryTable[instr.i.op](state, instr);
+          if (state.stop != StopReason::None) [[unlikely]] {
+            state.pc = fetchPC;
+            state.nextPC = pc;
+            return budget - cycles - 1;
+          }
+          continue;
+        }
+
+        state.pc = pc;
+        state.nextPC = pc + 4;
+        primaryTable[instr.i.op](state, instr);
+        pc = state.pc;
+        delaySlot = state.nextPC != pc + 4;
+      }
+      if (delaySlot) {
+        return budget;
+      }
+#endif
+      state.pc = pc;
+      state.nextPC = pc + 4;
+      return budget;
+    } catch (...) {
+      if (!delaySlot) {
+        state.pc = pc;
+        state.nextPC = pc + 4;
+      }
+      throw;
+    }
+  }
+
+  // Steps the block FetchBlock would return for state.pc, stopping early if
+  // cycles run out or the CPU stops. Returns the number of instructions
+  // executed.
+  static int StepBlock(State &state, int cycles, size_t maxSize) {
+    int executed = 0;
+    bool delaySlot = false;
+
+    while (executed < cycles) {
+      const Instruction instr = FetchInstruction<Memory>(state, state.pc);
+      ExecuteInstruction(state);
+      if (state.stop != StopReason::None) [[unlikely]] {
+        break;
+      }
+      executed++;
+
+      if (delaySlot) {
+        break;
+      }
+
+      if (IsControlTransfer(instr)) {
+        delaySlot = true;
+      } else if ((size_t)executed >= maxSize) {
+        break;
+      }
+    }
+
+    return executed;
+  }
+
+  // Resolves an instruction straight to its handler, skipping the SPECIAL and
+  // BCONDZ sub-tables, so callers can predecode instructions ahead of time
+  static interpreterfp Decode(Instruction instr) {
+    switch (instr.i.op) {
+    case 0b00'0000:
+      return secondaryTable[instr.r.func];
+    case 0b00'0001:
+      return branchTable[BranchTableHash(instr)];
+    default:
+      return primaryTable[instr.i.op];
+    }
+  }
+
+  // True for jumps and branches, i.e. instructions followed by a delay slot
+  static bool IsControlTransfer(Instruction instr) {
+    if (instr.i.op == 0b00'0000) {
+      return instr.r.func == 0b00'1000 || instr.r.func == 0b00'1001; // JR, JALR
+    }
+    return instr.i.op >= 0b00'0001 && instr.i.op <= 0b00'0111;
+  }
+
+  // True for instructions that may stop the CPU (see StopReason). Overflows
+  // and MTC0/RFE only count with exceptions, and misaligned halfword/word
+  // loads/stores never do, callers check those inline.
+  static bool MayStop(Instruction instr, bool exceptions = false) {
+    const interpreterfp handler = Decode(instr);
+
+    if (handler == &COPInstruction<COP::COP0>) {
+      const uint32_t rs = instr.i.rs;
+      if (ValueIsIn(rs, 0b0'0100u, 0b1'0000u)) { // MTC, RFE
+        return exceptions; // May unmask an interrupt
+      }
+      return rs != 0b0'0000u; // MFC
+    }
+    if (ValueIsIn(handler, &ArithmeticInstruction<Arithmetic::ADD>,
+                  &ArithmeticInstruction<Arithmetic::ADDI>,
+                  &ArithmeticInstruction<Arithmetic::SUB>)) {
+      return exceptions;
+    }
+    if (ValueIsIn(handler, &ALoadInstruction<ALoad::LH>,
+                  &ALoadInstruction<ALoad::LHU>, &ALoadInstruction<ALoad::LW>,
+                  &AStoreInstruction<AStore::SH>,
+                  &AStoreInstruction<AStore::SW>)) {
+      return false;
+    }
+
+    return GetFlags(instr) & CanStop;
+  }
+
+  // Fetches the basic block starting at pc: everything up to and including the
+  // delay slot of the first jump/branch, or maxSize instructions of straight
+  // line code. A delay slot is never split from its jump/branch.
+  static std::vector<Instruction> FetchBlock(State &state, uint32_t pc,
+                                             size_t maxSize) {
+    std::vector<Instruction> block;
+    bool delaySlot = false;
+
+    while (true) {
+      Instruction instr = FetchInstruction<Memory>(state, pc);
+      block.push_back(instr);
+      pc += 4;
+
+      if (delaySlot) {
+        break;
+      }
+
+      if (IsControlTransfer(instr)) {
+        delaySlot = true;
+      } else if (block.size() >= maxSize) {
+        break;
+      }
+    }
+
+    return block;
+  }
+
+  // Stops the CPU on a misaligned halfword/word access, if guest exceptions
+  // are on. Returns false to let the access go ahead otherwise.
+  static bool AddressError(State &state, uint32_t addr, bool store) {
+    if (!state.exceptions) {
+      return false;
+    }
+    state.badVaddr = addr;
+    state.stop =
+        store ? StopReason::AddressErrorStore : StopReason::AddressErrorLoad;
+    return true;
   }
 
   // TODO: load delays maybe?
   template <ALoad T>
   static void ALoadInstruction(State &state, Instruction instr) {
-    // TODO: unaligned addr exception
     uint32_t value;
     uint32_t dest = instr.i.rt;
     uint32_t addr = state.GetGPR(instr.i.rs) + (int32_t)(int16_t)instr.i.imm;
 
+    constexpr uint32_t alignment =
+        T == ALoad::LW ? 3 : ValueIsIn(T, ALoad::LH, ALoad::LHU) ? 1 : 0;
+    if ((addr & alignment) && AddressError(state, addr, false)) [[unlikely]] {
+      return;
+    }
+
     if constexpr (T == ALoad::LB) {
-      value = (int32_t)(int8_t)state.read8(addr);
+      value = (int32_t)(int8_t)DataMemory::Read8(state, addr);
     } else if constexpr (T == ALoad::LBU) {
-      value = state.read8(addr);
+      value = DataMemory::Read8(state, addr);
     } else if constexpr (T == ALoad::LH) {
-      value = (int32_t)(int16_t)state.read16(addr);
+      value = (int32_t)(int16_t)DataMemory::Read16(state, addr);
     } else if constexpr (T == ALoad::LHU) {
-      value = state.read16(addr);
+      value = DataMemory::Read16(state, addr);
     } else if constexpr (T == ALoad::LW) {
-      value = state.read32(addr);
+      value = DataMemory::Read32(state, addr);
     }
 
     state.SetGPR(dest, value);
@@ -108,23 +463,34 @@ public:
 
   template <AStore T>
   static void AStoreInstruction(State &state, Instruction instr) {
-    // TODO: unaligned addr exception
     uint32_t value = state.GetGPR(instr.i.rt);
     uint32_t addr = state.GetGPR(instr.i.rs) + (int32_t)(int16_t)instr.i.imm;
+
+    constexpr uint32_t alignment =
+        T == AStore::SW ? 3 : T == AStore::SH ? 1 : 0;
+    if ((addr & alignment) && AddressError(state, addr, true)) [[unlikely]] {
+      return;
+    }
+
+    // With the cache isolated, stores never reach memory
+    if (state.systemControl.CacheIsolated()) [[unlikely]] {
+      return;
+    }
+
     if constexpr (T == AStore::SB) {
-      state.write8(addr, value & 0xff);
+      DataMemory::Write8(state, addr, value & 0xff);
     } else if constexpr (T == AStore::SH) {
-      state.write16(addr, value & 0xffff);
+      DataMemory::Write16(state, addr, value & 0xffff);
     } else if constexpr (T == AStore::SW) {
-      state.write32(addr, value);
+      DataMemory::Write32(state, addr, value);
     }
+    state.CheckCodeWrite(addr);
   }
 
   template <ULoadStore T>
   static void ULoadStoreInstruction(State &state, Instruction instr) {
     // I really don't get this...
-
-    throw std::invalid_argument("[Unaligned Load Store] Unimplemented!");
+    state.stop = StopReason::Unimplemented;
   }
 
   template <Arithmetic T>
@@ -141,10 +507,20 @@ public:
 
     if constexpr (ValueIsIn(T, Arithmetic::ADD, Arithmetic::ADDI,
                             Arithmetic::SUB)) {
-      // signed
-      // TODO: how do you detect overflow again?
+      // signed, overflow leaves the destination untouched
       operand = T == Arithmetic::ADDI ? (int32_t)(int16_t)instr.i.imm
                                       : state.GetGPR(instr.i.rt);
+      int32_t result;
+      const bool overflow =
+          T == Arithmetic::SUB
+              ? SubOverflows((int32_t)value, (int32_t)operand, result)
+              : AddOverflows((int32_t)value, (int32_t)operand, result);
+      if (overflow && state.exceptions) [[unlikely]] {
+        state.stop = StopReason::Overflow;
+        return;
+      }
+      state.SetGPR(dest, result);
+      return;
     } else {
       // unsigned
       // TODO: check ternary constexpr stuff on godbolt
@@ -412,16 +788,18 @@ public:
     if constexpr (T == COP::COP0) {
       switch (instr.i.rs) {
       case 0b0'0000: // MFC (data)
-        state.SetGPR(instr.i.rt, state.cop0->GetReg(instr.r.rd));
+        state.SetGPR(instr.i.rt, state.GetCOP0(instr.r.rd));
         break;
       case 0b0'0100: // MTC (data)
-        // something like: state.cop0.SetReg(instr.i.rd,
-        // state.GetGPR(instr.i.rt))
-        state.cop0->SetReg(instr.r.rd, state.GetGPR(instr.i.rt));
+        state.SetCOP0(instr.r.rd, state.GetGPR(instr.i.rt));
+        CheckInterrupt(state);
         break;
-      case 0b1'0000: // RFE
-        // TODO: exceptions do be confusing
+      case 0b1'0000: { // RFE pops the KU/IE mode stack in SR
+        const uint32_t sr = state.GetCOP0(COP0::SR);
+        state.WriteCOP0(COP0::SR, (sr & ~0xfu) | ((sr >> 2) & 0xf));
+        CheckInterrupt(state);
         break;
+      }
       default:
         InvalidInstruction<Invalid::COP>(state, instr);
         break;
@@ -429,73 +807,77 @@ public:
     }
 
     if constexpr (T == COP::COP2) {
-      throw std::invalid_argument("[COP2 Instruction] Not Implemented Yet!\n");
+      state.stop = StopReason::Unimplemented;
+    }
+  }
+
+  // An interrupt unmasked mid-slice is taken right after the instruction
+  // that unmasked it, see CPU::DeliverException
+  static void CheckInterrupt(State &state) {
+    if (state.exceptions && state.InterruptPending()) [[unlikely]] {
+      state.stop = StopReason::Interrupt;
     }
   }
 
   template <LWC T> static void LWCInstruction(State &state, Instruction instr) {
-    const uint32_t addr =
-        state.GetGPR(instr.i.rs) + (int32_t)(int16_t)instr.i.imm;
-    const uint32_t value = state.read32(addr);
     if constexpr (T == LWC::COP0) {
-      // using interface, something like: state.cop0.SetDataReg(instr.i.rt);
-      state.cop0->SetReg(instr.i.rt, value);
+      const uint32_t addr =
+          state.GetGPR(instr.i.rs) + (int32_t)(int16_t)instr.i.imm;
+      const uint32_t value = DataMemory::Read32(state, addr);
+      state.SetCOP0(instr.i.rt, value);
     }
 
     if constexpr (T == LWC::COP2) {
-      throw std::invalid_argument("[COP2 LWC] Not Implemented Yet!\n");
+      state.stop = StopReason::Unimplemented;
     }
   }
 
   template <SWC T> static void SWCInstruction(State &state, Instruction instr) {
-    const uint32_t addr =
-        state.GetGPR(instr.i.rs) + (int32_t)(int16_t)instr.i.imm;
-    const uint32_t value = state.cop0->GetReg(instr.i.rt);
-
     if constexpr (T == SWC::COP0) {
-      state.write32(addr, value);
+      const uint32_t addr =
+          state.GetGPR(instr.i.rs) + (int32_t)(int16_t)instr.i.imm;
+      if (!state.systemControl.CacheIsolated()) {
+        DataMemory::Write32(state, addr, state.GetCOP0(instr.i.rt));
+        state.CheckCodeWrite(addr);
+      }
     }
 
     if constexpr (T == SWC::COP2) {
-      throw std::invalid_argument("[COP2 SWC] Not Implemented Yet!\n");
+      state.stop = StopReason::Unimplemented;
     }
   }
 
   template <Exception T>
-  static void ExceptionInstruction(State &state, Instruction instr) {
-    throw std::invalid_argument(fmt::format(
-        "[SYSCALL / BREAK] PC: {:08X} NEXTPC: {:08X} OPCODE: {:08X}\n",
-        state.pc, state.nextPC, instr.value));
+  static void ExceptionInstruction(State &state, Instruction) {
+    state.stop = T == Exception::SYSCALL ? StopReason::Syscall : StopReason::Break;
   }
 
+  // Unused opcodes, and COP0 ones that aren't MFC/MTC/RFE
   template <Invalid T>
-  static void InvalidInstruction(State &state, Instruction instr) {
-    if constexpr (T == Invalid::NA) {
-      throw std::invalid_argument(fmt::format(
-          "[INVALID INSTRUCTION] PC: {:08X} NEXTPC: {:08X} OPCODE: {:08X}\n",
-          state.pc, state.nextPC, instr.value));
-    } else if (T == Invalid::COP) {
-      throw std::invalid_argument(fmt::format(
-          "[INVALID DECODING COP INSTRUCTION] PC: {:08X} NEXTPC: {:08X} OPCODE: "
-          "{:08X}\n",
-          state.pc, state.nextPC, instr.value));
-    }
+  static void InvalidInstruction(State &state, Instruction) {
+    state.stop = StopReason::ReservedInstruction;
   }
 
 private:
+  using DataMemory = ScratchpadMemory<Memory>; // Loads and stores
+
 #define instr(type, op) type##Instruction<type::op>
   static void SecondaryTableLookup(State &state, Instruction instr) {
     secondaryTable[instr.r.func](state, instr);
   }
 
+  static size_t BranchTableHash(Instruction instr) {
+    return (((instr.i.rt >> 1) == 0x8) << 1) | (instr.i.rt & 1);
+  }
+
   static void BCondZ(State &state, Instruction instr) {
-    static constexpr std::array<interpreterfp, 4> branchTable{
-        instr(Branch, BLTZ), instr(Branch, BGEZ), instr(Branch, BLTZAL),
-        instr(Branch, BGEZAL)};
-    size_t hash = (((instr.i.rt >> 1) == 0x8) << 1) | (instr.i.rt & 1);
-    branchTable[hash](state, instr);
+    branchTable[BranchTableHash(instr)](state, instr);
   }
 
+  static constexpr std::array<interpreterfp, 4> branchTable{
+      instr(Branch, BLTZ), instr(Branch, BGEZ), instr(Branch, BLTZAL),
+      instr(Branch, BGEZAL)};
+
   // clang-format off
   static constexpr std::array<interpreterfp, 64> primaryTable = {
     SecondaryTableLookup,      BCondZ,                   instr(Jump, J),          instr(Jump, JAL),         // first column
@@ -535,6 +917,61 @@ private:
   };
 // clang-format on
 #undef instr
+
+  // What the handler in each table slot does besides its own work, by opcode
+  // so Run can branch on it at compile time: UsesPC ones read or set
+  // pc/nextPC, which Run otherwise only keeps in a local (jumps and
+  // branches), and CanStop ones may set State::stop, all of COP0 included
+  static constexpr uint8_t UsesPC = 1 << 0;
+  static constexpr uint8_t CanStop = 1 << 1;
+
+  template <size_t N>
+  static constexpr std::array<uint8_t, N>
+  MakeFlags(std::initializer_list<size_t> usesPC,
+            std::initializer_list<size_t> canStop) {
+    std::array<uint8_t, N> flags{};
+    for (size_t slot : usesPC) {
+      flags[slot] |= UsesPC;
+    }
+    for (size_t slot : canStop) {
+      flags[slot] |= CanStop;
+    }
+    return flags;
+  }
+
+  // clang-format off
+  static constexpr std::array<uint8_t, 64> primaryTableFlags = MakeFlags<64>(
+      {01, 02, 03, 04, 05, 06, 07}, // BCONDZ, J, JAL, BEQ, BNE, BLEZ, BGTZ
+      {010,                                         // ADDI
+       020, 021, 022, 023, 024, 025, 026, 027,      // COP0-COP3, unused
+       030, 031, 032, 033, 034, 035, 036, 037,      // Unused
+       041, 042, 043, 045, 046, 047,                // LH, LWL, LW, LHU, LWR
+       051, 052, 053, 054, 055, 056, 057,           // SH, SWL, SW, SWR
+       061, 062, 063, 064, 065, 066, 067,           // LWC1-LWC3, unused
+       071, 072, 073, 074, 075, 076, 077});         // SWC1-SWC3, unused
+  static constexpr std::array<uint8_t, 64> secondaryTableFlags = MakeFlags<64>(
+      {010, 011}, // JR, JALR
+      {01, 05, 012, 013, 016, 017,                  // Unused
+       014, 015,                                    // SYSCALL, BREAK
+       024, 025, 026, 027, 034, 035, 036, 037,      // Unused
+       040, 042,                                    // ADD, SUB
+       050, 051, 054, 055, 056, 057,                // Unused
+       060, 061, 062, 063, 064, 065, 066, 067,
+       070, 071, 072, 073, 074, 075, 076, 077});
+  static constexpr std::array<uint8_t, 4> branchTableFlags = MakeFlags<4>(
+      {0, 1, 2, 3}, {});
+  // clang-format on
+
+  static uint8_t GetFlags(Instruction instr) {
+    switch (instr.i.op) {
+    case 0:
+      return secondaryTableFlags[instr.r.func];
+    case 1:
+      return branchTableFlags[BranchTableHash(instr)];
+    default:
+      return primaryTableFlags[instr.i.op];
+    }
+  }
 };
 
 } // namespace Meeps
\ No newline at end of file
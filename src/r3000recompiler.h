@@ -0,0 +1,840 @@
+#pragma once
+#include "blockcache.h"
+#include "fastmem.h"
+#include "ir.h"
+#include "irpasses.h"
+#include "kernelhle.h"
+#include "memory.h"
+#include "r3000interpreter.h"
+#include "state.h"
+#include "tiering.h"
+#include "trace.h"
+#include "x64emitter.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+
+namespace Meeps {
+
+// Translates guest basic blocks into x86-64 code, going through the same
+// optimized IR as the cached interpreter. Guest registers live in State, rbx
+// holds the State pointer for the whole block, and IR::Op::Interpret calls the
+// matching R3000Interpreter handler.
+//
+// JIT frames have no unwind info, so nothing called from a block may throw,
+// and memory callbacks must not throw in this mode. Instructions that may
+// stop the CPU end the block and are stepped by the interpreter instead,
+// except for overflows and misaligned accesses with guest exceptions on,
+// which return early like guards.
+//
+// Cold code is stepped by the interpreter until it gets hot, see
+// HotnessCounters. With tracing on, hot code is recorded into traces, whose
+// guards return early with the number of instructions run so far.
+template <MemoryPolicy Memory = PointerMemory> class R3000Recompiler {
+public:
+  static constexpr size_t MaxBlockSize = 64;
+  static constexpr size_t MaxTraceSize = 256;
+  static constexpr size_t CodeCacheSize = 32 * 1024 * 1024;
+
+  R3000Recompiler() : emitter(CodeCacheSize) {}
+
+  // Returns the number of instructions executed, which is less than cycles
+  // if the CPU stopped (see StopReason)
+  int Run(State &state, int cycles) {
+    const int budget = std::max(cycles, 0);
+    Block *block = nullptr; // Last block run to completion
+    state.stop = StopReason::None;
+
+    while (cycles > 0 && state.stop == StopReason::None) {
+      // Blocks built from code that was stored to go before running any more
+      if (state.writtenCodeCount) [[unlikely]] {
+        cache.InvalidateWritten(state);
+        block = nullptr;
+      }
+
+      // Blocks assume sequential flow, pending branches are stepped instead
+      if (state.nextPC != state.pc + 4) {
+        const int executed = Interpreter::Step(state, 1);
+        cycles -= executed;
+        stats.steppedInstructions += executed;
+        block = nullptr;
+        continue;
+      }
+
+      if (state.hle && KernelHLE::IsEntry(state.pc) &&
+          state.hle->Call<Memory>(state)) [[unlikely]] {
+        cycles--;
+        block = nullptr;
+        continue;
+      }
+
+      block = GetBlock(state, block);
+      if (!block) {
+        const int executed = RunCold(state, cycles);
+        cycles -= executed;
+        stats.steppedInstructions += executed;
+        continue;
+      }
+
+      if (!block->payload) {
+        const int executed = Interpreter::Step(state, 1);
+        cycles -= executed;
+        stats.steppedInstructions += executed;
+        block = nullptr;
+        continue;
+      }
+
+      // Blocks can't be stopped halfway, so a slice ending inside of one is
+      // stepped to completion rather than compiling a block for each tail
+      if (block->size > (uint32_t)cycles) {
+        const int executed = Interpreter::Step(state, cycles);
+        cycles -= executed;
+        stats.steppedInstructions += executed;
+        break;
+      }
+
+      const uint32_t executed = block->payload(&state);
+      if (executed != block->size) {
+        block = nullptr; // Side exits aren't linked
+      }
+      cycles -= executed;
+      stats.blockInstructions += executed;
+
+      // Every further iteration of an idle loop would do the same, so the
+      // ones that fit are skipped and only the tail is stepped
+      if (block && block->idle && state.pc == block->start) {
+        const int skipped = cycles - cycles % (int)block->size;
+        cycles -= skipped;
+        stats.skippedInstructions += skipped;
+      }
+    }
+
+    return budget - std::max(cycles, 0);
+  }
+
+  // Must be called whenever guest code that may have been compiled is modified
+  void Flush() {
+    cache.Clear();
+    hotness.Clear();
+    emitter.Reset();
+  }
+
+  // Drops the blocks overlapping [addr, addr + size) and unlinks them. Their
+  // host code is only reclaimed by the next full Flush.
+  void Invalidate(uint32_t addr, uint32_t size) {
+    cache.Invalidate(addr, size);
+    hotness.Invalidate(addr, size);
+  }
+
+  size_t GetBlockCount() const { return cache.GetBlockCount(); }
+
+  void SetHotThreshold(uint32_t threshold) { hotness.SetThreshold(threshold); }
+  uint32_t GetHotThreshold() const { return hotness.GetThreshold(); }
+  const TierStats &GetTierStats() const { return stats; }
+
+  // Records traces from hot code instead of compiling single blocks
+  void SetTracing(bool enabled) { tracing = enabled; }
+
+  // Applies to blocks compiled from now on
+  void SetIROptions(const IR::Options &options) { irOptions = options; }
+
+private:
+  using Interpreter = R3000Interpreter<Memory>;
+  using DataMemory = ScratchpadMemory<Memory>;
+  using BlockFn = uint32_t (*)(State *); // Returns instructions executed
+  using Reg = X64::Reg;
+
+  // nullptr if the first instruction has to be interpreted
+  using Cache = BlockCache<BlockFn>;
+  using Block = typename Cache::Block;
+
+  static constexpr size_t MaxInstrBytes = 256;
+
+  static constexpr int32_t GPROffset(size_t reg) {
+    return (int32_t)(offsetof(State, gpr) + reg * sizeof(uint32_t));
+  }
+  static constexpr int32_t PCOffset = offsetof(State, pc);
+  static constexpr int32_t NextPCOffset = offsetof(State, nextPC);
+  static constexpr int32_t StopOffset = offsetof(State, stop);
+  static constexpr int32_t CodePagesOffset = offsetof(State, codePages);
+  static constexpr int32_t ScratchpadBaseOffset =
+      offsetof(State, scratchpadBase);
+  static constexpr int32_t SROffset =
+      offsetof(State, systemControl) + offsetof(SystemControl, regs) +
+      COP0::SR * sizeof(uint32_t);
+
+#ifdef MEEPS_FASTMEM
+  static constexpr bool UseFastmem = std::is_same_v<Memory, FastmemMemory>;
+#else
+  static constexpr bool UseFastmem = false;
+#endif
+
+  // Follows the link out of the previous block if there is one, and links it
+  // up after a lookup otherwise. Returns nullptr if there's no block yet.
+  Block *GetBlock(State &state, Block *previous) {
+    if (previous) {
+      if (Block *next = Cache::Follow(*previous, state.pc)) {
+        return next;
+      }
+    }
+
+    Block *block = cache.Find(state.pc);
+    if (block && previous) {
+      cache.Link(*previous, *block);
+    }
+    return block;
+  }
+
+  // Steps the block at state.pc while it's cold. Once it's hot, it either
+  // gets compiled for the next lookup or a trace is recorded from it.
+  // Returns the number of instructions executed.
+  int RunCold(State &state, int cycles) {
+    const uint32_t pc = state.pc;
+    if (!hotness.Enter(pc)) {
+      return Interpreter::StepBlock(state, cycles, MaxBlockSize);
+    }
+
+    if (!tracing) {
+      CompileBlock(state, pc);
+      return 0;
+    }
+
+    int executed;
+    Trace trace = RecordTrace<Memory>(
+        state, cycles, executed, MaxBlockSize, MaxTraceSize,
+        [this](uint32_t next) { return cache.Find(next) != nullptr; });
+    if (!trace.empty()) {
+      CompileTrace(state, std::move(trace));
+    }
+    return executed;
+  }
+
+  // Number of leading instructions that can be compiled
+  static size_t CompilableSize(const std::vector<Instruction> &instrs) {
+    size_t size = 0;
+    while (size < instrs.size() && !Interpreter::MayStop(instrs[size])) {
+      size++;
+    }
+    return size;
+  }
+
+  Block &CompileBlock(State &state, uint32_t pc) {
+    std::vector<Instruction> instrs =
+        Interpreter::FetchBlock(state, pc, MaxBlockSize);
+
+    const size_t size = CompilableSize(instrs);
+    stats.blocksTranslated++;
+    if (!size) {
+      return cache.Insert(pc, instrs, 0, nullptr); // Not built from code
+    }
+
+    IR::Block ir = IR::Translate(instrs, pc, size, state.exceptions);
+    Block &block = cache.Insert(pc, instrs, (uint32_t)size, Emit(ir));
+    block.idle = irOptions.idleLoopSkipping && IR::IsIdleLoop(ir);
+    Cache::MarkCode(state, block);
+    return block;
+  }
+
+  // Like blocks, traces end before the first instruction that may stop the CPU
+  void CompileTrace(State &state, Trace trace) {
+    const uint32_t head = trace.front().pc;
+    for (size_t i = 0; i < trace.size(); i++) {
+      const size_t size = CompilableSize(trace[i].instrs);
+      if (size < trace[i].instrs.size()) {
+        auto &instrs = trace[i].instrs;
+        instrs.erase(instrs.begin() + size, instrs.end());
+        trace.resize(size ? i + 1 : i);
+        break;
+      }
+    }
+
+    if (trace.empty()) {
+      CompileBlock(state, head);
+      return;
+    }
+
+    IR::Block ir = IR::TranslateTrace(trace, state.exceptions);
+    stats.tracesTranslated++;
+    Block &block = cache.InsertTrace(trace, Emit(ir));
+    block.idle = irOptions.idleLoopSkipping && IR::IsIdleLoop(ir);
+    Cache::MarkCode(state, block);
+  }
+
+  BlockFn Emit(IR::Block &ir) {
+    IR::Optimize(ir, irOptions);
+
+    if (emitter.Remaining() < (ir.insts.size() + 2) * MaxInstrBytes) {
+      Flush();
+    }
+
+    BlockFn code = (BlockFn)emitter.GetCursor();
+    EmitPrologue();
+    for (const IR::Inst &inst : ir.insts) {
+      EmitInst(inst);
+    }
+    EmitEpilogue(ir.size);
+    return code;
+  }
+
+  void EmitPrologue() {
+    // The return address leaves rsp 8 off of 16 byte alignment, pushing rbx
+    // realigns it for the calls made by the block
+    emitter.Push(Reg::RBX);
+    if (X64::ABIShadowSpace) {
+      emitter.AluImm64(X64::ALU::SUB, Reg::RSP, X64::ABIShadowSpace);
+    }
+    emitter.Mov64(Reg::RBX, X64::ABIParam1);
+  }
+
+  void EmitEpilogue(uint32_t executed) {
+    emitter.MovImm(Reg::RAX, executed);
+    if (X64::ABIShadowSpace) {
+      emitter.AluImm64(X64::ALU::ADD, Reg::RSP, X64::ABIShadowSpace);
+    }
+    emitter.Pop(Reg::RBX);
+    emitter.Ret();
+  }
+
+  void EmitFallback(const IR::Inst &inst) {
+    // Handlers expect the pc/nextPC shuffle to have already happened
+    if (!inst.delaySlot) {
+      emitter.MovStoreImm(Reg::RBX, PCOffset, inst.addr + 4);
+      emitter.MovStoreImm(Reg::RBX, NextPCOffset, inst.addr + 8);
+    }
+
+    emitter.Mov64(X64::ABIParam1, Reg::RBX);
+    emitter.MovImm(X64::ABIParam2, inst.instr.value);
+    emitter.Call(
+        reinterpret_cast<const void *>(Interpreter::Decode(inst.instr)));
+  }
+
+  void EmitInst(const IR::Inst &inst) {
+    using enum IR::Op;
+    using X64::ALU;
+    using X64::Cond;
+    using X64::ShiftOp;
+    const uint32_t dst = inst.dst;
+    const uint32_t src1 = inst.src1;
+    const uint32_t src2 = inst.src2;
+    const uint32_t imm = inst.imm;
+
+    switch (inst.op) {
+    case Const:
+      emitter.MovStoreImm(Reg::RBX, GPROffset(dst), imm);
+      break;
+    case Mov:
+      emitter.MovLoad(Reg::RAX, Reg::RBX, GPROffset(src1));
+      emitter.MovStore(Reg::RBX, GPROffset(dst), Reg::RAX);
+      break;
+    case Add:
+      EmitAluReg(ALU::ADD, dst, src1, src2);
+      break;
+    case Sub:
+      EmitAluReg(ALU::SUB, dst, src1, src2);
+      break;
+    case And:
+      EmitAluReg(ALU::AND, dst, src1, src2);
+      break;
+    case Or:
+      EmitAluReg(ALU::OR, dst, src1, src2);
+      break;
+    case Xor:
+      EmitAluReg(ALU::XOR, dst, src1, src2);
+      break;
+    case Nor:
+      EmitAluReg(ALU::OR, dst, src1, src2);
+      emitter.Not(Reg::RAX);
+      emitter.MovStore(Reg::RBX, GPROffset(dst), Reg::RAX);
+      break;
+    case Slt:
+      EmitCompareReg(Cond::L, dst, src1, src2);
+      break;
+    case Sltu:
+      EmitCompareReg(Cond::B, dst, src1, src2);
+      break;
+    case AddI:
+      EmitAluImm(ALU::ADD, dst, src1, imm);
+      break;
+    case AndI:
+      EmitAluImm(ALU::AND, dst, src1, imm);
+      break;
+    case OrI:
+      EmitAluImm(ALU::OR, dst, src1, imm);
+      break;
+    case XorI:
+      EmitAluImm(ALU::XOR, dst, src1, imm);
+      break;
+    case SltI:
+      EmitCompareImm(Cond::L, dst, src1, imm);
+      break;
+    case SltuI:
+      EmitCompareImm(Cond::B, dst, src1, imm);
+      break;
+    case Sll:
+      EmitShiftImm(ShiftOp::SHL, dst, src1, imm);
+      break;
+    case Srl:
+      EmitShiftImm(ShiftOp::SHR, dst, src1, imm);
+      break;
+    case Sra:
+      EmitShiftImm(ShiftOp::SAR, dst, src1, imm);
+      break;
+    case Sllv:
+      EmitShiftReg(ShiftOp::SHL, dst, src1, src2);
+      break;
+    case Srlv:
+      EmitShiftReg(ShiftOp::SHR, dst, src1, src2);
+      break;
+    case Srav:
+      EmitShiftReg(ShiftOp::SAR, dst, src1, src2);
+      break;
+    case MfHi:
+    case MfLo:
+      emitter.MovLoad(Reg::RAX, Reg::RBX,
+                      inst.op == MfHi ? offsetof(State, hi)
+                                      : offsetof(State, lo));
+      emitter.MovStore(Reg::RBX, GPROffset(dst), Reg::RAX);
+      break;
+    case Load8:
+      EmitLoad(inst, 1, true);
+      break;
+    case Load8U:
+      EmitLoad(inst, 1, false);
+      break;
+    case Load16:
+      EmitLoad(inst, 2, true);
+      break;
+    case Load16U:
+      EmitLoad(inst, 2, false);
+      break;
+    case Load32:
+      EmitLoad(inst, 4, false);
+      break;
+    case Store8:
+      EmitStore(inst, 1);
+      break;
+    case Store16:
+      EmitStore(inst, 2);
+      break;
+    case Store32:
+      EmitStore(inst, 4);
+      break;
+    case Jump:
+      if (dst) {
+        emitter.MovStoreImm(Reg::RBX, GPROffset(dst), inst.addr + 8);
+      }
+      if (inst.fusedSlot) {
+        emitter.MovStoreImm(Reg::RBX, PCOffset, imm);
+      }
+      emitter.MovStoreImm(Reg::RBX, NextPCOffset,
+                          inst.fusedSlot ? imm + 4 : imm);
+      break;
+    case JumpReg:
+      // src1 has to be read before the link in case both are the same
+      emitter.MovLoad(Reg::RAX, Reg::RBX, GPROffset(src1));
+      if (dst) {
+        emitter.MovStoreImm(Reg::RBX, GPROffset(dst), inst.addr + 8);
+      }
+      EmitSetNextPC(Reg::RAX, inst.fusedSlot);
+      break;
+    case Beq:
+      EmitBranch(Cond::E, src1, src2, inst);
+      break;
+    case Bne:
+      EmitBranch(Cond::NE, src1, src2, inst);
+      break;
+    case Blez:
+      EmitBranch(Cond::LE, src1, 0, inst);
+      break;
+    case Bgtz:
+      EmitBranch(Cond::G, src1, 0, inst);
+      break;
+    case Bltz:
+      EmitBranch(Cond::L, src1, 0, inst);
+      break;
+    case Bgez:
+      EmitBranch(Cond::GE, src1, 0, inst);
+      break;
+    case Blt:
+      EmitCompareBranch(Cond::L, Cond::L, inst, false);
+      break;
+    case Bge:
+      EmitCompareBranch(Cond::L, Cond::GE, inst, false);
+      break;
+    case Bltu:
+      EmitCompareBranch(Cond::B, Cond::B, inst, false);
+      break;
+    case Bgeu:
+      EmitCompareBranch(Cond::B, Cond::AE, inst, false);
+      break;
+    case BltI:
+      EmitCompareBranch(Cond::L, Cond::L, inst, true);
+      break;
+    case BgeI:
+      EmitCompareBranch(Cond::L, Cond::GE, inst, true);
+      break;
+    case BltuI:
+      EmitCompareBranch(Cond::B, Cond::B, inst, true);
+      break;
+    case BgeuI:
+      EmitCompareBranch(Cond::B, Cond::AE, inst, true);
+      break;
+    case DelaySlot:
+      // The branch already wrote its target into nextPC
+      emitter.MovLoad(Reg::RAX, Reg::RBX, NextPCOffset);
+      emitter.MovStore(Reg::RBX, PCOffset, Reg::RAX);
+      emitter.AluImm(ALU::ADD, Reg::RAX, 4);
+      emitter.MovStore(Reg::RBX, NextPCOffset, Reg::RAX);
+      break;
+    case Interpret:
+      EmitFallback(inst);
+      // Only overflows and MTC0/RFE unmasking an interrupt get here, the
+      // rest end the block (see CompilableSize)
+      if (Interpreter::MayStop(inst.instr, true)) {
+        emitter.MovLoad(Reg::RAX, Reg::RBX, StopOffset);
+        emitter.AluImm(ALU::AND, Reg::RAX, 0xff);
+        uint8_t *running = emitter.JccShort(Cond::E);
+        EmitStopExit(inst);
+        emitter.Bind(running);
+      }
+      break;
+    case Guard: {
+      emitter.MovLoad(Reg::RAX, Reg::RBX, PCOffset);
+      emitter.AluImm(ALU::CMP, Reg::RAX, imm);
+      uint8_t *onTrace = emitter.JccShort(Cond::E);
+      EmitEpilogue(inst.imm2);
+      emitter.Bind(onTrace);
+      break;
+    }
+    case Exit:
+      emitter.MovStoreImm(Reg::RBX, PCOffset, imm);
+      emitter.MovStoreImm(Reg::RBX, NextPCOffset, imm + 4);
+      break;
+    case ExitBranch:
+      emitter.MovStoreImm(Reg::RBX, PCOffset, imm);
+      break;
+    case Nop:
+      break;
+    }
+  }
+
+  // Writes to $zero have no effect and are dropped entirely, leaving the
+  // result in eax for callers that post-process it. Optimized IR never
+  // contains them, but the check is free at compile time.
+  void EmitAluReg(X64::ALU op, uint32_t dest, uint32_t rs, uint32_t rt) {
+    if (!dest) {
+      return;
+    }
+    emitter.MovLoad(Reg::RAX, Reg::RBX, GPROffset(rs));
+    emitter.MovLoad(Reg::RCX, Reg::RBX, GPROffset(rt));
+    emitter.Alu(op, Reg::RAX, Reg::RCX);
+    emitter.MovStore(Reg::RBX, GPROffset(dest), Reg::RAX);
+  }
+
+  void EmitAluImm(X64::ALU op, uint32_t dest, uint32_t rs, uint32_t imm) {
+    if (!dest) {
+      return;
+    }
+    emitter.MovLoad(Reg::RAX, Reg::RBX, GPROffset(rs));
+    emitter.AluImm(op, Reg::RAX, imm);
+    emitter.MovStore(Reg::RBX, GPROffset(dest), Reg::RAX);
+  }
+
+  void EmitCompareReg(X64::Cond cond, uint32_t dest, uint32_t rs, uint32_t rt) {
+    if (!dest) {
+      return;
+    }
+    emitter.MovLoad(Reg::RAX, Reg::RBX, GPROffset(rs));
+    emitter.MovLoad(Reg::RCX, Reg::RBX, GPROffset(rt));
+    emitter.Alu(X64::ALU::CMP, Reg::RAX, Reg::RCX);
+    emitter.SetCC(cond, Reg::RAX);
+    emitter.MovStore(Reg::RBX, GPROffset(dest), Reg::RAX);
+  }
+
+  void EmitCompareImm(X64::Cond cond, uint32_t dest, uint32_t rs,
+                      uint32_t imm) {
+    if (!dest) {
+      return;
+    }
+    emitter.MovLoad(Reg::RAX, Reg::RBX, GPROffset(rs));
+    emitter.AluImm(X64::ALU::CMP, Reg::RAX, imm);
+    emitter.SetCC(cond, Reg::RAX);
+    emitter.MovStore(Reg::RBX, GPROffset(dest), Reg::RAX);
+  }
+
+  void EmitShiftImm(X64::ShiftOp op, uint32_t dest, uint32_t rt,
+                    uint32_t amount) {
+    if (!dest) {
+      return;
+    }
+    emitter.MovLoad(Reg::RAX, Reg::RBX, GPROffset(rt));
+    emitter.ShiftImm(op, Reg::RAX, amount);
+    emitter.MovStore(Reg::RBX, GPROffset(dest), Reg::RAX);
+  }
+
+  // x86 masks the shift amount in cl to 5 bits, same as MIPS
+  void EmitShiftReg(X64::ShiftOp op, uint32_t dest, uint32_t rt, uint32_t rs) {
+    if (!dest) {
+      return;
+    }
+    emitter.MovLoad(Reg::RCX, Reg::RBX, GPROffset(rs));
+    emitter.MovLoad(Reg::RAX, Reg::RBX, GPROffset(rt));
+    emitter.ShiftCL(op, Reg::RAX);
+    emitter.MovStore(Reg::RBX, GPROffset(dest), Reg::RAX);
+  }
+
+  // nextPC = (rs <cond> rt) ? target : fallthrough, where rt == 0 compares
+  // against $zero
+  void EmitBranch(X64::Cond cond, uint32_t rs, uint32_t rt,
+                  const IR::Inst &inst) {
+    emitter.MovLoad(Reg::RAX, Reg::RBX, GPROffset(rs));
+    if (rt) {
+      emitter.MovLoad(Reg::RCX, Reg::RBX, GPROffset(rt));
+      emitter.Alu(X64::ALU::CMP, Reg::RAX, Reg::RCX);
+    } else {
+      emitter.AluImm(X64::ALU::CMP, Reg::RAX, 0);
+    }
+    EmitSelectTarget(cond, inst);
+  }
+
+  // dst = src1 <less> src2 (or imm2), then branches on <cond> of the same
+  // compare, which setcc/mov leave the flags of
+  void EmitCompareBranch(X64::Cond less, X64::Cond cond, const IR::Inst &inst,
+                         bool immediate) {
+    emitter.MovLoad(Reg::RAX, Reg::RBX, GPROffset(inst.src1));
+    if (immediate) {
+      emitter.AluImm(X64::ALU::CMP, Reg::RAX, inst.imm2);
+    } else {
+      emitter.MovLoad(Reg::RCX, Reg::RBX, GPROffset(inst.src2));
+      emitter.Alu(X64::ALU::CMP, Reg::RAX, Reg::RCX);
+    }
+    emitter.SetCC(less, Reg::RAX);
+    emitter.MovStore(Reg::RBX, GPROffset(inst.dst), Reg::RAX);
+    EmitSelectTarget(cond, inst);
+  }
+
+  void EmitSelectTarget(X64::Cond cond, const IR::Inst &inst) {
+    emitter.MovImm(Reg::RDX, inst.addr + 8);
+    emitter.MovImm(Reg::RCX, inst.imm);
+    emitter.CMov(cond, Reg::RDX, Reg::RCX);
+    EmitSetNextPC(Reg::RDX, inst.fusedSlot);
+  }
+
+  // Goes straight through the delay slot if the DelaySlot op was fused in
+  void EmitSetNextPC(Reg target, bool fusedSlot) {
+    if (fusedSlot) {
+      emitter.MovStore(Reg::RBX, PCOffset, target);
+      emitter.AluImm(X64::ALU::ADD, target, 4);
+    }
+    emitter.MovStore(Reg::RBX, NextPCOffset, target);
+  }
+
+  // Leaves the block right before inst, which stopped the CPU
+  void EmitStopExit(const IR::Inst &inst) {
+    if (inst.delaySlot) {
+      emitter.MovLoad(Reg::RAX, Reg::RBX, PCOffset);
+      emitter.MovStore(Reg::RBX, NextPCOffset, Reg::RAX);
+    } else {
+      emitter.MovStoreImm(Reg::RBX, NextPCOffset, inst.addr + 4);
+    }
+    emitter.MovStoreImm(Reg::RBX, PCOffset, inst.addr);
+    EmitEpilogue(inst.imm2);
+  }
+
+  // Raises an address error and leaves the block if the access is misaligned
+  void EmitAlignmentCheck(const IR::Inst &inst, bool store) {
+    EmitAddress(Reg::RAX, inst);
+    emitter.AluImm(X64::ALU::AND, Reg::RAX, inst.alignMask);
+    uint8_t *aligned = emitter.JccShort(X64::Cond::E);
+    EmitAddress(X64::ABIParam2, inst);
+    emitter.Mov64(X64::ABIParam1, Reg::RBX);
+    emitter.Call(store ? reinterpret_cast<const void *>(&StoreAddressError)
+                       : reinterpret_cast<const void *>(&LoadAddressError));
+    EmitStopExit(inst);
+    emitter.Bind(aligned);
+  }
+
+  // Addresses folded by constant propagation are absolute immediates
+  void EmitAddress(Reg dst, const IR::Inst &inst) {
+    if (!inst.src1) {
+      emitter.MovImm(dst, inst.imm);
+      return;
+    }
+    emitter.MovLoad(dst, Reg::RBX, GPROffset(inst.src1));
+    if (inst.imm) {
+      emitter.AluImm(X64::ALU::ADD, dst, inst.imm);
+    }
+  }
+
+  // The load is performed even for $zero, it may have side effects
+  void EmitLoad(const IR::Inst &inst, size_t size, bool sign) {
+    if (inst.alignMask) {
+      EmitAlignmentCheck(inst, false);
+    }
+    if constexpr (UseFastmem) {
+      uint8_t *scratchpad = EmitScratchpadCheck(inst);
+      EmitFastmemAccess(inst, size, false);
+      if (sign && size == 1) {
+        emitter.MovSX8(Reg::RAX, Reg::RAX);
+      } else if (sign && size == 2) {
+        emitter.MovSX16(Reg::RAX, Reg::RAX);
+      }
+      uint8_t *done = emitter.JmpShort();
+      emitter.Bind(scratchpad);
+      EmitLoadCall(inst, size, sign);
+      emitter.Bind(done);
+    } else {
+      EmitLoadCall(inst, size, sign);
+    }
+
+    if (inst.dst) {
+      emitter.MovStore(Reg::RBX, GPROffset(inst.dst), Reg::RAX);
+    }
+  }
+
+  void EmitStore(const IR::Inst &inst, size_t size) {
+    if (inst.alignMask) {
+      EmitAlignmentCheck(inst, true);
+    }
+
+    // With the cache isolated, stores never reach memory
+    emitter.MovLoad(Reg::RAX, Reg::RBX, SROffset);
+    emitter.AluImm(X64::ALU::AND, Reg::RAX, SystemControl::IsC);
+    uint8_t *isolated = emitter.JccNear(X64::Cond::NE);
+    if constexpr (UseFastmem) {
+      uint8_t *scratchpad = EmitScratchpadCheck(inst);
+      emitter.MovLoad(Reg::RAX, Reg::RBX, GPROffset(inst.src2));
+      EmitFastmemAccess(inst, size, true);
+      EmitCodeWriteCheck(inst);
+      uint8_t *done = emitter.JmpShort();
+      emitter.Bind(scratchpad);
+      EmitStoreCall(inst, size);
+      emitter.Bind(done);
+    } else {
+      EmitStoreCall(inst, size);
+    }
+    emitter.BindNear(isolated);
+  }
+
+  void EmitLoadCall(const IR::Inst &inst, size_t size, bool sign) {
+    const void *helper;
+    if (size == 1) {
+      helper = sign ? reinterpret_cast<const void *>(&LoadByte)
+                    : reinterpret_cast<const void *>(&LoadByteUnsigned);
+    } else if (size == 2) {
+      helper = sign ? reinterpret_cast<const void *>(&LoadHalf)
+                    : reinterpret_cast<const void *>(&LoadHalfUnsigned);
+    } else {
+      helper = reinterpret_cast<const void *>(&LoadWord);
+    }
+
+    EmitAddress(X64::ABIParam2, inst);
+    emitter.Mov64(X64::ABIParam1, Reg::RBX);
+    emitter.Call(helper);
+  }
+
+  void EmitStoreCall(const IR::Inst &inst, size_t size) {
+    const void *helper;
+    if (size == 1) {
+      helper = reinterpret_cast<const void *>(&StoreByte);
+    } else if (size == 2) {
+      helper = reinterpret_cast<const void *>(&StoreHalf);
+    } else {
+      helper = reinterpret_cast<const void *>(&StoreWord);
+    }
+
+    EmitAddress(X64::ABIParam2, inst);
+    emitter.MovLoad(X64::ABIParam3, Reg::RBX, GPROffset(inst.src2));
+    emitter.Mov64(X64::ABIParam1, Reg::RBX);
+    emitter.Call(helper);
+  }
+
+  // Fastmem doesn't map the scratchpad, accesses to it are left to the
+  // helpers. Jumps if the address is in it, see State::InScratchpad.
+  uint8_t *EmitScratchpadCheck(const IR::Inst &inst) {
+    EmitAddress(Reg::RAX, inst);
+    emitter.AluImm(X64::ALU::AND, Reg::RAX,
+                   0x7fff'ffff & ~(State::ScratchpadSize - 1));
+    emitter.MovLoad(Reg::RCX, Reg::RBX, ScratchpadBaseOffset);
+    emitter.Alu(X64::ALU::CMP, Reg::RAX, Reg::RCX);
+    return emitter.JccShort(X64::Cond::E);
+  }
+
+  // Inline State::CheckCodeWrite, so stores to data pages don't leave the
+  // block
+  void EmitCodeWriteCheck(const IR::Inst &inst) {
+    EmitAddress(Reg::RAX, inst);
+    emitter.AluImm(X64::ALU::AND, Reg::RAX, 0x1fff'ffff);
+    emitter.ShiftImm(X64::ShiftOp::SHR, Reg::RAX, State::CodePageBits);
+    emitter.BitTest(Reg::RBX, CodePagesOffset, Reg::RAX);
+    uint8_t *data = emitter.JccShort(X64::Cond::AE);
+    EmitAddress(X64::ABIParam2, inst);
+    emitter.Mov64(X64::ABIParam1, Reg::RBX);
+    emitter.Call(reinterpret_cast<const void *>(&CodeWritten));
+    emitter.Bind(data);
+  }
+
+  // Same register assignment and encoding as FastmemMemory, so faulting
+  // accesses are emulated by FastmemArena's handler. The value is in eax.
+  void EmitFastmemAccess(const IR::Inst &inst, size_t size, bool store) {
+#ifdef MEEPS_FASTMEM
+    EmitAddress(Reg::RDI, inst);
+    emitter.MovLoad64(Reg::RSI, Reg::RBX, offsetof(State, fastmem));
+    emitter.Mov64(Reg::RDX, Reg::RBX);
+    for (const FastmemAccess &access : fastmemAccesses) {
+      if (access.size == size && access.store == store) {
+        emitter.Raw(access.bytes.data(), access.length);
+      }
+    }
+#endif
+  }
+
+  // Called from generated code, results are already extended to 32 bits
+  static uint32_t LoadByte(State *state, uint32_t addr) {
+    return (int32_t)(int8_t)DataMemory::Read8(*state, addr);
+  }
+  static uint32_t LoadByteUnsigned(State *state, uint32_t addr) {
+    return DataMemory::Read8(*state, addr);
+  }
+  static uint32_t LoadHalf(State *state, uint32_t addr) {
+    return (int32_t)(int16_t)DataMemory::Read16(*state, addr);
+  }
+  static uint32_t LoadHalfUnsigned(State *state, uint32_t addr) {
+    return DataMemory::Read16(*state, addr);
+  }
+  static uint32_t LoadWord(State *state, uint32_t addr) {
+    return DataMemory::Read32(*state, addr);
+  }
+  static void StoreByte(State *state, uint32_t addr, uint32_t value) {
+    DataMemory::Write8(*state, addr, value & 0xff);
+    state->CheckCodeWrite(addr);
+  }
+  static void StoreHalf(State *state, uint32_t addr, uint32_t value) {
+    DataMemory::Write16(*state, addr, value & 0xffff);
+    state->CheckCodeWrite(addr);
+  }
+  static void StoreWord(State *state, uint32_t addr, uint32_t value) {
+    DataMemory::Write32(*state, addr, value);
+    state->CheckCodeWrite(addr);
+  }
+  static void CodeWritten(State *state, uint32_t addr) {
+    state->CodeWritten(addr);
+  }
+  static void LoadAddressError(State *state, uint32_t addr) {
+    Interpreter::AddressError(*state, addr, false);
+  }
+  static void StoreAddressError(State *state, uint32_t addr) {
+    Interpreter::AddressError(*state, addr, true);
+  }
+
+  X64::Emitter emitter;
+  Cache cache;
+  IR::Options irOptions;
+  HotnessCounters hotness;
+  TierStats stats;
+  bool tracing = false;
+};
+
+} // namespace Meeps
@@ -0,0 +1,136 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <stdexcept>
+#include <vector>
+
+namespace Meeps {
+
+// Timed events for the embedder's timers, DMA and interrupts, on a global
+// 64-bit cycle counter. CPU::Run advances the counter by the instructions it
+// executes and runs in slices that end exactly at the next deadline, calling
+// the callbacks of whatever is due in between, so nothing has to be polled
+// per instruction and blocks run uninterrupted until an event is due. Slices
+// are at least one instruction long, so events scheduled with no delay from
+// a callback fire after the next one.
+//
+// Events are added once and then scheduled as often as needed, callbacks
+// included. Deadlines are kept in a min-heap, where rescheduling or
+// cancelling leaves the old entry behind to be dropped once it surfaces.
+class Scheduler {
+public:
+  using EventId = uint32_t;
+  using Callback = std::function<void()>;
+
+  static constexpr uint64_t Never = UINT64_MAX;
+
+  EventId AddEvent(Callback callback) {
+    events.push_back({std::move(callback)});
+    return (EventId)(events.size() - 1);
+  }
+
+  // Fires the event cycles from now, replacing its pending deadline if any
+  void Schedule(EventId id, uint64_t cycles) { ScheduleAt(id, now + cycles); }
+
+  void ScheduleAt(EventId id, uint64_t deadline) {
+    if (deadline == Never) {
+      throw std::invalid_argument("[Scheduler] Deadline out of range");
+    }
+    Event &event = GetEvent(id);
+    event.deadline = deadline;
+    event.sequence = ++sequence;
+    heap.push_back({deadline, sequence, id});
+    std::push_heap(heap.begin(), heap.end(), Later);
+  }
+
+  void Cancel(EventId id) {
+    Event &event = GetEvent(id);
+    event.deadline = Never;
+    event.sequence = ++sequence;
+  }
+
+  // Never if the event isn't scheduled
+  uint64_t GetDeadline(EventId id) { return GetEvent(id).deadline; }
+
+  uint64_t Now() const { return now; }
+
+  // Earliest pending deadline, Never if nothing is scheduled
+  uint64_t NextDeadline() {
+    DropStale();
+    return heap.empty() ? Never : heap.front().deadline;
+  }
+
+  // Moves the counter forward without running anything that became due
+  void Advance(uint64_t cycles) { now += cycles; }
+
+  // Calls the callbacks of every event due by now, earliest first and in
+  // the order they were scheduled on a tie. Events the callbacks schedule
+  // for now or earlier are left for the next call, so one that keeps
+  // rescheduling itself with no delay fires once per slice of CPU::Run
+  // instead of spinning.
+  void RunDueEvents() {
+    const uint64_t last = sequence;
+    std::vector<Entry> rescheduled;
+    while (NextDeadline() <= now) {
+      const Entry entry = heap.front();
+      std::pop_heap(heap.begin(), heap.end(), Later);
+      heap.pop_back();
+      if (entry.sequence > last) {
+        rescheduled.push_back(entry);
+        continue;
+      }
+
+      Event &event = events[entry.id];
+      event.deadline = Never;
+      event.callback();
+    }
+
+    for (const Entry &entry : rescheduled) {
+      heap.push_back(entry);
+      std::push_heap(heap.begin(), heap.end(), Later);
+    }
+  }
+
+private:
+  struct Event {
+    Callback callback;
+    uint64_t deadline = Never;
+    uint64_t sequence = 0; // Of the heap entry that's still current
+  };
+
+  struct Entry {
+    uint64_t deadline;
+    uint64_t sequence;
+    EventId id;
+  };
+
+  // std::push_heap builds a max-heap, so the comparison is reversed
+  static bool Later(const Entry &a, const Entry &b) {
+    return a.deadline != b.deadline ? a.deadline > b.deadline
+                                    : a.sequence > b.sequence;
+  }
+
+  Event &GetEvent(EventId id) {
+    if (id >= events.size()) {
+      throw std::invalid_argument("[Scheduler] Unknown event");
+    }
+    return events[id];
+  }
+
+  void DropStale() {
+    while (!heap.empty() &&
+           heap.front().sequence != events[heap.front().id].sequence) {
+      std::pop_heap(heap.begin(), heap.end(), Later);
+      heap.pop_back();
+    }
+  }
+
+  std::deque<Event> events; // Stays put while a callback adds events
+  std::vector<Entry> heap;
+  uint64_t now = 0;
+  uint64_t sequence = 0;
+};
+
+} // namespace Meeps
@@ -1,12 +1,48 @@
 #pragma once
 #include "types.h"
 #include "cop0.h"
+#include "pagetable.h"
+#include "systemcontrol.h"
+#include <algorithm>
 #include <array>
+#include <utility>
+#include <vector>
 
 namespace Meeps {
+class KernelHLE;
+
+// Why Run returned before using up its cycles. The instruction that stopped
+// it hasn't run, pc/nextPC are left right before it. With guest exceptions on
+// (see State::exceptions), the ones the R3000 raises exceptions for are
+// delivered through COP0 instead of ending the run.
+enum class StopReason : uint8_t {
+  None,
+  Syscall,
+  Break,
+  ReservedInstruction,
+  Unimplemented, // COP2 and the unaligned LWL/LWR/SWL/SWR
+  Breakpoint,
+  // Only with guest exceptions on
+  Overflow,          // ADD/ADDI/SUB
+  AddressErrorLoad,  // Misaligned LH/LHU/LW, the address is in badVaddr
+  AddressErrorStore, // Misaligned SH/SW
+  Interrupt, // MTC0/RFE unmasked a pending interrupt, unlike the rest it ran
+};
+
 struct State {
 public:
-  State(COP0* cop0) : cop0(cop0) {
+  // The data cache, used as fast RAM at 0x1f80'0000 and its KSEG0 mirror
+  static constexpr uint32_t ScratchpadBase = 0x1f80'0000;
+  static constexpr uint32_t ScratchpadSize = 1024;
+
+  // Physical memory is tracked for modified code in pages of this size, and
+  // within them in 64 lines
+  static constexpr uint32_t CodePageBits = 12;
+  static constexpr uint32_t CodeLineBits = 6;
+  static constexpr size_t CodePageCount = size_t(0x2000'0000) >> CodePageBits;
+
+  // Without a COP0 of its own, the built-in SystemControl is used
+  State(COP0* cop0 = nullptr) : cop0(cop0) {
     Reset();
   }
 
@@ -16,6 +52,9 @@ public:
     nextPC = pc + 4;
     hi = 0;
     lo = 0;
+    stop = StopReason::None;
+    badVaddr = 0;
+    systemControl.Reset();
   }
 
   uint32_t GetGPR(size_t reg) { return gpr[reg]; }
@@ -25,7 +64,119 @@ public:
       gpr[reg] = value;
   }
 
-  // TODO: Test on godbolt to see if faster/slower than virtual functions
+  // COP0 access, direct for the built-in SystemControl
+  uint32_t GetCOP0(size_t reg) {
+    return cop0 ? cop0->GetReg(reg) : systemControl.GetReg(reg);
+  }
+
+  void SetCOP0(size_t reg, uint32_t value) {
+    if (cop0) {
+      cop0->SetReg(reg, value);
+      MirrorSR(reg);
+    } else {
+      systemControl.SetReg(reg, value);
+    }
+  }
+
+  // For exception entry and RFE, which may write what guests can't
+  void WriteCOP0(size_t reg, uint32_t value) {
+    if (cop0) {
+      cop0->SetReg(reg, value);
+      MirrorSR(reg);
+    } else {
+      systemControl.regs[reg] = value;
+    }
+  }
+
+  // With a COP0 of the embedder's, SR is mirrored into systemControl, so
+  // stores check for cache isolation (SystemControl::CacheIsolated) without
+  // a virtual call. It's refreshed on every write through State and at the
+  // start of each slice of CPU::Run, so changes the embedder makes directly
+  // on its COP0 in the middle of a slice are only seen from the next one.
+  void MirrorSR(size_t reg = COP0::SR) {
+    if (cop0 && (reg & 31) == COP0::SR) {
+      systemControl.regs[COP0::SR] = cop0->GetReg(COP0::SR);
+    }
+  }
+
+  // IEc is set and a raised interrupt line is unmasked in SR
+  bool InterruptPending() {
+    const uint32_t sr = GetCOP0(COP0::SR);
+    return (sr & 1) && (sr & GetCOP0(COP0::Cause) & 0xff00);
+  }
+
+  bool InScratchpad(uint32_t addr) const {
+    return (addr & (0x7fff'ffff & ~(ScratchpadSize - 1))) == scratchpadBase;
+  }
+
+  // Flags the physical lines [begin, end) overlaps as holding translated
+  // code, in every segment they're mirrored to
+  void MarkCode(uint32_t begin, uint32_t end) {
+    if (begin == end) {
+      return;
+    }
+    if (codeLines.empty()) {
+      codeLines.resize(CodePageCount);
+    }
+    const uint32_t first = (begin & 0x1fff'ffff) >> CodeLineBits;
+    const uint32_t count = (end - 1 - (begin & ~0x3fu)) >> CodeLineBits;
+    for (uint32_t i = 0; i <= count; i++) {
+      const uint32_t line = (first + i) % (CodePageCount << 6);
+      const uint32_t page = line >> 6;
+      codePages[page / 64] |= uint64_t(1) << (page % 64);
+      codeLines[page] |= uint64_t(1) << (line % 64);
+    }
+  }
+
+  // Called after every store that reached memory, which only costs the bit
+  // test unless the page holds translated code
+  void CheckCodeWrite(uint32_t addr) {
+    const uint32_t page = (addr & 0x1fff'ffff) >> CodePageBits;
+    if (codePages[page / 64] & (uint64_t(1) << (page % 64))) [[unlikely]] {
+      CodeWritten(addr);
+    }
+  }
+
+  // Queues up the line written to if it holds code, for the backend to drop
+  // the blocks overlapping it before running the next one. Stores to data
+  // that shares a page with code end here.
+  void CodeWritten(uint32_t addr) {
+    if (ClearCodeLines(addr, uint64_t(1) << ((addr >> CodeLineBits) % 64))) {
+      QueueCodeWrite(addr & ~0x3fu, 1 << CodeLineBits);
+    }
+  }
+
+  // CheckCodeWrite for size bytes written at once, e.g. by DMA
+  void CheckCodeWrites(uint32_t addr, uint32_t size) {
+    bool written = false;
+    for (uint64_t offset = 0; offset < size;) {
+      const uint32_t at = addr + (uint32_t)offset;
+      const uint32_t page = (at & 0x1fff'ffff) >> CodePageBits;
+      const uint32_t inPage = at & ((1 << CodePageBits) - 1);
+      const uint64_t length =
+          std::min<uint64_t>(size - offset, (1 << CodePageBits) - inPage);
+      if (codePages[page / 64] & (uint64_t(1) << (page % 64))) {
+        const uint32_t first = inPage >> CodeLineBits;
+        const uint32_t last = (inPage + (uint32_t)length - 1) >> CodeLineBits;
+        const uint64_t lines =
+            (~uint64_t(0) >> (63 - last)) & (~uint64_t(0) << first);
+        written |= ClearCodeLines(at, lines);
+      }
+      offset += length;
+    }
+    if (written) {
+      QueueCodeWrite(addr, size);
+    }
+  }
+
+  // Forgets all translated code, for when the backends flushed everything
+  void ClearCodePages() {
+    codePages.fill(0);
+    std::fill(codeLines.begin(), codeLines.end(), 0);
+    writtenCodeCount = 0;
+  }
+
+  // Callback path, only used by the PointerMemory policy (see memory.h)
   inline uint8_t read8(size_t addr) { return rp8(mp, addr); }
   inline void write8(size_t addr, uint8_t value) { wp8(mp, addr, value); }
 
@@ -41,15 +192,68 @@ public:
   uint32_t hi;
   uint32_t lo;
   std::array<uint32_t, 32> gpr;
-  COP0* cop0;
+  COP0* cop0; // Null for the built-in one
+  SystemControl systemControl;
+
+  // Set by an instruction that stops the CPU, cleared when Run starts
+  StopReason stop = StopReason::None;
+
+  // Makes overflows and misaligned accesses stop the CPU, so they can be
+  // delivered as exceptions. Otherwise ADD/ADDI/SUB wrap and misaligned
+  // accesses go ahead.
+  bool exceptions = false;
+  uint32_t badVaddr = 0; // Set along with StopReason::AddressError*
 
   // Interface
-  void *mp;
-  readPointer<uint8_t> rp8;
-  readPointer<uint16_t> rp16;
-  readPointer<uint32_t> rp32;
-  writePointer<uint8_t> wp8;
-  writePointer<uint16_t> wp16;
-  writePointer<uint32_t> wp32;
+  void *mp = nullptr;
+  readPointer<uint8_t> rp8 = nullptr;
+  readPointer<uint16_t> rp16 = nullptr;
+  readPointer<uint32_t> rp32 = nullptr;
+  writePointer<uint8_t> wp8 = nullptr;
+  writePointer<uint16_t> wp16 = nullptr;
+  writePointer<uint32_t> wp32 = nullptr;
+
+  // Only consulted by the PageTableMemory and FastmemMemory policies
+  PageTable pageTable;
+  uint8_t *fastmem = nullptr; // Base of the attached FastmemArena
+  const uint8_t *fastmemPages = nullptr; // Its FastmemArena::PageAccess
+
+  // Only reached by guest loads/stores, see ScratchpadMemory. The base is 1
+  // while disabled, which no address matches.
+  std::array<uint8_t, ScratchpadSize> scratchpad{};
+  uint32_t scratchpadBase = 1;
+
+  // Set while any kernel call is emulated, see kernelhle.h
+  KernelHLE *hle = nullptr;
+
+  // Bit per physical page with translated code, and per line of each page,
+  // see CheckCodeWrite. Code written to since the backend last checked is
+  // queued in writtenCode as (address, size), more writes than fit mean
+  // everything has to be dropped.
+  std::array<uint64_t, CodePageCount / 64> codePages{};
+  std::vector<uint64_t> codeLines; // Allocated along with the first block
+  std::array<std::pair<uint32_t, uint32_t>, 8> writtenCode{};
+  uint32_t writtenCodeCount = 0;
+
+private:
+  // Clears lines of the page holding addr, returns true if any held code
+  bool ClearCodeLines(uint32_t addr, uint64_t lines) {
+    const uint32_t page = (addr & 0x1fff'ffff) >> CodePageBits;
+    if (!(codeLines[page] & lines)) {
+      return false;
+    }
+    codeLines[page] &= ~lines;
+    if (!codeLines[page]) {
+      codePages[page / 64] &= ~(uint64_t(1) << (page % 64));
+    }
+    return true;
+  }
+
+  void QueueCodeWrite(uint32_t addr, uint32_t size) {
+    if (writtenCodeCount < writtenCode.size()) {
+      writtenCode[writtenCodeCount] = {addr & 0x1fff'ffff, size};
+    }
+    writtenCodeCount++;
+  }
 };
 } // namespace Meeps
\ No newline at end of file
@@ -0,0 +1,78 @@
+#pragma once
+#include "memory.h"
+#include "r3000interpreter.h"
+#include "state.h"
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <unordered_map>
+
+namespace Meeps {
+
+// Runs guest code through C++ functions generated ahead of time by the static
+// recompiler (see staticrecompiler.h). Anything they don't cover, like code
+// that couldn't be found statically or was loaded at runtime, is stepped by
+// the interpreter instead.
+//
+// Generated code is a snapshot of the guest binary, so it must not be used
+// for code that gets modified after it was recompiled. It's also translated
+// without guest exceptions (ADD/ADDI/SUB wrap, misaligned accesses go
+// through), so it can't run with State::exceptions set.
+template <MemoryPolicy Memory = PointerMemory> class StaticProgram {
+public:
+  static constexpr size_t MaxBlockSize = 64;
+
+  // Runs blocks from state.pc for as long as they fit into cycles, and
+  // returns on reaching a pc outside of the function or once the CPU stops.
+  // Cycles left in a block that stopped are given back.
+  using Function = void (*)(State &state, int &cycles);
+
+  // function has to handle being entered at pc
+  void Add(uint32_t pc, Function function) { functions[pc] = function; }
+
+  // Returns the number of instructions executed, which is less than cycles
+  // if the CPU stopped (see StopReason)
+  int Run(State &state, int cycles) {
+    if (state.exceptions) {
+      throw std::invalid_argument(
+          "[Static Program] Guest exceptions are unsupported");
+    }
+
+    const int budget = std::max(cycles, 0);
+    state.stop = StopReason::None;
+
+    while (cycles > 0 && state.stop == StopReason::None) {
+      // Functions start on whole blocks, a pending branch is stepped first
+      if (state.nextPC != state.pc + 4) {
+        cycles -= Interpreter::Step(state, 1);
+        continue;
+      }
+
+      auto it = functions.find(state.pc);
+      if (it == functions.end()) {
+        cycles -= Interpreter::StepBlock(state, cycles, MaxBlockSize);
+        continue;
+      }
+
+      // Blocks run as a whole, so one that doesn't fit into what's left of
+      // the slice returns right away and gets stepped instead
+      const int remaining = cycles;
+      it->second(state, cycles);
+      if (cycles == remaining && state.stop == StopReason::None) {
+        cycles -= Interpreter::Step(state, cycles);
+        break;
+      }
+    }
+
+    return budget - std::max(cycles, 0);
+  }
+
+  size_t GetEntryCount() const { return functions.size(); }
+
+private:
+  using Interpreter = R3000Interpreter<Memory>;
+
+  std::unordered_map<uint32_t, Function> functions;
+};
+
+} // namespace Meeps
@@ -0,0 +1,451 @@
+#pragma once
+#include "ir.h"
+#include "irpasses.h"
+#include "r3000interpreter.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fmt/core.h>
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace Meeps {
+
+// Guest code as loaded into memory, along with where execution starts
+struct GuestImage {
+  uint32_t base = 0;
+  uint32_t entry = 0;
+  std::vector<uint8_t> data;
+
+  bool Contains(uint32_t addr) const {
+    return addr - base < data.size() && data.size() - (addr - base) >= 4;
+  }
+
+  Instruction Read(uint32_t addr) const {
+    uint32_t value;
+    std::memcpy(&value, &data[addr - base], sizeof(value));
+    return value;
+  }
+
+  // The text section of a PS-X EXE is loaded at the address in its header,
+  // starting 0x800 bytes into the file
+  static GuestImage FromPSXExe(const std::vector<uint8_t> &file) {
+    constexpr size_t HeaderSize = 0x800;
+    if (file.size() < HeaderSize || std::memcmp(file.data(), "PS-X EXE", 8)) {
+      throw std::invalid_argument("[Static Recompiler] Not a PS-X EXE");
+    }
+
+    auto Field = [&](size_t offset) {
+      uint32_t value;
+      std::memcpy(&value, &file[offset], sizeof(value));
+      return value;
+    };
+
+    GuestImage image;
+    image.entry = Field(0x10);
+    image.base = Field(0x18);
+    const size_t size = std::min<size_t>(Field(0x1c), file.size() - HeaderSize);
+    image.data.assign(file.begin() + HeaderSize,
+                      file.begin() + HeaderSize + size);
+    return image;
+  }
+};
+
+// Translates a guest binary into C++ ahead of time, for programs that get
+// run often enough that building them with the host compiler pays off.
+//
+// Code is found by recursive traversal from the entry point. Branch and J
+// targets, and the return sites of calls, belong to the function they're
+// found in, while JAL targets start new functions. Each function becomes one
+// C++ function that runs the same IR the other backends use, with gotos
+// between its blocks, and returns to StaticProgram (see staticprogram.h)
+// whenever control leaves it, like on calls and JR/JALR.
+class StaticRecompiler {
+public:
+  static constexpr size_t MaxBlockSize = 64;
+
+  struct Function {
+    uint32_t entry;
+    std::set<uint32_t> blocks; // Starting addresses, entry included
+  };
+
+  explicit StaticRecompiler(GuestImage image) : image(std::move(image)) {}
+
+  // Finds every function reachable from the image's entry point and the
+  // extra entries given, e.g. for callbacks only reached through pointers
+  void Analyze(const std::vector<uint32_t> &entries = {}) {
+    std::deque<uint32_t> pending = {image.entry};
+    pending.insert(pending.end(), entries.begin(), entries.end());
+
+    while (!pending.empty()) {
+      const uint32_t entry = pending.front();
+      pending.pop_front();
+      if (functions.contains(entry) || !image.Contains(entry)) {
+        continue;
+      }
+
+      Function &function = functions[entry];
+      function.entry = entry;
+
+      std::deque<uint32_t> blocks = {entry};
+      while (!blocks.empty()) {
+        const uint32_t pc = blocks.front();
+        blocks.pop_front();
+        if (!image.Contains(pc) || !function.blocks.insert(pc).second) {
+          continue;
+        }
+
+        const Successors next = FindSuccessors(pc, FetchBlock(pc));
+        blocks.insert(blocks.end(), next.local.begin(), next.local.end());
+        if (next.returnSite) {
+          blocks.push_back(next.returnSite);
+        }
+        if (next.call) {
+          pending.push_back(next.call);
+        }
+      }
+    }
+  }
+
+  const std::map<uint32_t, Function> &GetFunctions() const { return functions; }
+
+  // Generates a translation unit defining
+  //   void <registerName>(Meeps::StaticProgram<Meeps::<memory>> &program)
+  // which adds every function to program
+  std::string Emit(const std::string &registerName,
+                   const std::string &memory = "PointerMemory") const {
+    std::string out;
+    out += "// Generated by the Meeps static recompiler, do not edit\n";
+    out += "#include <staticprogram.h>\n\n";
+    out += "namespace {\n\n";
+    out += "using namespace Meeps;\n";
+    out += fmt::format("using Memory = {};\n", memory);
+    out += "using Interpreter = R3000Interpreter<Memory>;\n";
+    out += "using DataMemory = ScratchpadMemory<Memory>;\n";
+
+    for (const auto &[entry, function] : functions) {
+      EmitFunction(out, function);
+    }
+
+    out += "\n} // namespace\n\n";
+    out += fmt::format("void {}(Meeps::StaticProgram<Meeps::{}> &program) {{\n",
+                       registerName, memory);
+    for (const auto &[entry, function] : functions) {
+      for (const uint32_t pc : function.blocks) {
+        out += fmt::format("  program.Add(0x{:08x}, &Function_{:08x});\n", pc,
+                           entry);
+      }
+    }
+    out += "}\n";
+    return out;
+  }
+
+private:
+  using Interpreter = R3000Interpreter<>;
+
+  struct Successors {
+    std::vector<uint32_t> local; // Blocks of the same function
+    uint32_t call = 0;           // JAL target
+    uint32_t returnSite = 0;     // Where JAL/JALR calls come back to
+  };
+
+  // Like R3000Interpreter::FetchBlock, but reads from the image and stops at
+  // its end
+  std::vector<Instruction> FetchBlock(uint32_t pc) const {
+    std::vector<Instruction> block;
+    bool delaySlot = false;
+
+    while (image.Contains(pc)) {
+      const Instruction instr = image.Read(pc);
+      block.push_back(instr);
+      pc += 4;
+
+      if (delaySlot) {
+        break;
+      }
+
+      if (Interpreter::IsControlTransfer(instr)) {
+        delaySlot = true;
+      } else if (block.size() >= MaxBlockSize) {
+        break;
+      }
+    }
+
+    return block;
+  }
+
+  static Successors FindSuccessors(uint32_t pc,
+                                   const std::vector<Instruction> &instrs) {
+    Successors next;
+    const size_t size = instrs.size();
+    const uint32_t end = pc + (uint32_t)size * 4;
+
+    // Cut off by the end of the image, or a jump in the delay slot, neither
+    // of which can be followed statically
+    if (!size || Interpreter::IsControlTransfer(instrs[size - 1])) {
+      return next;
+    }
+
+    if (size < 2 || !Interpreter::IsControlTransfer(instrs[size - 2])) {
+      next.local.push_back(end);
+      return next;
+    }
+
+    const Instruction instr = instrs[size - 2];
+    const uint32_t addr = end - 8;
+    const uint32_t jumpTarget =
+        ((addr + 4) & 0xf000'0000) + (instr.j.target << 2);
+    switch (instr.i.op) {
+    case 0b00'0000: // JR, JALR
+      if (instr.r.func == 0b00'1001) {
+        next.returnSite = end;
+      }
+      break;
+    case 0b00'0010: // J
+      next.local.push_back(jumpTarget);
+      break;
+    case 0b00'0011: // JAL
+      next.call = jumpTarget;
+      next.returnSite = end;
+      break;
+    default: // Branches
+      next.local.push_back(addr + 4 +
+                           (uint32_t)(int32_t)(int16_t)instr.i.imm * 4);
+      next.local.push_back(end);
+      break;
+    }
+    return next;
+  }
+
+  void EmitFunction(std::string &out, const Function &function) const {
+    out += fmt::format("\nvoid Function_{:08x}(State &state, int &cycles) {{\n",
+                       function.entry);
+    out += "  auto &gpr = state.gpr;\n";
+    out += "  switch (state.pc) {\n";
+    for (const uint32_t pc : function.blocks) {
+      out += fmt::format("  case 0x{:08x}:\n    goto Block_{:08x};\n", pc, pc);
+    }
+    out += "  default:\n    return;\n  }\n";
+
+    for (const uint32_t pc : function.blocks) {
+      const std::vector<Instruction> instrs = FetchBlock(pc);
+      // Without guest exceptions, which StaticProgram refuses to run with
+      IR::Block ir = IR::Translate(instrs, pc, instrs.size());
+      IR::Optimize(ir);
+
+      out += fmt::format("\nBlock_{:08x}:\n", pc);
+      out += fmt::format("  if (cycles < {}) {{\n    return;\n  }}\n", ir.size);
+      out += fmt::format("  cycles -= {};\n", ir.size);
+      for (const IR::Inst &inst : ir.insts) {
+        out += "  ";
+        out += EmitInst(inst);
+        out += "\n";
+        if (inst.op == IR::Op::Interpret && Interpreter::MayStop(inst.instr)) {
+          EmitStopCheck(out, inst, ir.size);
+        }
+      }
+
+      // pc/nextPC are set up for whatever comes next, the function only
+      // carries on if that's one of its own blocks
+      for (const uint32_t next : FindSuccessors(pc, instrs).local) {
+        if (function.blocks.contains(next)) {
+          out += fmt::format("  if (state.pc == 0x{:08x}) {{\n"
+                             "    goto Block_{:08x};\n  }}\n",
+                             next, next);
+        }
+      }
+      out += "  return;\n";
+    }
+    out += "}\n";
+  }
+
+  // Leaves the function right before an instruction that stopped the CPU,
+  // giving back the cycles of the rest of the block
+  static void EmitStopCheck(std::string &out, const IR::Inst &inst,
+                            uint32_t blockSize) {
+    const std::string nextPC =
+        inst.delaySlot ? "state.pc" : fmt::format("0x{:08x}u", inst.addr + 4);
+    out += "  if (state.stop != StopReason::None) {\n";
+    out += fmt::format("    state.nextPC = {};\n", nextPC);
+    out += fmt::format("    state.pc = 0x{:08x}u;\n", inst.addr);
+    out += fmt::format("    cycles += {};\n", blockSize - inst.imm2);
+    out += "    return;\n  }\n";
+  }
+
+  static std::string EmitInst(const IR::Inst &inst) {
+    using enum IR::Op;
+    if (inst.fusedSlot) {
+      IR::Inst transfer = inst;
+      transfer.fusedSlot = false;
+      return EmitInst(transfer) + " " + EmitInst({DelaySlot});
+    }
+
+    const std::string d = fmt::format("gpr[{}]", inst.dst);
+    const std::string a = fmt::format("gpr[{}]", inst.src1);
+    const std::string b = fmt::format("gpr[{}]", inst.src2);
+    const std::string imm = fmt::format("0x{:08x}u", inst.imm);
+    const std::string address =
+        inst.src1 ? fmt::format("{} + {}", a, imm) : imm;
+    const std::string link =
+        inst.dst ? fmt::format("{} = 0x{:08x}u; ", d, inst.addr + 8) : "";
+
+    auto Load = [&](const char *read, const char *extend) {
+      const std::string value =
+          fmt::format("{}DataMemory::{}(state, {})", extend, read, address);
+      return inst.dst ? fmt::format("{} = {};", d, value)
+                      : fmt::format("(void){};", value);
+    };
+    // With the cache isolated, stores never reach memory
+    auto Store = [&](const char *write, const char *truncate) {
+      return fmt::format("if (!state.systemControl.CacheIsolated()) "
+                         "DataMemory::{}(state, {}, {}{});",
+                         write, address, truncate, b);
+    };
+    auto Branch = [&](const std::string &taken) {
+      return fmt::format("state.nextPC = {} ? {} : 0x{:08x}u;", taken, imm,
+                         inst.addr + 8);
+    };
+    // dst is written first, so the branch reads the compare result from it
+    const std::string imm2 = fmt::format("0x{:08x}u", inst.imm2);
+    auto CompareBranch = [&](const std::string &less, bool onLess) {
+      return fmt::format("{} = {}; {}", d, less,
+                         Branch(onLess ? d : "!" + d));
+    };
+
+    switch (inst.op) {
+    case Nop:
+      return ";";
+    case Const:
+      return fmt::format("{} = {};", d, imm);
+    case Mov:
+      return fmt::format("{} = {};", d, a);
+    case Add:
+      return fmt::format("{} = {} + {};", d, a, b);
+    case Sub:
+      return fmt::format("{} = {} - {};", d, a, b);
+    case And:
+      return fmt::format("{} = {} & {};", d, a, b);
+    case Or:
+      return fmt::format("{} = {} | {};", d, a, b);
+    case Xor:
+      return fmt::format("{} = {} ^ {};", d, a, b);
+    case Nor:
+      return fmt::format("{} = ~({} | {});", d, a, b);
+    case Slt:
+      return fmt::format("{} = (int32_t){} < (int32_t){};", d, a, b);
+    case Sltu:
+      return fmt::format("{} = {} < {};", d, a, b);
+    case AddI:
+      return fmt::format("{} = {} + {};", d, a, imm);
+    case AndI:
+      return fmt::format("{} = {} & {};", d, a, imm);
+    case OrI:
+      return fmt::format("{} = {} | {};", d, a, imm);
+    case XorI:
+      return fmt::format("{} = {} ^ {};", d, a, imm);
+    case SltI:
+      return fmt::format("{} = (int32_t){} < (int32_t){};", d, a, imm);
+    case SltuI:
+      return fmt::format("{} = {} < {};", d, a, imm);
+    case Sll:
+      return fmt::format("{} = {} << {};", d, a, inst.imm);
+    case Srl:
+      return fmt::format("{} = {} >> {};", d, a, inst.imm);
+    case Sra:
+      return fmt::format("{} = (uint32_t)((int32_t){} >> {});", d, a,
+                         inst.imm);
+    case Sllv:
+      return fmt::format("{} = {} << ({} & 31);", d, a, b);
+    case Srlv:
+      return fmt::format("{} = {} >> ({} & 31);", d, a, b);
+    case Srav:
+      return fmt::format("{} = (uint32_t)((int32_t){} >> ({} & 31));", d, a, b);
+    case MfHi:
+      return fmt::format("{} = state.hi;", d);
+    case MfLo:
+      return fmt::format("{} = state.lo;", d);
+    case Load8:
+      return Load("Read8", "(uint32_t)(int8_t)");
+    case Load8U:
+      return Load("Read8", "");
+    case Load16:
+      return Load("Read16", "(uint32_t)(int16_t)");
+    case Load16U:
+      return Load("Read16", "");
+    case Load32:
+      return Load("Read32", "");
+    case Store8:
+      return Store("Write8", "(uint8_t)");
+    case Store16:
+      return Store("Write16", "(uint16_t)");
+    case Store32:
+      return Store("Write32", "");
+    case Jump:
+      return fmt::format("{}state.nextPC = {};", link, imm);
+    case JumpReg:
+      // The target has to be read before linking in case both are the same
+      return fmt::format("state.nextPC = {}; {}", a, link);
+    case Beq:
+      return Branch(fmt::format("{} == {}", a, b));
+    case Bne:
+      return Branch(fmt::format("{} != {}", a, b));
+    case Blez:
+      return Branch(fmt::format("(int32_t){} <= 0", a));
+    case Bgtz:
+      return Branch(fmt::format("(int32_t){} > 0", a));
+    case Bltz:
+      return Branch(fmt::format("(int32_t){} < 0", a));
+    case Bgez:
+      return Branch(fmt::format("(int32_t){} >= 0", a));
+    case Blt:
+      return CompareBranch(fmt::format("(int32_t){} < (int32_t){}", a, b), true);
+    case Bge:
+      return CompareBranch(fmt::format("(int32_t){} < (int32_t){}", a, b),
+                           false);
+    case Bltu:
+      return CompareBranch(fmt::format("{} < {}", a, b), true);
+    case Bgeu:
+      return CompareBranch(fmt::format("{} < {}", a, b), false);
+    case BltI:
+      return CompareBranch(fmt::format("(int32_t){} < (int32_t){}", a, imm2),
+                           true);
+    case BgeI:
+      return CompareBranch(fmt::format("(int32_t){} < (int32_t){}", a, imm2),
+                           false);
+    case BltuI:
+      return CompareBranch(fmt::format("{} < {}", a, imm2), true);
+    case BgeuI:
+      return CompareBranch(fmt::format("{} < {}", a, imm2), false);
+    case DelaySlot:
+      return "state.pc = state.nextPC; state.nextPC += 4;";
+    case Interpret: {
+      const std::string call =
+          fmt::format("Interpreter::Decode(0x{0:08x}u)(state, 0x{0:08x}u);",
+                      inst.instr.value);
+      if (inst.delaySlot) {
+        return call;
+      }
+      return fmt::format("state.pc = 0x{:08x}u; state.nextPC = 0x{:08x}u; {}",
+                         inst.addr + 4, inst.addr + 8, call);
+    }
+    case Guard: // Only traces have guards
+      return ";";
+    case Exit:
+      return fmt::format("state.pc = {}; state.nextPC = 0x{:08x}u;", imm,
+                         inst.imm + 4);
+    case ExitBranch:
+      return fmt::format("state.pc = {};", imm);
+    }
+    return ";";
+  }
+
+  GuestImage image;
+  std::map<uint32_t, Function> functions;
+};
+
+} // namespace Meeps
@@ -0,0 +1,78 @@
+#pragma once
+#include "cop0.h"
+#include "types.h"
+#include <array>
+
+namespace Meeps {
+
+// The R3000's own system control coprocessor, used whenever the CPU isn't
+// given a COP0 of its own. It lives inline in State without any virtual
+// calls, so checking SR/Cause bits is a couple of loads.
+//
+// Guest writes (MTC0/LWC0) follow the hardware: BadVaddr, EPC and PRId are
+// read only, and only the software interrupt bits of Cause are writable. The
+// hardware interrupt lines are driven with SetInterruptLines.
+class SystemControl {
+public:
+  // Called after every guest write that went through, for registers whose
+  // side effects live outside of the CPU, like the breakpoint ones
+  using WriteHook = void (*)(void *user, size_t reg, uint32_t value);
+
+  static constexpr size_t PRId = 15;
+
+  static constexpr uint32_t IEc = 1u << 0;  // Interrupts enabled
+  static constexpr uint32_t IsC = 1u << 16; // Stores only reach the cache
+  static constexpr uint32_t BEV = 1u << 22; // Exception vectors in the BIOS
+  static constexpr uint32_t SoftwareInterrupts = 0x300; // Cause.IP0-IP1
+
+  SystemControl() { Reset(); }
+
+  // Comes out of reset with the BIOS vectors selected, like the hardware
+  void Reset() {
+    regs.fill(0);
+    regs[COP0::SR] = BEV;
+    regs[PRId] = 0x2; // R3000A
+  }
+
+  uint32_t GetReg(size_t reg) const { return regs[reg & 31]; }
+
+  void SetReg(size_t reg, uint32_t value) {
+    reg &= 31;
+    switch (reg) {
+    case COP0::BadVaddr:
+    case COP0::EPC:
+    case PRId:
+      return;
+    case COP0::Cause:
+      value = (regs[reg] & ~SoftwareInterrupts) | (value & SoftwareInterrupts);
+      break;
+    default:
+      break;
+    }
+
+    regs[reg] = value;
+    if (writeHook) {
+      writeHook(hookUser, reg, value);
+    }
+  }
+
+  void SetWriteHook(WriteHook hook, void *user) {
+    writeHook = hook;
+    hookUser = user;
+  }
+
+  // IP2-IP7 as bits 0-5
+  void SetInterruptLines(uint32_t lines) {
+    regs[COP0::Cause] = (regs[COP0::Cause] & ~0xfc00u) | ((lines & 0x3f) << 10);
+  }
+
+  bool CacheIsolated() const { return regs[COP0::SR] & IsC; }
+
+  // Written directly by exception entry and RFE, which aren't bound by the
+  // rules guest writes are
+  std::array<uint32_t, 32> regs;
+  WriteHook writeHook = nullptr;
+  void *hookUser = nullptr;
+};
+
+} // namespace Meeps
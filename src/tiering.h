@@ -0,0 +1,61 @@
+#pragma once
+#include <cstdint>
+#include <unordered_map>
+
+namespace Meeps {
+
+// Instructions run per tier by a CPU since it was created
+struct TierStats {
+  uint64_t steppedInstructions = 0; // Cold code, run by the plain interpreter
+  uint64_t blockInstructions = 0;   // Hot code, run from translated blocks
+  uint64_t blocksTranslated = 0;
+  uint64_t tracesTranslated = 0;
+  uint64_t skippedInstructions = 0; // Idle loop iterations that never ran
+};
+
+// Counts entries into blocks that haven't been translated yet. Code starts
+// out stepped by the interpreter and a block is only translated on its
+// threshold-th entry, so one-shot code like init paths and loaders never pays
+// for translation or takes up cache space.
+class HotnessCounters {
+public:
+  static constexpr uint32_t DefaultThreshold = 8;
+
+  // Counts an entry into the block at pc, returns true once it is hot
+  bool Enter(uint32_t pc) {
+    if (threshold <= 1) {
+      return true;
+    }
+
+    auto it = counts.try_emplace(pc, 0).first;
+    if (++it->second < threshold) {
+      return false;
+    }
+    counts.erase(it);
+    return true;
+  }
+
+  // 0 and 1 both translate blocks on their first entry
+  void SetThreshold(uint32_t threshold) { this->threshold = threshold; }
+  uint32_t GetThreshold() const { return threshold; }
+
+  uint32_t GetCount(uint32_t pc) const {
+    auto it = counts.find(pc);
+    return it != counts.end() ? it->second : 0;
+  }
+
+  // Modified code starts counting from scratch
+  void Invalidate(uint32_t addr, uint32_t size) {
+    std::erase_if(counts, [&](const auto &count) {
+      return count.first - addr < size;
+    });
+  }
+
+  void Clear() { counts.clear(); }
+
+private:
+  std::unordered_map<uint32_t, uint32_t> counts; // Keyed by block start
+  uint32_t threshold = DefaultThreshold;
+};
+
+} // namespace Meeps
@@ -0,0 +1,66 @@
+#pragma once
+#include "kernelhle.h"
+#include "memory.h"
+#include "r3000interpreter.h"
+#include "state.h"
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace Meeps {
+
+// One basic block along a recorded path, as returned by FetchBlock
+struct TracePart {
+  uint32_t pc;
+  std::vector<Instruction> instrs;
+};
+
+// The basic blocks a run of guest code went through, in order. Each part
+// starts where the previous one led, so a trace can be translated into a
+// single block that checks the path still holds at every jump/branch.
+using Trace = std::vector<TracePart>;
+
+// Steps guest code from state.pc one basic block at a time, recording the
+// path actually taken. Recording ends once the path leads back to where it
+// started, at a pc that stop returns true for or an emulated kernel call, or
+// once the trace holds maxSize instructions. A part cut short by cycles
+// running out is dropped.
+//
+// executed is set to the number of instructions run, recorded or not.
+template <MemoryPolicy Memory, class StopAt>
+Trace RecordTrace(State &state, int cycles, int &executed, size_t maxBlockSize,
+                  size_t maxSize, StopAt &&stop) {
+  using Interpreter = R3000Interpreter<Memory>;
+  const uint32_t head = state.pc;
+  Trace trace;
+  size_t size = 0;
+  executed = 0;
+
+  while (executed < cycles) {
+    TracePart part{state.pc,
+                   Interpreter::FetchBlock(state, state.pc, maxBlockSize)};
+    const int stepped =
+        Interpreter::StepBlock(state, cycles - executed, maxBlockSize);
+    executed += stepped;
+    if ((size_t)stepped < part.instrs.size()) {
+      break;
+    }
+
+    // A jump in a delay slot takes effect after the part, so only guarding
+    // pc wouldn't catch the path changing
+    const bool jumpInDelaySlot =
+        Interpreter::IsControlTransfer(part.instrs.back());
+
+    size += part.instrs.size();
+    trace.push_back(std::move(part));
+    const bool kernelCall = state.hle && KernelHLE::IsEntry(state.pc);
+    if (state.pc == head || size >= maxSize || stop(state.pc) ||
+        jumpInDelaySlot || kernelCall) {
+      break;
+    }
+  }
+
+  return trace;
+}
+
+} // namespace Meeps
@@ -0,0 +1,313 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+// Just enough of an x86-64 assembler for the recompiler. Every memory operand
+// is [base + disp32] and every ALU op works on 32 bit registers, which is all
+// that MIPS-I code needs.
+
+namespace Meeps::X64 {
+
+enum class Reg : uint8_t {
+  RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+  R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+enum class Cond : uint8_t {
+  O, NO, B, AE, E, NE, BE, A, S, NS, P, NP, L, GE, LE, G
+};
+
+// /digit of the 0x81 (imm) group, the reg-reg form is (digit << 3) | 1
+enum class ALU : uint8_t { ADD = 0, OR = 1, AND = 4, SUB = 5, XOR = 6, CMP = 7 };
+
+// /digit of the 0xC1 (imm) and 0xD3 (cl) groups
+enum class ShiftOp : uint8_t { SHL = 4, SHR = 5, SAR = 7 };
+
+#ifdef _WIN32
+constexpr Reg ABIParam1 = Reg::RCX;
+constexpr Reg ABIParam2 = Reg::RDX;
+constexpr Reg ABIParam3 = Reg::R8;
+constexpr int32_t ABIShadowSpace = 32;
+#else
+constexpr Reg ABIParam1 = Reg::RDI;
+constexpr Reg ABIParam2 = Reg::RSI;
+constexpr Reg ABIParam3 = Reg::RDX;
+constexpr int32_t ABIShadowSpace = 0;
+#endif
+
+class Emitter {
+public:
+  Emitter(size_t size) : size(size) {
+#ifdef _WIN32
+    buffer = (uint8_t *)VirtualAlloc(nullptr, size, MEM_COMMIT | MEM_RESERVE,
+                                     PAGE_EXECUTE_READWRITE);
+    if (!buffer) {
+#else
+    void *mem = mmap(nullptr, size, PROT_READ | PROT_WRITE | PROT_EXEC,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    buffer = mem == MAP_FAILED ? nullptr : (uint8_t *)mem;
+    if (!buffer) {
+#endif
+      throw std::runtime_error("[X64 Emitter] Failed to allocate code buffer");
+    }
+    cursor = buffer;
+  }
+
+  ~Emitter() {
+#ifdef _WIN32
+    VirtualFree(buffer, 0, MEM_RELEASE);
+#else
+    munmap(buffer, size);
+#endif
+  }
+
+  Emitter(const Emitter &) = delete;
+  Emitter &operator=(const Emitter &) = delete;
+
+  void Reset() { cursor = buffer; }
+  size_t Remaining() const { return size - (cursor - buffer); }
+  const uint8_t *GetCursor() const { return cursor; }
+
+  // mov r32, [base + disp]
+  void MovLoad(Reg dst, Reg base, int32_t disp) {
+    Rex(false, dst, base);
+    Byte(0x8B);
+    MemOperand(dst, base, disp);
+  }
+
+  // mov r64, [base + disp]
+  void MovLoad64(Reg dst, Reg base, int32_t disp) {
+    Rex(true, dst, base);
+    Byte(0x8B);
+    MemOperand(dst, base, disp);
+  }
+
+  // mov [base + disp], r32
+  void MovStore(Reg base, int32_t disp, Reg src) {
+    Rex(false, src, base);
+    Byte(0x89);
+    MemOperand(src, base, disp);
+  }
+
+  // mov dword [base + disp], imm32
+  void MovStoreImm(Reg base, int32_t disp, uint32_t imm) {
+    Rex(false, Reg::RAX, base);
+    Byte(0xC7);
+    MemOperand(Reg::RAX, base, disp);
+    Dword(imm);
+  }
+
+  // mov r32, imm32 (zero extends into the full register)
+  void MovImm(Reg dst, uint32_t imm) {
+    Rex(false, Reg::RAX, dst);
+    Byte(0xB8 + Low(dst));
+    Dword(imm);
+  }
+
+  // mov r64, imm64
+  void MovImm64(Reg dst, uint64_t imm) {
+    Rex(true, Reg::RAX, dst);
+    Byte(0xB8 + Low(dst));
+    Dword((uint32_t)imm);
+    Dword((uint32_t)(imm >> 32));
+  }
+
+  // mov r32, r32
+  void Mov(Reg dst, Reg src) {
+    Rex(false, src, dst);
+    Byte(0x89);
+    RegOperand(src, dst);
+  }
+
+  // mov r64, r64
+  void Mov64(Reg dst, Reg src) {
+    Rex(true, src, dst);
+    Byte(0x89);
+    RegOperand(src, dst);
+  }
+
+  // op r32, r32
+  void Alu(ALU op, Reg dst, Reg src) {
+    Rex(false, src, dst);
+    Byte(((uint8_t)op << 3) | 1);
+    RegOperand(src, dst);
+  }
+
+  // op r32, imm32
+  void AluImm(ALU op, Reg dst, uint32_t imm) {
+    Rex(false, Reg::RAX, dst);
+    Byte(0x81);
+    RegOperand((Reg)op, dst);
+    Dword(imm);
+  }
+
+  // op r64, imm8 (only used for stack adjustments)
+  void AluImm64(ALU op, Reg dst, int8_t imm) {
+    Rex(true, Reg::RAX, dst);
+    Byte(0x83);
+    RegOperand((Reg)op, dst);
+    Byte((uint8_t)imm);
+  }
+
+  // shl/shr/sar r32, imm8
+  void ShiftImm(ShiftOp op, Reg dst, uint8_t amount) {
+    Rex(false, Reg::RAX, dst);
+    Byte(0xC1);
+    RegOperand((Reg)op, dst);
+    Byte(amount);
+  }
+
+  // shl/shr/sar r32, cl
+  void ShiftCL(ShiftOp op, Reg dst) {
+    Rex(false, Reg::RAX, dst);
+    Byte(0xD3);
+    RegOperand((Reg)op, dst);
+  }
+
+  // not r32
+  void Not(Reg dst) {
+    Rex(false, Reg::RAX, dst);
+    Byte(0xF7);
+    RegOperand((Reg)2, dst);
+  }
+
+  // setcc r8 + movzx r32, r8, only valid for registers with a legacy low byte
+  void SetCC(Cond cond, Reg dst) {
+    Rex(false, Reg::RAX, dst);
+    Byte(0x0F);
+    Byte(0x90 + (uint8_t)cond);
+    RegOperand(Reg::RAX, dst);
+    MovZX8(dst, dst);
+  }
+
+  // cmovcc r32, r32
+  void CMov(Cond cond, Reg dst, Reg src) {
+    Rex(false, dst, src);
+    Byte(0x0F);
+    Byte(0x40 + (uint8_t)cond);
+    RegOperand(dst, src);
+  }
+
+  void MovZX8(Reg dst, Reg src) { Extend(0xB6, dst, src); }
+  void MovZX16(Reg dst, Reg src) { Extend(0xB7, dst, src); }
+  void MovSX8(Reg dst, Reg src) { Extend(0xBE, dst, src); }
+  void MovSX16(Reg dst, Reg src) { Extend(0xBF, dst, src); }
+
+  // Copies bit number bit of the bit string at [base + disp] into CF
+  void BitTest(Reg base, int32_t disp, Reg bit) {
+    Rex(false, bit, base);
+    Byte(0x0F);
+    Byte(0xA3);
+    MemOperand(bit, base, disp);
+  }
+
+  void Push(Reg reg) {
+    Rex(false, Reg::RAX, reg);
+    Byte(0x50 + Low(reg));
+  }
+
+  void Pop(Reg reg) {
+    Rex(false, Reg::RAX, reg);
+    Byte(0x58 + Low(reg));
+  }
+
+  // Calls an absolute address through rax, which is clobbered
+  void Call(const void *function) {
+    MovImm64(Reg::RAX, (uint64_t)function);
+    Byte(0xFF);
+    Byte(0xD0); // call rax
+  }
+
+  void Ret() { Byte(0xC3); }
+
+  // jcc rel8 to a label further ahead, pass the result to Bind once there
+  uint8_t *JccShort(Cond cond) {
+    Byte(0x70 + (uint8_t)cond);
+    Byte(0);
+    return cursor - 1;
+  }
+
+  // jmp rel8, bound the same way
+  uint8_t *JmpShort() {
+    Byte(0xEB);
+    Byte(0);
+    return cursor - 1;
+  }
+
+  // jcc rel32, for labels a short jump may not reach. Bound with BindNear.
+  uint8_t *JccNear(Cond cond) {
+    Byte(0x0F);
+    Byte(0x80 + (uint8_t)cond);
+    Dword(0);
+    return cursor - 4;
+  }
+
+  // Points a short jump at the cursor
+  void Bind(uint8_t *displacement) {
+    *displacement = (uint8_t)(cursor - displacement - 1);
+  }
+
+  void BindNear(uint8_t *displacement) {
+    const int32_t rel = (int32_t)(cursor - displacement - 4);
+    std::memcpy(displacement, &rel, sizeof(rel));
+  }
+
+  // Copies pre-encoded instructions verbatim
+  void Raw(const uint8_t *bytes, size_t length) {
+    std::memcpy(cursor, bytes, length);
+    cursor += length;
+  }
+
+private:
+  static uint8_t Low(Reg reg) { return (uint8_t)reg & 7; }
+  static bool High(Reg reg) { return (uint8_t)reg >= 8; }
+
+  void Byte(uint8_t value) { *cursor++ = value; }
+
+  void Dword(uint32_t value) {
+    std::memcpy(cursor, &value, sizeof(value));
+    cursor += sizeof(value);
+  }
+
+  // Emits a REX prefix if any of its bits are needed. Always emitting one for
+  // byte registers would also be correct, but we only ever touch al/cl/dl/bl
+  void Rex(bool wide, Reg reg, Reg rm) {
+    uint8_t rex = 0x40 | (wide << 3) | (High(reg) << 2) | High(rm);
+    if (rex != 0x40) {
+      Byte(rex);
+    }
+  }
+
+  void RegOperand(Reg reg, Reg rm) {
+    Byte(0b11'000'000 | (Low(reg) << 3) | Low(rm));
+  }
+
+  void MemOperand(Reg reg, Reg base, int32_t disp) {
+    Byte(0b10'000'000 | (Low(reg) << 3) | Low(base));
+    if (Low(base) == 4) {
+      Byte(0x24); // rsp/r12 as a base always needs a SIB byte
+    }
+    Dword((uint32_t)disp);
+  }
+
+  void Extend(uint8_t opcode, Reg dst, Reg src) {
+    Rex(false, dst, src);
+    Byte(0x0F);
+    Byte(opcode);
+    RegOperand(dst, src);
+  }
+
+  uint8_t *buffer;
+  uint8_t *cursor;
+  size_t size;
+};
+
+} // namespace Meeps::X64
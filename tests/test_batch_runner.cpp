@@ -0,0 +1,62 @@
+#include "test_cop0.h"
+#include <batchrunner.h>
+#include <cstring>
+#include <doctest.h>
+#include <memory>
+#include <vector>
+
+using namespace Meeps;
+
+// Each guest sums 1..n for its own n in a loop, then spins in place
+static constexpr uint32_t program[] = {
+    0x00001021, // addu $2, $0, $0
+    0x00411021, // addu $2, $2, $1
+    0x2421ffff, // addiu $1, $1, -1
+    0x1420fffd, // bne $1, $0, -3
+    0x00000000, // nop
+    0x08000005, // j 0x14
+    0x00000000, // nop
+};
+
+static auto BuildGuest = [](size_t index,
+                            BatchRunner<PageTableMemory>::Instance &guest) {
+  auto ram = std::make_shared<std::vector<uint8_t>>(PageTable::PageSize);
+  std::memcpy(ram->data(), program, sizeof(program));
+
+  guest.cop0 = std::make_unique<TestCOP0>();
+  guest.cpu = std::make_unique<CPU<PageTableMemory>>(CPUMode::CachedInterpreter,
+                                                     guest.cop0.get());
+  guest.cpu->GetState().pageTable.MapMemory(0, PageTable::PageSize,
+                                            ram->data());
+  guest.cpu->GetState().SetGPR(1, 100 + index);
+  guest.memory = ram;
+};
+
+TEST_CASE("Batch Runner") {
+  constexpr size_t count = 64;
+  BatchRunner<PageTableMemory>::Options options;
+  options.threads = 4;
+  options.sliceCycles = 37;
+  BatchRunner<PageTableMemory> runner(count, BuildGuest, options);
+
+  SUBCASE("Runs Every Instance") {
+    runner.Run(10000);
+    for (size_t i = 0; i < count; i++) {
+      const uint32_t n = 100 + i;
+      REQUIRE(runner.GetCPU(i).GetState().GetGPR(1) == 0);
+      REQUIRE(runner.GetCPU(i).GetState().GetGPR(2) == n * (n + 1) / 2);
+      REQUIRE(!runner.GetInstance(i).error);
+    }
+  }
+
+  SUBCASE("Stops Instances Early") {
+    // Guests stop at the first slice boundary after reaching the spin loop
+    runner.Run(1'000'000, [](size_t, auto &guest) {
+      return guest.cpu->GetState().pc >= 0x14;
+    });
+    for (size_t i = 0; i < count; i++) {
+      REQUIRE(runner.GetCPU(i).GetState().GetGPR(1) == 0);
+      REQUIRE(runner.GetInstance(i).cycles > 0);
+    }
+  }
+}
@@ -0,0 +1,508 @@
+#include "test_cop0.h"
+#include "test_memory.h"
+#include <chrono>
+#include <doctest.h>
+#include <fmt/core.h>
+#include <iterator>
+#include <r3000.h>
+#include <random>
+#include <vector>
+
+// Every execution mode has to match the plain interpreter exactly, so these
+// tests run the same guest code through each mode and compare the results
+
+using namespace Meeps;
+
+static TestCOP0 cop0{};
+static TestMemory memory{};
+static CPU reference{CPUMode::Interpreter, &cop0};
+static CPU cached{CPUMode::CachedInterpreter, &cop0};
+static CPU recompiled{CPUMode::Recompiler, &cop0};
+static constexpr auto instrCount = 100000;
+
+static auto rnum = [](uint32_t lower, uint32_t upper) { // both inclusive
+  static std::mt19937 rng(
+      std::chrono::steady_clock::now().time_since_epoch().count());
+  return std::uniform_int_distribution<uint32_t>(lower, upper)(rng);
+};
+
+static auto AttachMemory = [](CPU<> &cpu) {
+  cpu.SetMemoryPointer(&memory);
+  cpu.SetReadPointer<uint8_t>(&TestMemory::read<uint8_t>);
+  cpu.SetWritePointer<uint8_t>(&TestMemory::write<uint8_t>);
+  cpu.SetReadPointer<uint16_t>(&TestMemory::read<uint16_t>);
+  cpu.SetWritePointer<uint16_t>(&TestMemory::write<uint16_t>);
+  cpu.SetReadPointer<uint32_t>(&TestMemory::read<uint32_t>);
+  cpu.SetWritePointer<uint32_t>(&TestMemory::write<uint32_t>);
+};
+
+static auto ResetAll = []() {
+  memory.Reset();
+  reference.Reset();
+  cached.Reset();
+  recompiled.Reset();
+  for (auto i = 1; i < 32; i++) {
+    uint32_t value = rnum(0, 0xffffffff);
+    reference.GetState().SetGPR(i, value);
+    cached.GetState().SetGPR(i, value);
+    recompiled.GetState().SetGPR(i, value);
+  }
+};
+
+static auto CompareStates = [](State &expected, State &actual) {
+  auto success = true;
+  for (auto i = 0; i < 32; i++) {
+    if (expected.gpr[i] != actual.gpr[i]) {
+      success = false;
+      fmt::print("DIFF r{}: expected 0x{:08X}, got 0x{:08X}\n", i,
+                 expected.gpr[i], actual.gpr[i]);
+    }
+  }
+  if (expected.pc != actual.pc || expected.nextPC != actual.nextPC) {
+    success = false;
+    fmt::print("DIFF PC: expected {:08X}/{:08X}, got {:08X}/{:08X}\n",
+               expected.pc, expected.nextPC, actual.pc, actual.nextPC);
+  }
+  return success;
+};
+
+TEST_CASE("Interpreter") {
+  AttachMemory(reference);
+
+  SUBCASE("Slices Ending In Delay Slots") {
+    ResetAll();
+
+    memory.WriteInstrSequential(0x24010064); // addiu $1, $0, 100
+    memory.WriteInstrSequential(0x0c000010); // jal 0x40
+    memory.WriteInstrSequential(0x24420001); // addiu $2, $2, 1 (delay slot)
+    memory.WriteInstrSequential(0x2421ffff); // addiu $1, $1, -1
+    memory.WriteInstrSequential(0x1420fffc); // bne $1, $0, -4
+    memory.WriteInstrSequential(0x00000000); // nop (delay slot)
+    memory.WriteInstrSequential(0x08000006); // j 0x18
+    memory.WriteInstrSequential(0x00000000); // nop (delay slot)
+    memory.instrCounter = 0x40;
+    memory.WriteInstrSequential(0x00621821); // addu $3, $3, $2
+    memory.WriteInstrSequential(0x03e00008); // jr $ra
+    memory.WriteInstrSequential(0x24840002); // addiu $4, $4, 2 (delay slot)
+
+    // Run only writes pc/nextPC back when it returns, which has to look the
+    // same as stepping one instruction at a time
+    CPU stepped{CPUMode::Interpreter, &cop0};
+    AttachMemory(stepped);
+    stepped.GetState().gpr = reference.GetState().gpr;
+
+    bool matches = true;
+    for (int remaining = 3000, slice = 1; remaining > 0;
+         remaining -= slice, slice = slice % 7 + 1) {
+      const int cycles = std::min(remaining, slice);
+      reference.Run(cycles);
+      for (int i = 0; i < cycles; i++) {
+        R3000Interpreter<>::ExecuteInstruction(stepped.GetState());
+      }
+      matches &= CompareStates(stepped.GetState(), reference.GetState());
+    }
+
+    REQUIRE(matches);
+    REQUIRE(reference.GetState().GetGPR(1) == 0);
+  }
+}
+
+TEST_CASE("Cached Interpreter") {
+  AttachMemory(reference);
+  AttachMemory(cached);
+
+  SUBCASE("Random ALU Instructions") {
+    fmt::print("Comparing Cached Interpreter On Random ALU Instructions\n");
+    // Straight line code only runs once, so translate it right away
+    cached.SetHotThreshold(1);
+    for (auto i = 0; i < 10; i++) {
+      ResetAll();
+
+      std::vector<uint32_t> ops = {0x8, 0x9, 0xA, 0xB, 0xC, 0xD, 0xE, 0xF};
+      std::vector<uint32_t> funcs = {0x0,  0x2,  0x3,  0x4,  0x6,  0x7,
+                                     0x21, 0x23, 0x24, 0x25, 0x26, 0x27,
+                                     0x2A, 0x2B};
+      Instruction instr = 0;
+
+      for (auto i = 0; i < instrCount; i++) {
+        instr.value = rnum(0, 0xffffffff);
+        if (rnum(0, 1)) {
+          instr.r.op = 0;
+          instr.r.func = funcs[rnum(0, funcs.size() - 1)];
+        } else {
+          instr.i.op = ops[rnum(0, ops.size() - 1)];
+        }
+        memory.write<uint32_t>(&memory, i * 4, instr.value);
+      }
+
+      reference.Run(instrCount);
+      cached.Run(instrCount);
+      REQUIRE(CompareStates(reference.GetState(), cached.GetState()));
+    }
+    cached.SetHotThreshold(HotnessCounters::DefaultThreshold);
+  }
+
+  SUBCASE("Loops And Delay Slots") {
+    fmt::print("Comparing Cached Interpreter On Loops\n");
+    ResetAll();
+
+    memory.WriteInstrSequential(0x240103e8); // addiu $1, $0, 1000
+    memory.WriteInstrSequential(0x24420003); // addiu $2, $2, 3
+    memory.WriteInstrSequential(0x2421ffff); // addiu $1, $1, -1
+    memory.WriteInstrSequential(0x1420fffd); // bne $1, $0, -3
+    memory.WriteInstrSequential(0x00621821); // addu $3, $3, $2 (delay slot)
+    memory.WriteInstrSequential(0xac020100); // sw $2, 0x100($0)
+    memory.WriteInstrSequential(0x8c040100); // lw $4, 0x100($0)
+
+    reference.Run(4004);
+    // Odd slices stop in the middle of blocks and right before delay slots
+    for (auto remaining = 4004; remaining > 0; remaining -= 7) {
+      cached.Run(std::min(remaining, 7));
+    }
+
+    REQUIRE(cached.GetState().GetGPR(1) == 0);
+    REQUIRE(CompareStates(reference.GetState(), cached.GetState()));
+  }
+}
+
+TEST_CASE("Recompiler") {
+  AttachMemory(reference);
+  AttachMemory(recompiled);
+
+  SUBCASE("Random ALU Instructions") {
+    fmt::print("Comparing Recompiler On Random ALU Instructions\n");
+    recompiled.SetHotThreshold(1);
+    for (auto i = 0; i < 10; i++) {
+      ResetAll();
+
+      // Includes MULT/DIV and HI/LO moves to exercise interpreter fallbacks
+      std::vector<uint32_t> ops = {0x8, 0x9, 0xA, 0xB, 0xC, 0xD, 0xE, 0xF};
+      std::vector<uint32_t> funcs = {0x0,  0x2,  0x3,  0x4,  0x6,  0x7,
+                                     0x10, 0x12, 0x18, 0x19, 0x1A, 0x1B,
+                                     0x21, 0x23, 0x24, 0x25, 0x26, 0x27,
+                                     0x2A, 0x2B};
+      Instruction instr = 0;
+
+      for (auto i = 0; i < instrCount; i++) {
+        instr.value = rnum(0, 0xffffffff);
+        if (rnum(0, 1)) {
+          instr.r.op = 0;
+          instr.r.func = funcs[rnum(0, funcs.size() - 1)];
+        } else {
+          instr.i.op = ops[rnum(0, ops.size() - 1)];
+        }
+        memory.write<uint32_t>(&memory, i * 4, instr.value);
+      }
+
+      reference.Run(instrCount);
+      recompiled.Run(instrCount);
+      REQUIRE(CompareStates(reference.GetState(), recompiled.GetState()));
+    }
+    recompiled.SetHotThreshold(HotnessCounters::DefaultThreshold);
+  }
+
+  SUBCASE("Loops And Delay Slots") {
+    fmt::print("Comparing Recompiler On Loops\n");
+    ResetAll();
+
+    memory.WriteInstrSequential(0x240103e8); // addiu $1, $0, 1000
+    memory.WriteInstrSequential(0x24420003); // addiu $2, $2, 3
+    memory.WriteInstrSequential(0x2421ffff); // addiu $1, $1, -1
+    memory.WriteInstrSequential(0x1420fffd); // bne $1, $0, -3
+    memory.WriteInstrSequential(0x00621821); // addu $3, $3, $2 (delay slot)
+    memory.WriteInstrSequential(0xac020100); // sw $2, 0x100($0)
+    memory.WriteInstrSequential(0x8c040100); // lw $4, 0x100($0)
+
+    reference.Run(4004);
+    for (auto remaining = 4004; remaining > 0; remaining -= 7) {
+      recompiled.Run(std::min(remaining, 7));
+    }
+
+    REQUIRE(recompiled.GetState().GetGPR(1) == 0);
+    REQUIRE(CompareStates(reference.GetState(), recompiled.GetState()));
+  }
+}
+
+TEST_CASE("Block Linking") {
+  AttachMemory(reference);
+  AttachMemory(cached);
+  AttachMemory(recompiled);
+
+  // Blocks get chained across the loop and the JR return, then the callee is
+  // patched in place and only its block is invalidated
+  auto RunProgram = [](CPU<> &cpu) {
+    ResetAll();
+    const uint32_t program[] = {
+        0x240100c8, // addiu $1, $0, 200
+        0x0c000010, // jal 0x40
+        0x00000000, // nop
+        0x0c000010, // jal 0x40
+        0x24a50001, // addiu $5, $5, 1 (delay slot)
+        0x2421ffff, // addiu $1, $1, -1
+        0x1420fffa, // bne $1, $0, -6
+        0x00000000, // nop
+        0x08000008, // j 0x20
+        0x00000000, // nop
+    };
+    for (uint32_t i = 0; i < std::size(program); i++) {
+      memory.write<uint32_t>(&memory, i * 4, program[i]);
+    }
+    memory.write<uint32_t>(&memory, 0x40, 0x24420007); // addiu $2, $2, 7
+    memory.write<uint32_t>(&memory, 0x44, 0x03e00008); // jr $31
+    memory.write<uint32_t>(&memory, 0x48, 0x00621821); // addu $3, $3, $2
+
+    reference.Run(1500);
+    for (auto remaining = 1500; remaining > 0; remaining -= 5) {
+      cpu.Run(std::min(remaining, 5));
+    }
+    REQUIRE(CompareStates(reference.GetState(), cpu.GetState()));
+
+    memory.write<uint32_t>(&memory, 0x40, 0x2442fffe); // addiu $2, $2, -2
+    cpu.InvalidateCache(0x40, 4);
+
+    reference.Run(1500);
+    cpu.Run(1500);
+    REQUIRE(CompareStates(reference.GetState(), cpu.GetState()));
+  };
+
+  SUBCASE("Cached Interpreter") { RunProgram(cached); }
+  SUBCASE("Recompiler") { RunProgram(recompiled); }
+}
+
+TEST_CASE("Tiered Execution") {
+  AttachMemory(reference);
+  AttachMemory(cached);
+  AttachMemory(recompiled);
+
+  // The setup block runs once and stays cold, the loop body is stepped until
+  // its 10th entry and runs translated from then on
+  auto RunProgram = [](CPU<> &cpu) {
+    ResetAll();
+    cpu.SetHotThreshold(10);
+    REQUIRE(cpu.GetHotThreshold() == 10);
+
+    memory.WriteInstrSequential(0x24010064); // addiu $1, $0, 100
+    memory.WriteInstrSequential(0x24420003); // addiu $2, $2, 3
+    memory.WriteInstrSequential(0x2421ffff); // addiu $1, $1, -1
+    memory.WriteInstrSequential(0x1420fffd); // bne $1, $0, -3
+    memory.WriteInstrSequential(0x00000000); // nop
+
+    const TierStats before = cpu.GetTierStats();
+    reference.Run(401);
+    cpu.Run(401);
+    const TierStats after = cpu.GetTierStats();
+    cpu.SetHotThreshold(HotnessCounters::DefaultThreshold);
+
+    REQUIRE(CompareStates(reference.GetState(), cpu.GetState()));
+    REQUIRE(after.blocksTranslated - before.blocksTranslated == 1);
+    REQUIRE(after.steppedInstructions - before.steppedInstructions ==
+            5 + 9 * 4);
+    REQUIRE(after.blockInstructions - before.blockInstructions == 90 * 4);
+  };
+
+  SUBCASE("Cached Interpreter") { RunProgram(cached); }
+  SUBCASE("Recompiler") { RunProgram(recompiled); }
+}
+
+TEST_CASE("Trace Recording") {
+  AttachMemory(reference);
+  AttachMemory(cached);
+  AttachMemory(recompiled);
+
+  // The loop spans three blocks, and the inner branch flips partway through
+  // so the recorded path has to be left through a side exit
+  auto RunProgram = [](CPU<> &cpu) {
+    ResetAll();
+    cpu.SetTracing(true);
+
+    memory.WriteInstrSequential(0x2401012c); // addiu $1, $0, 300
+    memory.WriteInstrSequential(0x2421ffff); // addiu $1, $1, -1
+    memory.WriteInstrSequential(0x28240064); // slti $4, $1, 100
+    memory.WriteInstrSequential(0x14800002); // bne $4, $0, 2
+    memory.WriteInstrSequential(0x24420003); // addiu $2, $2, 3 (delay slot)
+    memory.WriteInstrSequential(0x24420005); // addiu $2, $2, 5
+    memory.WriteInstrSequential(0x1420fffa); // bne $1, $0, -6
+    memory.WriteInstrSequential(0x00621821); // addu $3, $3, $2 (delay slot)
+    memory.WriteInstrSequential(0x08000008); // j 0x20
+    memory.WriteInstrSequential(0x00000000); // nop
+
+    const TierStats before = cpu.GetTierStats();
+    reference.Run(3000);
+    for (auto remaining = 3000; remaining > 0; remaining -= 500) {
+      cpu.Run(500);
+    }
+    const TierStats after = cpu.GetTierStats();
+    cpu.SetTracing(false);
+
+    REQUIRE(CompareStates(reference.GetState(), cpu.GetState()));
+    REQUIRE(after.tracesTranslated > before.tracesTranslated);
+    REQUIRE(after.blocksTranslated == before.blocksTranslated);
+    REQUIRE(after.blockInstructions - before.blockInstructions > 2000);
+  };
+
+  SUBCASE("Cached Interpreter") { RunProgram(cached); }
+  SUBCASE("Recompiler") { RunProgram(recompiled); }
+}
+
+TEST_CASE("Idle Loop Skipping") {
+  AttachMemory(reference);
+  AttachMemory(cached);
+  AttachMemory(recompiled);
+
+  // Polls a flag until it's set, then spins on a counter, which changes state
+  // every iteration and must not be skipped
+  auto RunProgram = [](CPU<> &cpu) {
+    ResetAll();
+    IR::Options options;
+    options.idleLoopSkipping = true;
+    cpu.SetIROptions(options);
+
+    memory.WriteInstrSequential(0x8c020100); // lw $2, 0x100($0)
+    memory.WriteInstrSequential(0x1040fffe); // beq $2, $0, -2
+    memory.WriteInstrSequential(0x00000000); // nop (delay slot)
+    memory.WriteInstrSequential(0x24630001); // addiu $3, $3, 1
+    memory.WriteInstrSequential(0x24840001); // addiu $4, $4, 1
+    memory.WriteInstrSequential(0x08000004); // j 0x10
+    memory.WriteInstrSequential(0x00000000); // nop (delay slot)
+
+    const TierStats before = cpu.GetTierStats();
+    reference.Run(100000);
+    for (auto remaining = 100000; remaining > 0; remaining -= 9999) {
+      cpu.Run(std::min(remaining, 9999));
+    }
+    const TierStats idle = cpu.GetTierStats();
+    REQUIRE(CompareStates(reference.GetState(), cpu.GetState()));
+    REQUIRE(idle.skippedInstructions - before.skippedInstructions > 90000);
+
+    memory.write<uint32_t>(&memory, 0x100, 1);
+    reference.Run(10000);
+    cpu.Run(10000);
+    const TierStats busy = cpu.GetTierStats();
+    cpu.SetIROptions({});
+
+    REQUIRE(CompareStates(reference.GetState(), cpu.GetState()));
+    REQUIRE(busy.skippedInstructions == idle.skippedInstructions);
+  };
+
+  SUBCASE("Cached Interpreter") { RunProgram(cached); }
+  SUBCASE("Recompiler") { RunProgram(recompiled); }
+}
+
+TEST_CASE("Self-Modifying Code") {
+  AttachMemory(reference);
+  AttachMemory(cached);
+  AttachMemory(recompiled);
+
+  // Calls a function on its own page and patches it after every call, to
+  // return one more than before. The stores to 0x2000 only touch data.
+  auto LoadProgram = []() {
+    memory.Reset();
+    const uint32_t program[] = {
+        0x3c052402, // 00: lui $5, 0x2402
+        0x34a50001, // 04: ori $5, $5, 1 (addiu $2, $0, 1)
+        0x00002021, // 08: addu $4, $0, $0
+        0x0c000400, // 0c: jal 0x1000
+        0x00000000, // 10: nop (delay slot)
+        0x00822021, // 14: addu $4, $4, $2
+        0x24a50001, // 18: addiu $5, $5, 1
+        0xac051000, // 1c: sw $5, 0x1000($0)
+        0xac042000, // 20: sw $4, 0x2000($0)
+        0x08000003, // 24: j 0x0c
+        0x00000000, // 28: nop (delay slot)
+    };
+    for (size_t i = 0; i < std::size(program); i++) {
+      memory.write<uint32_t>(&memory, i * 4, program[i]);
+    }
+    memory.write<uint32_t>(&memory, 0x1000, 0x24020001); // addiu $2, $0, 1
+    memory.write<uint32_t>(&memory, 0x1004, 0x03e00008); // jr $31
+    memory.write<uint32_t>(&memory, 0x1008, 0x00000000); // nop (delay slot)
+  };
+
+  auto RunProgram = [&](CPU<> &cpu) {
+    ResetAll();
+    LoadProgram();
+    reference.Run(10000);
+    LoadProgram();
+    cpu.SetHotThreshold(1);
+    cpu.Run(10000);
+    cpu.SetHotThreshold(HotnessCounters::DefaultThreshold);
+
+    // 1 + 2 + ... for every call
+    const uint32_t calls = memory.read<uint32_t>(&memory, 0x1000) - 0x24020001;
+    REQUIRE(calls > 500);
+    REQUIRE(reference.GetState().GetGPR(4) >= calls * (calls + 1) / 2);
+    REQUIRE(CompareStates(reference.GetState(), cpu.GetState()));
+  };
+
+  SUBCASE("Cached Interpreter") { RunProgram(cached); }
+  SUBCASE("Recompiler") { RunProgram(recompiled); }
+}
+
+TEST_CASE("Stopping") {
+  AttachMemory(reference);
+  AttachMemory(cached);
+  AttachMemory(recompiled);
+
+  // Every stop leaves pc on the instruction that caused it, which runs again
+  // unless skipped, including in a delay slot
+  auto RunProgram = [](CPU<> &cpu) {
+    ResetAll();
+    cpu.SetHotThreshold(1);
+    memory.WriteInstrSequential(0x24020001); // addiu $2, $0, 1
+    memory.WriteInstrSequential(0x0000000c); // syscall
+    memory.WriteInstrSequential(0x24420001); // addiu $2, $2, 1
+    memory.WriteInstrSequential(0x10000002); // beq $0, $0, 2
+    memory.WriteInstrSequential(0x0000000d); // break (delay slot)
+    memory.WriteInstrSequential(0x00000000); // nop
+    memory.WriteInstrSequential(0x24420001); // addiu $2, $2, 1
+    memory.WriteInstrSequential(0xfc000000); // reserved
+    memory.WriteInstrSequential(0x24420001); // addiu $2, $2, 1
+    memory.WriteInstrSequential(0x08000009); // j 0x24
+    memory.WriteInstrSequential(0x00000000); // nop (delay slot)
+
+    // The second time around, the blocks are already translated
+    for (int pass = 0; pass < 2; pass++) {
+      State &state = cpu.GetState();
+      cpu.SetPC(0);
+
+      RunStatus status = cpu.Run(100);
+      REQUIRE(status.reason == StopReason::Syscall);
+      REQUIRE(status.cycles == 1);
+      REQUIRE(state.pc == 0x04);
+      REQUIRE(cpu.Run(100).cycles == 0);
+
+      cpu.Skip();
+      status = cpu.Run(100);
+      REQUIRE(status.reason == StopReason::Break);
+      REQUIRE(status.cycles == 2);
+      REQUIRE(state.pc == 0x10);
+      REQUIRE(state.nextPC == 0x18);
+
+      cpu.Skip();
+      status = cpu.Run(100);
+      REQUIRE(status.reason == StopReason::ReservedInstruction);
+      REQUIRE(status.cycles == 1);
+      REQUIRE(state.pc == 0x1c);
+
+      cpu.Skip();
+      cpu.AddBreakpoint(0x24);
+      status = cpu.Run(100);
+      REQUIRE(status.reason == StopReason::Breakpoint);
+      REQUIRE(status.cycles == 1);
+      REQUIRE(state.pc == 0x24);
+      REQUIRE(cpu.Run(100).cycles == 2);
+
+      cpu.RemoveBreakpoint(0x24);
+      status = cpu.Run(100);
+      REQUIRE(status.reason == StopReason::None);
+      REQUIRE(status.cycles == 100);
+      REQUIRE(state.GetGPR(2) == 4);
+    }
+
+    cpu.SetHotThreshold(HotnessCounters::DefaultThreshold);
+  };
+
+  SUBCASE("Interpreter") { RunProgram(reference); }
+  SUBCASE("Cached Interpreter") { RunProgram(cached); }
+  SUBCASE("Recompiler") { RunProgram(recompiled); }
+}
@@ -0,0 +1,265 @@
+#include "test_cop0.h"
+#include <cstring>
+#include <doctest.h>
+#include <r3000.h>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+using namespace Meeps;
+
+// Raises a syscall, an overflow, a load address error, a break in a delay
+// slot and a store address error, then spins
+static const std::vector<uint32_t> program = {
+    0x24020001, // 00: addiu $2, $0, 1
+    0x0000000c, // 04: syscall
+    0x3c037fff, // 08: lui $3, 0x7fff
+    0x00632020, // 0c: add $4, $3, $3
+    0x8c050002, // 10: lw $5, 2($0)
+    0x10000002, // 14: beq $0, $0, 2
+    0x0000000d, // 18: break (delay slot)
+    0x00000000, // 1c: nop
+    0xa4020001, // 20: sh $2, 1($0)
+    0x24420001, // 24: addiu $2, $2, 1
+    0x0800000a, // 28: j 0x28
+    0x00000000, // 2c: nop
+};
+
+// Records EPC, Cause and BadVaddr at 0x1000 + $16, then returns past the
+// instruction that raised it, or past the delay slot if BD is set
+static const std::vector<uint32_t> handler = {
+    0x401a7000, // 80: mfc0 $26, EPC
+    0x401b6800, // 84: mfc0 $27, Cause
+    0xae1a1000, // 88: sw $26, 0x1000($16)
+    0xae1b1004, // 8c: sw $27, 0x1004($16)
+    0x401a4000, // 90: mfc0 $26, BadVaddr
+    0xae1a1008, // 94: sw $26, 0x1008($16)
+    0x26100010, // 98: addiu $16, $16, 16
+    0x401a7000, // 9c: mfc0 $26, EPC
+    0x07610002, // a0: bgez $27, 2
+    0x275a0004, // a4: addiu $26, $26, 4 (delay slot)
+    0x275a0004, // a8: addiu $26, $26, 4
+    0x03400008, // ac: jr $26
+    0x42000010, // b0: rfe (delay slot)
+};
+
+static void RunProgram(CPUMode mode) {
+  std::vector<uint8_t> ram(0x8000);
+  std::memcpy(&ram[0], program.data(), program.size() * 4);
+  std::memcpy(&ram[0x80], handler.data(), handler.size() * 4);
+  auto Record = [&](uint32_t n, uint32_t field) {
+    uint32_t value;
+    std::memcpy(&value, &ram[0x1000 + n * 16 + field * 4], 4);
+    return value;
+  };
+
+  TestCOP0 cop0;
+  cop0.SetReg(COP0::SR, 0b000101); // IEc and IEp, user mode
+  CPU<PageTableMemory> cpu(mode, &cop0);
+  State &state = cpu.GetState();
+  state.pageTable.MapMemory(0, ram.size(), ram.data()); // Mirrored to KSEG0
+  cpu.SetHotThreshold(1);
+  cpu.SetGuestExceptions(true);
+
+  for (int i = 0; i < 10; i++) {
+    REQUIRE(cpu.Run(50).reason == StopReason::None);
+  }
+  REQUIRE(state.GetGPR(16) == 5 * 16);
+  REQUIRE(Record(0, 0) == 0x04);
+  REQUIRE(Record(0, 1) == 8 << 2);
+  REQUIRE(Record(1, 0) == 0x0c);
+  REQUIRE(Record(1, 1) == 12 << 2);
+  REQUIRE(Record(2, 0) == 0x10);
+  REQUIRE(Record(2, 1) == 4 << 2);
+  REQUIRE(Record(2, 2) == 2);
+  REQUIRE(Record(3, 0) == 0x14);
+  REQUIRE(Record(3, 1) == (0x8000'0000 | 9 << 2));
+  REQUIRE(Record(4, 0) == 0x20);
+  REQUIRE(Record(4, 1) == 5 << 2);
+  REQUIRE(Record(4, 2) == 1);
+
+  // Faulting instructions have no effect, and RFE restored SR each time
+  REQUIRE(state.GetGPR(4) == 0);
+  REQUIRE(state.GetGPR(5) == 0);
+  REQUIRE(state.GetGPR(2) == 2);
+  REQUIRE(ram[1] == 0);
+  REQUIRE(cop0.GetReg(COP0::SR) == 0b010101);
+
+  // A raised and unmasked interrupt is taken before running
+  REQUIRE((state.pc == 0x28 || state.pc == 0x2c));
+  cpu.SetPC(0x28);
+  cop0.SetReg(COP0::Cause, 1 << 10);
+  cop0.SetReg(COP0::SR, (1 << 10) | 1);
+  REQUIRE(cpu.Run(1).cycles == 1);
+  REQUIRE(state.pc == 0x8000'0084);
+  REQUIRE(cop0.GetReg(COP0::EPC) == 0x28);
+  REQUIRE(cop0.GetReg(COP0::Cause) == 1 << 10);
+  REQUIRE(cop0.GetReg(COP0::SR) == ((1 << 10) | 0b000100));
+}
+
+TEST_CASE("Guest Exceptions") {
+  for (auto mode : {CPUMode::Interpreter, CPUMode::CachedInterpreter,
+                    CPUMode::Recompiler}) {
+    RunProgram(mode);
+  }
+}
+
+// Unmasks a pending interrupt with MTC0, with RFE, and with MTC0 in a delay
+// slot. $2 starts out as 0x401, the handler records EPC in $4 and spins.
+static const std::vector<uint32_t> unmaskProgram = {
+    0x00000000, // 00: nop
+    0x40826000, // 04: mtc0 $2, SR (IM2, IEc)
+    0x24630001, // 08: addiu $3, $3, 1
+    0x08000002, // 0c: j 0x08
+    0x00000000, // 10: nop
+    0x00000000, 0x00000000, 0x00000000,
+    0x42000010, // 20: rfe
+    0x24630001, // 24: addiu $3, $3, 1
+    0x08000009, // 28: j 0x24
+    0x00000000, // 2c: nop
+    0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x08000014, // 40: j 0x50
+    0x40826000, // 44: mtc0 $2, SR (delay slot)
+    0x00000000, 0x00000000,
+    0x24630001, // 50: addiu $3, $3, 1
+    0x08000015, // 54: j 0x54
+    0x00000000, // 58: nop
+};
+
+static void RunUnmask(CPUMode mode) {
+  std::vector<uint8_t> ram(0x1000);
+  std::memcpy(&ram[0], unmaskProgram.data(), unmaskProgram.size() * 4);
+  const uint32_t handler[] = {
+      0x40047000, // 80: mfc0 $4, EPC
+      0x08000021, // 84: j 0x84
+      0x00000000, // 88: nop
+  };
+  std::memcpy(&ram[0x80], handler, sizeof(handler));
+
+  for (auto [pc, sr, epc] : {std::tuple{0x00u, 0x400u, 0x08u},
+                             std::tuple{0x20u, 0x404u, 0x24u},
+                             std::tuple{0x40u, 0x400u, 0x50u}}) {
+    TestCOP0 cop0;
+    cop0.SetReg(COP0::SR, sr); // IEp only for RFE to pop
+    cop0.SetReg(COP0::Cause, 1 << 10);
+    CPU<PageTableMemory> cpu(mode, &cop0);
+    State &state = cpu.GetState();
+    state.pageTable.MapMemory(0, ram.size(), ram.data());
+    cpu.SetHotThreshold(1);
+    cpu.SetGuestExceptions(true);
+    cpu.SetPC(pc);
+    state.SetGPR(2, 0x401);
+
+    REQUIRE(cpu.Run(100).cycles == 100);
+    REQUIRE(state.GetGPR(4) == epc);
+    REQUIRE(state.GetGPR(3) == 0);
+    REQUIRE(cop0.GetReg(COP0::Cause) == 1 << 10);
+  }
+}
+
+TEST_CASE("Interrupt Unmasking") {
+  for (auto mode : {CPUMode::Interpreter, CPUMode::CachedInterpreter,
+                    CPUMode::Recompiler}) {
+    RunUnmask(mode);
+  }
+}
+
+// Isolates the cache around a store, then tries to write Cause and EPC
+static const std::vector<uint32_t> systemControlProgram = {
+    0x3c020001, // 00: lui $2, 1 (SR.IsC)
+    0x40826000, // 04: mtc0 $2, SR
+    0xac030100, // 08: sw $3, 0x100($0)
+    0x40806000, // 0c: mtc0 $0, SR
+    0xac030104, // 10: sw $3, 0x104($0)
+    0x2404ffff, // 14: addiu $4, $0, -1
+    0x40846800, // 18: mtc0 $4, Cause
+    0x40847000, // 1c: mtc0 $4, EPC
+    0x08000008, // 20: j 0x20
+    0x00000000, // 24: nop
+};
+
+struct HookCalls {
+  std::vector<std::pair<size_t, uint32_t>> writes;
+};
+
+static void RunSystemControl(CPUMode mode) {
+  std::vector<uint8_t> ram(0x8000);
+  std::memcpy(&ram[0], systemControlProgram.data(),
+              systemControlProgram.size() * 4);
+  auto Word = [&](uint32_t addr) {
+    uint32_t value;
+    std::memcpy(&value, &ram[addr], 4);
+    return value;
+  };
+
+  CPU<PageTableMemory> cpu(mode);
+  State &state = cpu.GetState();
+  SystemControl &systemControl = cpu.GetSystemControl();
+  state.pageTable.MapMemory(0, ram.size(), ram.data());
+  state.SetGPR(3, 0x1234'5678);
+  cpu.SetHotThreshold(1);
+
+  HookCalls calls;
+  systemControl.SetWriteHook(
+      [](void *user, size_t reg, uint32_t value) {
+        static_cast<HookCalls *>(user)->writes.push_back({reg, value});
+      },
+      &calls);
+
+  REQUIRE(systemControl.GetReg(COP0::SR) == SystemControl::BEV);
+  REQUIRE(cpu.Run(50).reason == StopReason::None);
+  REQUIRE(Word(0x100) == 0);
+  REQUIRE(Word(0x104) == 0x1234'5678);
+  REQUIRE(systemControl.GetReg(COP0::Cause) == 0x300);
+  REQUIRE(systemControl.GetReg(COP0::EPC) == 0);
+  REQUIRE(calls.writes.size() == 3);
+  REQUIRE(calls.writes[0] == std::pair<size_t, uint32_t>{COP0::SR, 0x10000});
+  REQUIRE(calls.writes[2] == std::pair<size_t, uint32_t>{COP0::Cause, 0x300});
+
+  // An interrupt line raised by the embedder, with BEV still set
+  cpu.SetGuestExceptions(true);
+  systemControl.SetReg(COP0::SR, SystemControl::BEV | (1 << 10) | 1);
+  systemControl.SetInterruptLines(1);
+  const uint32_t epc = state.pc;
+  REQUIRE(cpu.Run(0).cycles == 0);
+  REQUIRE(state.pc == 0xbfc0'0180);
+  REQUIRE(systemControl.GetReg(COP0::EPC) == epc);
+  REQUIRE(systemControl.GetReg(COP0::Cause) == 0x700);
+}
+
+// Same isolation with the embedder's COP0, through the guest and directly
+static void RunIsolatedWithCOP0(CPUMode mode) {
+  std::vector<uint8_t> ram(0x8000);
+  std::memcpy(&ram[0], systemControlProgram.data(),
+              systemControlProgram.size() * 4);
+  auto Word = [&](uint32_t addr) {
+    uint32_t value;
+    std::memcpy(&value, &ram[addr], 4);
+    return value;
+  };
+
+  TestCOP0 cop0;
+  CPU<PageTableMemory> cpu(mode, &cop0);
+  State &state = cpu.GetState();
+  state.pageTable.MapMemory(0, ram.size(), ram.data());
+  state.SetGPR(3, 0x1234'5678);
+  cpu.SetHotThreshold(1);
+
+  REQUIRE(cpu.Run(8).reason == StopReason::None);
+  REQUIRE(Word(0x100) == 0);
+  REQUIRE(Word(0x104) == 0x1234'5678);
+
+  cop0.SetReg(COP0::SR, SystemControl::IsC);
+  state.SetGPR(3, 0x9abc'def0);
+  cpu.SetPC(0x8);
+  REQUIRE(cpu.Run(1).cycles == 1);
+  REQUIRE(Word(0x100) == 0);
+}
+
+TEST_CASE("System Control") {
+  for (auto mode : {CPUMode::Interpreter, CPUMode::CachedInterpreter,
+                    CPUMode::Recompiler}) {
+    RunSystemControl(mode);
+    RunIsolatedWithCOP0(mode);
+  }
+}
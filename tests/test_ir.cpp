@@ -0,0 +1,201 @@
+#include <doctest.h>
+#include <ir.h>
+#include <irpasses.h>
+#include <vector>
+
+using namespace Meeps;
+
+static IR::Block Build(const std::vector<uint32_t> &code) {
+  std::vector<Instruction> instrs(code.begin(), code.end());
+  return IR::Translate(instrs, 0x8000'0000, instrs.size());
+}
+
+static size_t Count(const IR::Block &block, IR::Op op) {
+  size_t count = 0;
+  for (const IR::Inst &inst : block.insts) {
+    count += inst.op == op;
+  }
+  return count;
+}
+
+TEST_CASE("IR Passes") {
+  SUBCASE("Address Formation") {
+    IR::Block block = Build({
+        0x3c011f80, // lui $1, 0x1f80
+        0x34211000, // ori $1, $1, 0x1000
+        0x8c220004, // lw $2, 4($1)
+    });
+    IR::Optimize(block);
+
+    // The LUI is dead, the ORI becomes the full constant and the load uses an
+    // absolute address
+    REQUIRE(block.insts.size() == 3);
+    REQUIRE(block.insts[0].op == IR::Op::Const);
+    REQUIRE(block.insts[0].imm == 0x1f80'1000);
+    REQUIRE(block.insts[1].op == IR::Op::Load32);
+    REQUIRE(block.insts[1].src1 == 0);
+    REQUIRE(block.insts[1].imm == 0x1f80'1004);
+    REQUIRE(block.insts[2].op == IR::Op::Exit);
+  }
+
+  SUBCASE("Zero And Dead Writes") {
+    IR::Block block = Build({
+        0x00000000, // nop
+        0x24030001, // addiu $3, $0, 1
+        0x00641821, // addu $3, $3, $4
+        0x00031820, // add $3, $0, $3
+        0x24030002, // addiu $3, $0, 2
+        0x8c000000, // lw $0, 0($0)
+    });
+    IR::Optimize(block);
+
+    // Only the final write to $3 and the load's access survive
+    REQUIRE(block.insts.size() == 3);
+    REQUIRE(block.insts[0].op == IR::Op::Const);
+    REQUIRE(block.insts[0].imm == 2);
+    REQUIRE(block.insts[1].op == IR::Op::Load32);
+    REQUIRE(block.insts[1].dst == 0);
+  }
+
+  SUBCASE("Fallbacks Keep Their Inputs") {
+    IR::Block block = Build({
+        0x24040005, // addiu $4, $0, 5
+        0x0000000c, // syscall
+        0x24040006, // addiu $4, $0, 6
+    });
+    IR::Optimize(block);
+
+    REQUIRE(Count(block, IR::Op::Const) == 2);
+    REQUIRE(Count(block, IR::Op::Interpret) == 1);
+  }
+
+  SUBCASE("Redundant Loads") {
+    const std::vector<uint32_t> code = {
+        0x8fa20010, // lw $2, 16($sp)
+        0x8fa30010, // lw $3, 16($sp)
+        0xafa00014, // sw $0, 20($sp)
+        0x8fa40010, // lw $4, 16($sp)
+    };
+
+    IR::Block block = Build(code);
+    IR::Optimize(block);
+    REQUIRE(Count(block, IR::Op::Load32) == 3);
+
+    IR::Options options;
+    options.redundantLoadElimination = true;
+    block = Build(code);
+    IR::Optimize(block, options);
+
+    // The store may alias, so only the second load goes away
+    REQUIRE(Count(block, IR::Op::Load32) == 2);
+    REQUIRE(block.insts[1].op == IR::Op::Mov);
+    REQUIRE(block.insts[1].src1 == 2);
+  }
+
+  SUBCASE("Delay Slots") {
+    IR::Block block = Build({
+        0x10220003, // beq $1, $2, 3
+        0x00000000, // nop (delay slot)
+    });
+    IR::Options options;
+    options.fuseInstructions = false;
+    IR::Optimize(block, options);
+
+    // The delay slot NOP is gone but the pc/nextPC shuffle has to stay
+    REQUIRE(block.size == 2);
+    REQUIRE(block.insts.size() == 2);
+    REQUIRE(block.insts[0].op == IR::Op::Beq);
+    REQUIRE(block.insts[0].imm == 0x8000'0010);
+    REQUIRE(block.insts[1].op == IR::Op::DelaySlot);
+  }
+
+  SUBCASE("Superinstructions") {
+    IR::Block block = Build({
+        0x0043082a, // slt $1, $2, $3
+        0x14200003, // bne $1, $0, 3
+        0x00000000, // nop (delay slot)
+    });
+    IR::Optimize(block);
+
+    // One op covers all three instructions, the compare result still lands
+    // in $1
+    REQUIRE(block.size == 3);
+    REQUIRE(block.insts.size() == 1);
+    REQUIRE(block.insts[0].op == IR::Op::Blt);
+    REQUIRE(block.insts[0].dst == 1);
+    REQUIRE(block.insts[0].src1 == 2);
+    REQUIRE(block.insts[0].src2 == 3);
+    REQUIRE(block.insts[0].imm == 0x8000'0014);
+    REQUIRE(block.insts[0].fusedSlot);
+
+    block = Build({
+        0x2841000a, // slti $1, $2, 10
+        0x10010003, // beq $0, $1, 3
+        0x24630001, // addiu $3, $3, 1 (delay slot)
+    });
+    IR::Optimize(block);
+
+    REQUIRE(block.insts.size() == 2);
+    REQUIRE(block.insts[0].op == IR::Op::BgeI);
+    REQUIRE(block.insts[0].imm2 == 10);
+    REQUIRE(block.insts[0].fusedSlot);
+    REQUIRE(block.insts[1].op == IR::Op::AddI);
+  }
+
+  SUBCASE("Idle Loops") {
+    IR::Block poll = Build({
+        0x8c020100, // lw $2, 0x100($0)
+        0x1040fffe, // beq $2, $0, -2
+        0x00000000, // nop (delay slot)
+    });
+    IR::Block count = Build({
+        0x24840001, // addiu $4, $4, 1
+        0x1000fffe, // beq $0, $0, -2
+        0x00000000, // nop (delay slot)
+    });
+    IR::Block store = Build({
+        0xac000100, // sw $0, 0x100($0)
+        0x1000fffe, // beq $0, $0, -2
+        0x00000000, // nop (delay slot)
+    });
+    IR::Optimize(poll);
+    IR::Optimize(count);
+    IR::Optimize(store);
+
+    REQUIRE(IR::IsIdleLoop(poll));
+    REQUIRE(!IR::IsIdleLoop(count));
+    REQUIRE(!IR::IsIdleLoop(store));
+  }
+
+  SUBCASE("Trace Guards") {
+    const std::vector<uint32_t> loop = {
+        0x24420001, // addiu $2, $2, 1
+        0x10400002, // beq $2, $0, 2
+        0x24630001, // addiu $3, $3, 1 (delay slot)
+    };
+    const std::vector<uint32_t> call = {
+        0x0c000000, // jal 0
+        0x00000000, // nop (delay slot)
+    };
+
+    const Trace trace = {
+        {0x8000'0000, {loop.begin(), loop.end()}},
+        {0x8000'000c, {call.begin(), call.end()}},
+        {0x8000'0000, {loop.begin(), loop.end()}},
+    };
+    IR::Block block = IR::TranslateTrace(trace);
+    IR::Optimize(block);
+
+    // Only the branch needs checking, the JAL always goes the same way, and
+    // the last part exits normally
+    REQUIRE(block.size == 8);
+    REQUIRE(Count(block, IR::Op::Guard) == 1);
+    for (const IR::Inst &inst : block.insts) {
+      if (inst.op == IR::Op::Guard) {
+        REQUIRE(inst.imm == 0x8000'000c);
+        REQUIRE(inst.imm2 == 3);
+      }
+    }
+    REQUIRE(block.insts.back().op != IR::Op::Guard);
+  }
+}
@@ -0,0 +1,93 @@
+#include "test_cop0.h"
+#include <cstring>
+#include <doctest.h>
+#include <r3000.h>
+#include <string>
+#include <vector>
+
+using namespace Meeps;
+
+// main copies "hello" with memcpy and then prints it, each call going through
+// a stub that jumps to the A0 vector like the BIOS's own library does
+static const std::vector<uint32_t> program = {
+    0x241d5000, // 00: addiu $sp, $0, 0x5000
+    0x24042000, // 04: addiu $a0, $0, 0x2000
+    0x24053000, // 08: addiu $a1, $0, 0x3000
+    0x24060005, // 0c: addiu $a2, $0, 5
+    0x0c000400, // 10: jal memcpy
+    0x00000000, // 14: nop
+    0x24044000, // 18: addiu $a0, $0, 0x4000
+    0x2407002a, // 1c: addiu $a3, $0, 0x2a
+    0x0c000440, // 20: jal printf
+    0x2406fff9, // 24: addiu $a2, $0, -7 (delay slot)
+    0x0800000a, // 28: j 0x28
+    0x00000000, // 2c: nop
+};
+
+static const std::vector<uint32_t> memcpyStub = {
+    0x240a00a0, // 1000: addiu $t2, $0, 0xa0
+    0x01400008, // 1004: jr $t2
+    0x2409002a, // 1008: addiu $t1, $0, 0x2a (delay slot)
+};
+
+static const std::vector<uint32_t> printfStub = {
+    0x240a00a0, // 1100: addiu $t2, $0, 0xa0
+    0x01400008, // 1104: jr $t2
+    0x2409003f, // 1108: addiu $t1, $0, 0x3f (delay slot)
+};
+
+struct KernelRun {
+  std::string output;
+  uint32_t v0;
+  uint32_t pc;
+};
+
+static KernelRun RunProgram(CPUMode mode, std::vector<uint8_t> &ram,
+                            bool emulatePrintf) {
+  TestCOP0 cop0;
+  CPU<PageTableMemory> cpu(mode, &cop0);
+  cpu.GetState().pageTable.MapMemory(0, ram.size(), ram.data());
+  cpu.SetHotThreshold(1);
+
+  KernelRun run;
+  cpu.SetKernelOutput([&](std::string_view text) { run.output += text; });
+  cpu.SetKernelHLE(KernelFunction::Memcpy, true);
+  cpu.SetKernelHLE(KernelFunction::Printf, emulatePrintf);
+
+  // Odd slices stop in the stubs' delay slots as well
+  for (int i = 0; i < 20; i++) {
+    cpu.Run(3);
+  }
+  run.v0 = cpu.GetState().GetGPR(2);
+  run.pc = cpu.GetState().pc;
+  return run;
+}
+
+TEST_CASE("Kernel HLE") {
+  std::vector<uint8_t> ram(0x8000);
+  auto Copy = [&](uint32_t addr, const void *data, size_t size) {
+    std::memcpy(&ram[addr], data, size);
+  };
+  Copy(0, program.data(), program.size() * 4);
+  Copy(0x1000, memcpyStub.data(), memcpyStub.size() * 4);
+  Copy(0x1100, printfStub.data(), printfStub.size() * 4);
+  Copy(0x3000, "hello", 6);
+  Copy(0x4000, "%s=%d %04x%c%%", 15);
+  ram[0x5010] = '!'; // The fourth argument is on the stack
+
+  for (auto mode : {CPUMode::Interpreter, CPUMode::CachedInterpreter,
+                    CPUMode::Recompiler}) {
+    std::memset(&ram[0x2000], 0, 8);
+    KernelRun run = RunProgram(mode, ram, true);
+    REQUIRE(std::memcmp(&ram[0x2000], "hello", 5) == 0);
+    REQUIRE(run.output == "hello=-7 002a!%");
+    REQUIRE(run.v0 == run.output.size());
+    REQUIRE((run.pc == 0x28 || run.pc == 0x2c));
+
+    // printf is left to the guest, whose kernel is all NOPs here
+    run = RunProgram(mode, ram, false);
+    REQUIRE(run.output.empty());
+    REQUIRE(run.pc > 0xa0);
+    REQUIRE(run.pc < 0x1000);
+  }
+}
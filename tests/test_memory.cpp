@@ -3,10 +3,19 @@
 #include "test_memory.h"
 #include "test_cop0.h"
 #include <array>
+#include <cstring>
 #include <doctest.h>
+#include <fastmem.h>
 #include <fmt/core.h>
 #include <r3000.h>
 #include <r3000interpreter.h>
+#include <vector>
+
+#ifdef MEEPS_FASTMEM
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 
 
 using namespace Meeps;
@@ -32,4 +41,410 @@ TEST_CASE("Memory Interface") {
   REQUIRE(state.read16(0x200) == 0xBEEF);
   state.write32(0x300, 0x11223344);
   REQUIRE(state.read32(0x300) == 0x11223344);
-}
\ No newline at end of file
+}
+
+TEST_CASE("Memory Policy") {
+  for (auto mode : {CPUMode::Interpreter, CPUMode::CachedInterpreter,
+                    CPUMode::Recompiler}) {
+    CPU<TestMemory::Direct> cpu{mode, &cop0};
+    cpu.SetMemoryPointer(&memory);
+    memory.Reset();
+
+    cpu.GetState().SetGPR(1, 0x11223344);
+    memory.WriteInstrSequential(0xac010100); // sw $1, 0x100($0)
+    memory.WriteInstrSequential(0x84020102); // lh $2, 0x102($0)
+    memory.WriteInstrSequential(0x90030100); // lbu $3, 0x100($0)
+    cpu.Run(memory.instrCounter / 4);
+
+    REQUIRE(memory.read<uint32_t>(&memory, 0x100) == 0x11223344);
+    REQUIRE(cpu.GetState().GetGPR(2) == 0x1122);
+    REQUIRE(cpu.GetState().GetGPR(3) == 0x44);
+  }
+}
+
+TEST_CASE("Page Table") {
+  struct IOLog {
+    uint32_t addr = 0;
+    uint32_t value = 0;
+  };
+
+  static std::array<uint8_t, 64 * 1024> ram{};
+  static std::array<uint8_t, 4 * 1024> rom{};
+  IOLog io{};
+  IOHandlers handlers{
+      &io,
+      [](void *, size_t) -> uint8_t { return 0; },
+      [](void *, size_t addr) -> uint16_t { return addr & 0xffff; },
+      [](void *, size_t) -> uint32_t { return 0; },
+      [](void *, size_t, uint8_t) {},
+      [](void *, size_t, uint16_t) {},
+      [](void *c, size_t addr, uint32_t value) {
+        *(IOLog *)c = {(uint32_t)addr, value};
+      },
+  };
+
+  CPU<PageTableMemory> cpu{CPUMode::Interpreter, &cop0};
+  auto &pages = cpu.GetState().pageTable;
+  pages.MapMemory(0x0000'0000, ram.size(), ram.data());
+  pages.MapMemory(0xbfc0'0000, rom.size(), rom.data(), false);
+  pages.MapIO(0x1f80'1000, PageTable::PageSize, handlers);
+
+  SUBCASE("Segment Mirrors And IO") {
+    uint32_t program[] = {
+        0x3c01a000, // lui $1, 0xa000
+        0xac220100, // sw $2, 0x100($1)
+        0x3c048000, // lui $4, 0x8000
+        0x8c830100, // lw $3, 0x100($4)
+        0x3c051f80, // lui $5, 0x1f80
+        0xaca21000, // sw $2, 0x1000($5)
+        0x84a61004, // lh $6, 0x1004($5)
+    };
+    std::memcpy(ram.data(), program, sizeof(program));
+
+    cpu.SetPC(0x8000'0000); // Executes out of KSEG0
+    cpu.GetState().SetGPR(2, 0xdeadbeef);
+    cpu.Run(7);
+
+    REQUIRE(PageTableMemory::Read32(cpu.GetState(), 0x100) == 0xdeadbeef);
+    REQUIRE(cpu.GetState().GetGPR(3) == 0xdeadbeef);
+    REQUIRE(io.addr == 0x1f80'1000);
+    REQUIRE(io.value == 0xdeadbeef);
+    REQUIRE(cpu.GetState().GetGPR(6) == 0x1004);
+  }
+
+  SUBCASE("Read Only Memory") {
+    rom[0] = 0x42;
+    PageTableMemory::Write8(cpu.GetState(), 0x1fc0'0000, 0x24);
+    REQUIRE(PageTableMemory::Read8(cpu.GetState(), 0x9fc0'0000) == 0x42);
+  }
+}
+
+TEST_CASE("Region Mapping") {
+  struct Devices {
+    uint32_t irq = 0;
+    std::vector<uint32_t> dma;
+  };
+
+  static std::array<uint8_t, 8 * 1024> ram{};
+  static std::array<uint8_t, 4 * 1024> rom{};
+  Devices devices;
+  IOHandlers irq{
+      &devices,
+      [](void *, size_t) -> uint8_t { return 0; },
+      [](void *, size_t) -> uint16_t { return 0; },
+      [](void *c, size_t) { return ((Devices *)c)->irq; },
+      [](void *, size_t, uint8_t) {},
+      [](void *, size_t, uint16_t) {},
+      [](void *c, size_t, uint32_t value) { ((Devices *)c)->irq = value; },
+  };
+  IOHandlers dma = irq;
+  dma.write32 = [](void *c, size_t addr, uint32_t) {
+    ((Devices *)c)->dma.push_back((uint32_t)addr);
+  };
+
+  // RAM repeats every 8 KiB across 32 KiB, and two devices share a page
+  CPU<PageTableMemory> cpu{CPUMode::Interpreter};
+  cpu.MapRegion(0x0000'0000, 32 * 1024, ram.data(), 0, ram.size());
+  cpu.MapRegion(0xbfc0'0000, rom.size(), rom.data(), RegionFlags::ReadOnly);
+  cpu.MapIO(0x1f80'1070, 8, irq);
+  cpu.MapIO(0x1f80'1080, 0x80, dma);
+  cpu.SetWritePointer<uint8_t>([](void *, size_t, uint8_t) {
+    FAIL("Mapped accesses must not reach the callbacks");
+  });
+
+  uint32_t program[] = {
+      0x3c01a000, // lui $1, 0xa000
+      0xac222100, // sw $2, 0x2100($1)
+      0x8c030100, // lw $3, 0x100($0)
+      0x3c041f80, // lui $4, 0x1f80
+      0xac821070, // sw $2, 0x1070($4)
+      0xac8210f0, // sw $2, 0x10f0($4)
+      0x8c851070, // lw $5, 0x1070($4)
+      0x3c06bfc0, // lui $6, 0xbfc0
+      0xa0c20000, // sb $2, 0($6)
+  };
+  std::memcpy(ram.data(), program, sizeof(program));
+  cpu.SetPC(0x8000'6000); // Runs out of the last mirror in KSEG0
+  cpu.GetState().SetGPR(2, 0xdeadbeef);
+  cpu.Run(9);
+
+  REQUIRE(cpu.GetState().GetGPR(3) == 0xdeadbeef);
+  REQUIRE(devices.irq == 0xdeadbeef);
+  REQUIRE(cpu.GetState().GetGPR(5) == 0xdeadbeef);
+  REQUIRE(devices.dma == std::vector<uint32_t>{0x1f80'10f0});
+  REQUIRE(rom[0] == 0);
+
+  // Remapping replaces what was there, including IO
+  cpu.MapRegion(0x1f80'1000, 4 * 1024, ram.data(), RegionFlags::NoMirrors);
+  REQUIRE(PageTableMemory::Read32(cpu.GetState(), 0x1f80'1100) == 0xdeadbeef);
+  REQUIRE(PageTableMemory::Read32(cpu.GetState(), 0x9f80'1100) == 0);
+  REQUIRE(cpu.GetState().pageTable.FindIO(0x1f80'1070) == nullptr);
+  REQUIRE_THROWS_AS(cpu.MapRegion(0x100, 4 * 1024, ram.data()),
+                    std::invalid_argument);
+}
+
+TEST_CASE("Instruction Fetch") {
+  // Two banks of code, and an IO region that executes addiu $1, $1, 1
+  static std::array<uint8_t, 4 * 1024> bank0{};
+  static std::array<uint8_t, 4 * 1024> bank1{};
+  const uint32_t increment = 0x24210001; // addiu $1, $1, 1
+  const uint32_t decrement = 0x2421ffff; // addiu $1, $1, -1
+  for (size_t i = 0; i < bank0.size(); i += 4) {
+    std::memcpy(&bank0[i], &increment, 4);
+    std::memcpy(&bank1[i], &decrement, 4);
+  }
+  IOHandlers io{
+      nullptr,
+      [](void *, size_t) -> uint8_t { return 0; },
+      [](void *, size_t) -> uint16_t { return 0; },
+      [](void *, size_t) -> uint32_t { return 0x24210001; },
+      [](void *, size_t, uint8_t) {},
+      [](void *, size_t, uint16_t) {},
+      [](void *, size_t, uint32_t) {},
+  };
+
+  for (auto mode : {CPUMode::Interpreter, CPUMode::CachedInterpreter}) {
+    CPU<PageTableMemory> cpu{mode};
+    State &state = cpu.GetState();
+    cpu.MapRegion(0x0000'0000, bank0.size(), bank0.data());
+    cpu.MapRegion(0x0000'1000, bank0.size(), bank0.data());
+    cpu.MapIO(0x1f00'0000, 4 * 1024, io);
+
+    // Runs across the page boundary
+    cpu.SetPC(0x0000'0ff0);
+    cpu.Run(8);
+    REQUIRE(state.GetGPR(1) == 8);
+
+    // Remapping the page the pc is in is picked up
+    cpu.MapRegion(0x0000'1000, bank1.size(), bank1.data());
+    cpu.Run(4);
+    REQUIRE(state.GetGPR(1) == 4);
+
+    cpu.SetPC(0x1f00'0000);
+    cpu.Run(4);
+    REQUIRE(state.GetGPR(1) == 8);
+  }
+}
+
+TEST_CASE("Bulk Transfers") {
+  struct IOLog {
+    std::vector<uint32_t> words;
+  };
+
+  static std::array<uint8_t, 8 * 1024> ram{};
+  static std::array<uint8_t, 4 * 1024> rom{};
+  IOLog io;
+  IOHandlers handlers{
+      &io,
+      [](void *, size_t) -> uint8_t { return 0x11; },
+      [](void *, size_t) -> uint16_t { return 0; },
+      [](void *, size_t addr) -> uint32_t { return (uint32_t)addr; },
+      [](void *, size_t, uint8_t) {},
+      [](void *, size_t, uint16_t) {},
+      [](void *c, size_t, uint32_t value) {
+        ((IOLog *)c)->words.push_back(value);
+      },
+  };
+
+  CPU<PageTableMemory> cpu{CPUMode::CachedInterpreter};
+  cpu.MapRegion(0x0000'0000, ram.size(), ram.data());
+  cpu.MapRegion(0x1fc0'0000, rom.size(), rom.data(), RegionFlags::ReadOnly);
+  cpu.MapIO(0x1f80'1000, PageTable::PageSize, handlers);
+
+  // Across a page boundary and through a mirror
+  std::vector<uint8_t> data(0x100);
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i] = (uint8_t)i;
+  }
+  cpu.WriteBlock(0x8000'0f80, data.data(), (uint32_t)data.size());
+  REQUIRE(std::memcmp(&ram[0xf80], data.data(), data.size()) == 0);
+  std::vector<uint8_t> back(data.size());
+  cpu.ReadBlock(0xa000'0f80, back.data(), (uint32_t)back.size());
+  REQUIRE(back == data);
+
+  cpu.FillBlock(0x0000'0f90, 0xaa, 0x20);
+  REQUIRE(ram[0xf8f] == 0x0f);
+  REQUIRE(ram[0xf90] == 0xaa);
+  REQUIRE(ram[0xfaf] == 0xaa);
+  REQUIRE(ram[0xfb0] == 0x30);
+
+  // ROM is left alone and IO gets words where aligned
+  cpu.FillBlock(0x1fc0'0000, 0xff, 0x10);
+  REQUIRE(rom[0] == 0);
+  cpu.WriteBlock(0x1f80'1000, data.data(), 8);
+  REQUIRE(io.words == std::vector<uint32_t>{0x03020100, 0x07060504});
+  std::array<uint8_t, 6> regs{};
+  cpu.ReadBlock(0x1f80'1004, regs.data(), (uint32_t)regs.size());
+  REQUIRE(regs == std::array<uint8_t, 6>{0x04, 0x10, 0x80, 0x1f, 0x11, 0x11});
+
+  // Overwriting translated code drops it
+  const uint32_t increment = 0x24210001; // addiu $1, $1, 1
+  const uint32_t decrement = 0x2421ffff; // addiu $1, $1, -1
+  const uint32_t loop[] = {increment, 0x1000fffe, 0}; // b -2, nop
+  cpu.WriteBlock(0x0000'0000, loop, sizeof(loop));
+  cpu.SetHotThreshold(1);
+  cpu.Run(30);
+  REQUIRE(cpu.GetState().GetGPR(1) == 10);
+  cpu.WriteBlock(0x8000'0000, &decrement, 4);
+  cpu.Run(30);
+  REQUIRE(cpu.GetState().GetGPR(1) == 0);
+}
+
+// Stores through KUSEG and loads back through KSEG0, then touches RAM
+static const uint32_t scratchpadProgram[] = {
+    0x3c081f80, // lui $8, 0x1f80
+    0x3c099f80, // lui $9, 0x9f80
+    0x2402ff85, // addiu $2, $0, -123
+    0xad020010, // sw $2, 0x10($8)
+    0xa1020001, // sb $2, 1($8)
+    0xa50203fe, // sh $2, 0x3fe($8)
+    0x8d230010, // lw $3, 0x10($9)
+    0x81240001, // lb $4, 1($9)
+    0x952503fe, // lhu $5, 0x3fe($9)
+    0xad020400, // sw $2, 0x400($8)
+    0x8c061000, // lw $6, 0x1000($0)
+};
+
+TEST_CASE("Scratchpad") {
+  for (auto mode : {CPUMode::Interpreter, CPUMode::CachedInterpreter,
+                    CPUMode::Recompiler}) {
+    for (bool enabled : {true, false}) {
+      static std::array<uint8_t, 8 * 1024> ram{};
+      static std::array<uint8_t, 4 * 1024> io{};
+      ram.fill(0);
+      io.fill(0);
+      std::memcpy(ram.data(), scratchpadProgram, sizeof(scratchpadProgram));
+      ram[0x1000] = 0x42;
+
+      CPU<PageTableMemory> cpu{mode};
+      State &state = cpu.GetState();
+      cpu.MapRegion(0x0000'0000, ram.size(), ram.data());
+      cpu.MapRegion(0x1f80'0000, io.size(), io.data());
+      cpu.SetScratchpad(enabled);
+      cpu.SetHotThreshold(1);
+      for (int i = 0; i < 2; i++) {
+        cpu.SetPC(0x8000'0000);
+        cpu.Run(11);
+      }
+
+      REQUIRE(state.GetGPR(3) == 0xffff'ff85);
+      REQUIRE(state.GetGPR(4) == 0xffff'ff85);
+      REQUIRE(state.GetGPR(5) == 0xff85);
+      REQUIRE(state.GetGPR(6) == 0x42);
+
+      // Only the first KiB is scratchpad, past it is memory again
+      REQUIRE(io[0x400] == 0x85);
+      REQUIRE(io[0x10] == (enabled ? 0 : 0x85));
+      REQUIRE(state.scratchpad[0x10] == (enabled ? 0x85 : 0));
+      REQUIRE(state.scratchpad[0x3ff] == (enabled ? 0xff : 0));
+    }
+  }
+}
+
+#ifdef MEEPS_FASTMEM
+TEST_CASE("Fastmem") {
+  struct IOLog {
+    uint32_t addr = 0;
+    uint32_t value = 0;
+  };
+
+  IOLog io{};
+  IOHandlers handlers{
+      &io,
+      [](void *, size_t) -> uint8_t { return 0; },
+      [](void *, size_t addr) -> uint16_t { return addr & 0xffff; },
+      [](void *, size_t) -> uint32_t { return 0; },
+      [](void *, size_t, uint8_t) {},
+      [](void *, size_t, uint16_t) {},
+      [](void *c, size_t addr, uint32_t value) {
+        *(IOLog *)c = {(uint32_t)addr, value};
+      },
+  };
+
+  for (auto mode : {CPUMode::Interpreter, CPUMode::Recompiler}) {
+    FastmemArena arena;
+    CPU<FastmemMemory> cpu{mode, &cop0};
+    arena.Attach(cpu.GetState());
+    cpu.GetState().pageTable.MapIO(0x1f80'1000, PageTable::PageSize, handlers);
+
+    uint8_t *ram = arena.MapMemory(0x0000'0000, 64 * 1024);
+    uint8_t *rom = arena.MapMemory(0xbfc0'0000, 4 * 1024, false);
+
+    uint32_t program[] = {
+        0x3c01a000, // lui $1, 0xa000
+        0xac220100, // sw $2, 0x100($1)
+        0x3c048000, // lui $4, 0x8000
+        0x8c830100, // lw $3, 0x100($4)
+        0x3c051f80, // lui $5, 0x1f80
+        0xaca21000, // sw $2, 0x1000($5)
+        0x84a61004, // lh $6, 0x1004($5)
+    };
+    std::memcpy(ram, program, sizeof(program));
+
+    cpu.SetPC(0x8000'0000);
+    cpu.GetState().SetGPR(2, 0xdeadbeef);
+    cpu.Run(7);
+
+    REQUIRE(FastmemMemory::Read32(cpu.GetState(), 0x100) == 0xdeadbeef);
+    REQUIRE(cpu.GetState().GetGPR(3) == 0xdeadbeef);
+    REQUIRE(io.addr == 0x1f80'1000);
+    REQUIRE(io.value == 0xdeadbeef);
+    REQUIRE(cpu.GetState().GetGPR(6) == 0x1004);
+
+    // Writes to read-only mappings fault and are dropped by the slow path
+    FastmemMemory::Write8(cpu.GetState(), 0x1fc0'0000, 0x24);
+    REQUIRE(rom[0] == 0);
+
+    // The scratchpad isn't in the arena, recompiled code checks for it
+    const uint32_t scratchpad[] = {
+        0xaca20008, // sw $2, 8($5)
+        0x84a70008, // lh $7, 8($5)
+    };
+    cpu.WriteBlock(0x200, scratchpad, sizeof(scratchpad));
+    cpu.SetScratchpad(true);
+    cpu.SetPC(0x8000'0200);
+    cpu.Run(2);
+    REQUIRE(cpu.GetState().scratchpad[8] == 0xef);
+    REQUIRE(cpu.GetState().GetGPR(7) == 0xffff'beef);
+
+    // Bulk transfers copy mapped pages directly, and only those
+    State &state = cpu.GetState();
+    uint8_t *page = FastmemMemory::HostPage(state, 0xa000'1234, true);
+    REQUIRE(page == arena.GetBase() + 0xa000'1000);
+    page[0x234] = 0x42;
+    REQUIRE(ram[0x1234] == 0x42);
+    REQUIRE(FastmemMemory::HostPage(state, 0xbfc0'0000, false) != nullptr);
+    REQUIRE(FastmemMemory::HostPage(state, 0xbfc0'0000, true) == nullptr);
+    REQUIRE(FastmemMemory::HostPage(state, 0x1f80'1000, false) == nullptr);
+    std::vector<uint8_t> block(2 * PageTable::PageSize, 0x5a);
+    cpu.WriteBlock(0x8000'0800, block.data(), block.size());
+    REQUIRE(std::memcmp(ram + 0x800, block.data(), block.size()) == 0);
+    cpu.ReadBlock(0x1fc0'0000, block.data(), 4);
+    REQUIRE(std::memcmp(rom, block.data(), 4) == 0);
+
+    arena.Unmap(0x0000'0000, 64 * 1024);
+    REQUIRE(FastmemMemory::HostPage(state, 0x8000'0000, false) == nullptr);
+  }
+
+  // A fastmem encoding faulting outside of any arena is a real crash, even
+  // with a null base, so it has to reach the previous handler
+  FastmemArena arena;
+  State state;
+  const pid_t child = fork();
+  REQUIRE(child >= 0);
+  if (child == 0) {
+    const int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    dup2(null, STDERR_FILENO);
+    uint32_t value;
+    __asm__ __volatile__("movl (%%rsi,%%rdi,1), %%eax"
+                         : "=a"(value)
+                         : "S"(nullptr), "D"(uint64_t(0x10)), "d"(&state)
+                         : "memory");
+    _exit(0);
+  }
+  int status = 0;
+  REQUIRE(waitpid(child, &status, 0) == child);
+  REQUIRE(!(WIFEXITED(status) && WEXITSTATUS(status) == 0));
+}
+#endif
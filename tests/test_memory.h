@@ -1,3 +1,4 @@
+#include "state.h"
 #include "types.h"
 #include <array>
 #include <stdint.h>
@@ -23,6 +24,21 @@ public:
     *(T *)&((TestMemory *)m)->mem[addr] = value;
   }
 
+  // Memory policy that skips the callbacks and reads the TestMemory set as
+  // the CPU's memory pointer directly
+  struct Direct {
+    template <typename T> static T Read(Meeps::State &state, uint32_t addr) {
+      return read<T>(state.mp, addr);
+    }
+    static uint8_t Read8(Meeps::State &s, uint32_t a) { return Read<uint8_t>(s, a); }
+    static uint16_t Read16(Meeps::State &s, uint32_t a) { return Read<uint16_t>(s, a); }
+    static uint32_t Read32(Meeps::State &s, uint32_t a) { return Read<uint32_t>(s, a); }
+
+    static void Write8(Meeps::State &s, uint32_t a, uint8_t v) { write(s.mp, a, v); }
+    static void Write16(Meeps::State &s, uint32_t a, uint16_t v) { write(s.mp, a, v); }
+    static void Write32(Meeps::State &s, uint32_t a, uint32_t v) { write(s.mp, a, v); }
+  };
+
   // For manually writing instructions to memory
   void WriteInstrSequential(uint32_t value) {
     *(uint32_t *)&mem[instrCounter] = value;
@@ -0,0 +1,136 @@
+#include <cstring>
+#include <doctest.h>
+#include <r3000.h>
+#include <vector>
+
+using namespace Meeps;
+
+TEST_CASE("Scheduler") {
+  Scheduler scheduler;
+  std::vector<int> fired;
+  const auto a = scheduler.AddEvent([&] { fired.push_back(0); });
+  const auto b = scheduler.AddEvent([&] { fired.push_back(1); });
+  const auto c = scheduler.AddEvent([&] { fired.push_back(2); });
+  REQUIRE(scheduler.NextDeadline() == Scheduler::Never);
+  REQUIRE_THROWS_AS(scheduler.Schedule(3, 10), std::invalid_argument);
+
+  // Earliest first, in scheduling order on a tie
+  scheduler.Schedule(c, 20);
+  scheduler.Schedule(b, 10);
+  scheduler.Schedule(a, 10);
+  REQUIRE(scheduler.NextDeadline() == 10);
+  scheduler.Advance(25);
+  scheduler.RunDueEvents();
+  REQUIRE(fired == std::vector<int>{1, 0, 2});
+  REQUIRE(scheduler.GetDeadline(a) == Scheduler::Never);
+
+  // Rescheduling replaces the deadline and cancelling drops it
+  fired.clear();
+  scheduler.Schedule(a, 10);
+  scheduler.Schedule(a, 30);
+  scheduler.Schedule(b, 5);
+  scheduler.Cancel(b);
+  REQUIRE(scheduler.NextDeadline() == 55);
+  scheduler.Advance(29);
+  scheduler.RunDueEvents();
+  REQUIRE(fired.empty());
+  scheduler.Advance(1);
+  scheduler.RunDueEvents();
+  REQUIRE(fired == std::vector<int>{0});
+  REQUIRE(scheduler.NextDeadline() == Scheduler::Never);
+
+  // Rescheduling with no delay from a callback waits for the next call
+  fired.clear();
+  scheduler.AddEvent([&] {
+    fired.push_back(3);
+    scheduler.Schedule(3, 0);
+  });
+  scheduler.Schedule(3, 0);
+  scheduler.RunDueEvents();
+  scheduler.RunDueEvents();
+  REQUIRE(fired == std::vector<int>{3, 3});
+  REQUIRE(scheduler.NextDeadline() == scheduler.Now());
+}
+
+// Polls a flag until it's set, then counts in $3 forever
+static const std::vector<uint32_t> program = {
+    0x8c020100, // 00: lw $2, 0x100($0)
+    0x1040fffe, // 04: beq $2, $0, -2
+    0x00000000, // 08: nop (delay slot)
+    0x24630001, // 0c: addiu $3, $3, 1
+    0x08000003, // 10: j 0x0c
+    0x00000000, // 14: nop (delay slot)
+};
+
+struct Result {
+  std::vector<uint64_t> timer;
+  uint32_t counter;
+  uint64_t skipped;
+};
+
+static Result RunProgram(CPUMode mode) {
+  std::vector<uint8_t> ram(0x1000);
+  std::memcpy(&ram[0], program.data(), program.size() * 4);
+
+  CPU<PageTableMemory> cpu(mode);
+  cpu.GetState().pageTable.MapMemory(0, ram.size(), ram.data());
+  cpu.SetHotThreshold(1);
+  IR::Options options;
+  options.idleLoopSkipping = true;
+  cpu.SetIROptions(options);
+
+  // A periodic timer, and a device setting the flag at cycle 5000
+  Result run;
+  Scheduler &scheduler = cpu.GetScheduler();
+  Scheduler::EventId timer = scheduler.AddEvent([&] {
+    run.timer.push_back(scheduler.Now());
+    scheduler.Schedule(timer, 3000);
+  });
+  const auto device = scheduler.AddEvent([&] { ram[0x100] = 1; });
+  scheduler.Schedule(timer, 3000);
+  scheduler.Schedule(device, 5000);
+
+  for (int i = 0; i < 10; i++) {
+    REQUIRE(cpu.Run(1001).cycles == 1001);
+  }
+  REQUIRE(scheduler.Now() == 10010);
+  run.counter = cpu.GetState().GetGPR(3);
+  run.skipped = cpu.GetTierStats().skippedInstructions;
+  return run;
+}
+
+TEST_CASE("Scheduled Events") {
+  const Result reference = RunProgram(CPUMode::Interpreter);
+  REQUIRE(reference.timer == std::vector<uint64_t>{3000, 6000, 9000});
+  REQUIRE(reference.counter > 0);
+
+  // Idle loop skipping stops at the event that ends the loop
+  for (auto mode : {CPUMode::CachedInterpreter, CPUMode::Recompiler}) {
+    const Result run = RunProgram(mode);
+    REQUIRE(run.timer == reference.timer);
+    REQUIRE(run.counter == reference.counter);
+    REQUIRE(run.skipped > 4000);
+  }
+}
+
+TEST_CASE("Zero Delay Events") {
+  std::vector<uint8_t> ram(0x1000);
+  std::memcpy(&ram[0], program.data(), program.size() * 4);
+
+  // An event rearming itself with no delay fires once per instruction
+  for (auto mode : {CPUMode::Interpreter, CPUMode::CachedInterpreter,
+                    CPUMode::Recompiler}) {
+    CPU<PageTableMemory> cpu(mode);
+    cpu.GetState().pageTable.MapMemory(0, ram.size(), ram.data());
+    Scheduler &scheduler = cpu.GetScheduler();
+    int fired = 0;
+    Scheduler::EventId event = scheduler.AddEvent([&] {
+      fired++;
+      scheduler.Schedule(event, 0);
+    });
+    scheduler.Schedule(event, 0);
+    REQUIRE(cpu.Run(100).cycles == 100);
+    REQUIRE(scheduler.Now() == 100);
+    REQUIRE(fired == 101);
+  }
+}
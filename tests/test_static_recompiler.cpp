@@ -0,0 +1,126 @@
+#include "test_cop0.h"
+#include <cstring>
+#include <doctest.h>
+#include <r3000.h>
+#include <staticprogram.h>
+#include <staticrecompiler.h>
+#include <string>
+#include <vector>
+
+using namespace Meeps;
+
+// main calls sum(n) for n = 50..1 and adds up the results, sum loops on its
+// own and returns through $ra
+static const std::vector<uint32_t> program = {
+    0x24100000, // 00: addiu $16, $0, 0
+    0x24110032, // 04: addiu $17, $0, 50
+    0x0c004010, // 08: jal sum
+    0x00112021, // 0c: addu $4, $0, $17 (delay slot)
+    0x02028021, // 10: addu $16, $16, $2
+    0x2631ffff, // 14: addiu $17, $17, -1
+    0x1620fffb, // 18: bne $17, $0, -5
+    0x00000000, // 1c: nop
+    0x08004008, // 20: j 0x20
+    0x00000000, // 24: nop
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00001021, // 40: sum: addu $2, $0, $0
+    0x10800004, // 44: beq $4, $0, 4
+    0x00000000, // 48: nop
+    0x00441021, // 4c: addu $2, $2, $4
+    0x08004011, // 50: j 0x44
+    0x2484ffff, // 54: addiu $4, $4, -1 (delay slot)
+    0x03e00008, // 58: jr $31
+    0x00000000, // 5c: nop
+};
+
+static GuestImage BuildImage() {
+  GuestImage image;
+  image.base = 0x8001'0000;
+  image.entry = 0x8001'0000;
+  image.data.resize(program.size() * 4);
+  std::memcpy(image.data.data(), program.data(), image.data.size());
+  return image;
+}
+
+TEST_CASE("Static Recompiler") {
+  SUBCASE("Function Discovery") {
+    StaticRecompiler recompiler(BuildImage());
+    recompiler.Analyze();
+
+    const auto &functions = recompiler.GetFunctions();
+    REQUIRE(functions.size() == 2);
+
+    // The call's return site is part of main, sum's loop is all its own
+    const auto &main = functions.at(0x8001'0000);
+    REQUIRE(main.blocks.contains(0x8001'0010));
+    REQUIRE(main.blocks.contains(0x8001'0020));
+    REQUIRE(!main.blocks.contains(0x8001'0040));
+    const auto &sum = functions.at(0x8001'0040);
+    REQUIRE(sum.blocks == std::set<uint32_t>{0x8001'0040, 0x8001'0044,
+                                             0x8001'004c, 0x8001'0058});
+
+    const std::string code = recompiler.Emit("RegisterTest");
+    REQUIRE(code.find("void RegisterTest(Meeps::StaticProgram<Meeps::"
+                      "PointerMemory> &program)") != std::string::npos);
+    REQUIRE(code.find("program.Add(0x80010044, &Function_80010040);") !=
+            std::string::npos);
+  }
+
+  SUBCASE("PS-X EXE") {
+    std::vector<uint8_t> file(0x800 + program.size() * 4);
+    std::memcpy(file.data(), "PS-X EXE", 8);
+    const uint32_t header[] = {0x8001'0000, 0, 0x8001'0000,
+                               (uint32_t)program.size() * 4};
+    std::memcpy(&file[0x10], header, sizeof(header));
+    std::memcpy(&file[0x800], program.data(), program.size() * 4);
+
+    const GuestImage image = GuestImage::FromPSXExe(file);
+    REQUIRE(image.entry == 0x8001'0000);
+    REQUIRE(image.base == 0x8001'0000);
+    REQUIRE(image.Read(0x8001'0058).value == 0x03e00008);
+    REQUIRE(!image.Contains(0x8001'0060));
+
+    file[0] = 'X';
+    REQUIRE_THROWS_AS(GuestImage::FromPSXExe(file), std::invalid_argument);
+  }
+}
+
+// Generated by MeepsAOT from data/static_program.bin, a copy of program, at
+// build time (see CMakeLists.txt)
+void RegisterStaticProgram(StaticProgram<PageTableMemory> &program);
+
+TEST_CASE("Static Program") {
+  std::vector<uint8_t> ram(PageTable::PageSize);
+  std::memcpy(ram.data(), program.data(), program.size() * 4);
+
+  TestCOP0 cop0;
+  CPU<PageTableMemory> reference(CPUMode::Interpreter, &cop0);
+  CPU<PageTableMemory> cpu(CPUMode::Interpreter, &cop0);
+  for (auto *guest : {&reference, &cpu}) {
+    guest->GetState().pageTable.MapMemory(0x8001'0000, PageTable::PageSize,
+                                          ram.data());
+    guest->SetPC(0x8001'0000);
+  }
+
+  StaticProgram<PageTableMemory> compiled;
+  RegisterStaticProgram(compiled);
+  REQUIRE(compiled.GetEntryCount() == 8);
+
+  // Odd slices leave blocks that don't fit to the interpreter
+  bool matches = true;
+  for (int slice : {7, 1, 13, 3, 64, 5}) {
+    for (int i = 0; i < 200; i++) {
+      reference.Run(slice);
+      matches &= compiled.Run(cpu.GetState(), slice) == slice &&
+                 reference.GetState().gpr == cpu.GetState().gpr &&
+                 reference.GetState().pc == cpu.GetState().pc &&
+                 reference.GetState().nextPC == cpu.GetState().nextPC;
+    }
+  }
+  REQUIRE(matches);
+  REQUIRE(cpu.GetState().GetGPR(16) == 22100);
+
+  // Generated code is translated without guest exceptions
+  cpu.SetGuestExceptions(true);
+  REQUIRE_THROWS_AS(compiled.Run(cpu.GetState(), 10), std::invalid_argument);
+}